@@ -0,0 +1,159 @@
+/* 
+ * Author: Kamil S.
+ * Picks KERNEL_BANDWIDTH and AREA_RADIUS from the data itself, looking at a
+ * random sample so the cost doesn't grow with the size of the grid.
+ */
+
+#include "header/bandwidth_estimation.h"
+#include "header/spatial_hash.h"
+#include <algorithm>
+#include <random>
+
+#ifdef OMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+// A column whose range is below this fraction of the widest one's counts
+// as constant when sizing the search cells
+static const double DEGENERATE_RANGE = 1e-9;
+
+/*
+ * Draws options.sample_size points with replacement, or the whole grid
+ * if it's smaller than that.
+ */
+static void sample_points(Grid &points, const BandwidthEstimate &options, Grid &sample)
+{
+    if (points.size() <= options.sample_size)
+    {
+        sample = points;
+        return;
+    }
+
+    mt19937 generator(options.seed);
+    uniform_int_distribution<size_t> pick(0, points.size() - 1);
+    sample.reserve(options.sample_size);
+    for (size_t s = 0; s < options.sample_size; s++)
+        sample.push_back(points[pick(generator)]);
+}
+
+/*
+ * Mean over the sample of the distance to the (quantile * sample size)-th
+ * nearest sampled point, i.e. the radius that holds 'quantile' of the data
+ * around a typical point. The searches use a SpatialHash over the sample
+ * with about one point per cell, and run in parallel in the OMP build.
+ */
+static double knn_quantile_bandwidth(Grid &sample, double quantile)
+{
+    int sample_size = sample.size();
+    size_t k = max<size_t>(1, static_cast<size_t>(quantile * sample_size));
+    k = min<size_t>(k, sample_size - 1);
+
+    MinMaxData data;
+    get_grid_min_max(data, &sample);
+    int dimensions = data.mins.size();
+    double largest = 0;
+    for (int p = 0; p < dimensions; p++)
+        largest = max(largest, data.maxs[p] - data.mins[p]);
+
+    // Columns (nearly) constant in the sample don't spread the points, the
+    // cells are sized as if they weren't there
+    double volume = 1;
+    int spread = 0;
+    for (int p = 0; p < dimensions; p++)
+    {
+        double range = data.maxs[p] - data.mins[p];
+        if (range > largest * DEGENERATE_RANGE)
+        {
+            volume *= range;
+            spread++;
+        }
+    }
+    double cell_size = spread > 0 ? pow(volume / sample_size, 1.0 / spread) : 1.0;
+
+    SpatialHash index(cell_size);
+    for (int s = 0; s < sample_size; s++)
+        index.insert(sample[s], s);
+
+    // Summed afterwards in sample order so the estimate has the same bits
+    // for any number of threads
+    vector<double> distances(sample_size);
+#ifdef OMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+    for (int s = 0; s < sample_size; s++)
+        distances[s] = index.kth_nearest_distance(sample[s], k);
+
+    double total = 0;
+    for (double distance : distances)
+        total += distance;
+
+    return total / sample_size;
+}
+
+/*
+ * Scott's and Silverman's rules of thumb, h = c * sigma * n^(-1 / (d + 4)),
+ * with sigma the standard deviation averaged over the dimensions and n the
+ * size of the whole grid, not of the sample.
+ */
+static double rule_of_thumb_bandwidth(Grid &sample, size_t n, BandwidthRule rule)
+{
+    int dimensions = sample[0].size();
+    Coord mean(dimensions, 0.0), squares(dimensions, 0.0);
+    for (Coord &coord : sample)
+    {
+        for (int p = 0; p < dimensions; p++)
+        {
+            mean[p] += coord[p];
+            squares[p] += coord[p] * coord[p];
+        }
+    }
+
+    double sigma = 0;
+    for (int p = 0; p < dimensions; p++)
+    {
+        mean[p] /= sample.size();
+        sigma += sqrt(max(0.0, squares[p] / sample.size() - mean[p] * mean[p]));
+    }
+    sigma /= dimensions;
+
+    double factor = 1;
+    if (rule == BANDWIDTH_SILVERMAN)
+        factor = pow(4.0 / (dimensions + 2), 1.0 / (dimensions + 4));
+
+    return factor * sigma * pow(static_cast<double>(n), -1.0 / (dimensions + 4));
+}
+
+/*
+ * @param points The whole grid
+ * @param options Which rule to use and how big a sample to look at
+ * @return Returns the estimated kernel bandwidth, or 0 for an empty grid.
+ */
+double estimate_bandwidth(Grid &points, const BandwidthEstimate &options)
+{
+    if (points.size() < 2)
+        return 0;
+
+    Grid sample;
+    sample_points(points, options, sample);
+
+    if (options.rule == BANDWIDTH_KNN_QUANTILE)
+        return knn_quantile_bandwidth(sample, options.quantile);
+    return rule_of_thumb_bandwidth(sample, points.size(), options.rule);
+}
+
+/*
+ * @param points The whole grid
+ * @param options Which rule to use and how big a sample to look at
+ * Sets KERNEL_BANDWIDTH to estimate_bandwidth() and AREA_RADIUS to
+ * options.radius_ratio times that, in place of the first row of the CSV.
+ */
+void estimate_parameters(Grid &points, const BandwidthEstimate &options)
+{
+    KERNEL_BANDWIDTH = estimate_bandwidth(points, options);
+    AREA_RADIUS = options.radius_ratio * KERNEL_BANDWIDTH;
+}
@@ -0,0 +1,101 @@
+/* 
+ * Author: Kamil S.
+ * Compares mean_shift_parallel(), which merges per-thread partial sums,
+ * against accumulating into a shared numerator with '#pragma omp atomic'
+ * the way mean_shift() used to, and against its deterministic blocked
+ * reduction, at 1 to 64 threads.
+ * Usage: bench.o [points] [repetitions]
+ */
+
+#include "../header/mean_shift.h"
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+
+#ifdef OMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+#ifdef OMP
+static Coord mean_shift_atomic(Coord &x, Grid &points, double radius, double bandwidth, int threads)
+{
+    int numerator_size = x.size();
+    int points_size = points.size();
+    double radius_squared = radius * radius;
+    double denominator = 0;
+    Coord numerator(numerator_size, 0.0);
+
+#pragma omp parallel for reduction(+:denominator) num_threads(threads)
+    for (int i = 0; i < points_size; i++)
+    {
+        Coord &x_i = points[i];
+        double distance = squared_euclidean_distance(x, x_i);
+        if (distance > radius_squared)
+            continue;
+
+        double weight = gaussian_kernel(distance, bandwidth);
+        for (int p = 0; p < numerator_size; p++)
+        {
+            #pragma omp atomic
+            numerator[p] += (weight * x_i[p]);
+        }
+
+        denominator += weight;
+    }
+
+    for (double &num_i : numerator)
+        num_i /= denominator;
+
+    return numerator;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    int points_size = argc > 1 ? atoi(argv[1]) : 1000000;
+    int repetitions = argc > 2 ? atoi(argv[2]) : 10;
+
+    // Every point inside the window, so every point hits the accumulation
+    double radius = 1.0, bandwidth = 1.0;
+    stringstream csv;
+    csv << radius << " " << bandwidth;
+    mt19937 generator(0);
+    uniform_real_distribution<double> coordinate(-0.5, 0.5);
+    for (int i = 0; i < points_size; i++)
+        csv << "\n" << coordinate(generator) << " " << coordinate(generator);
+    Grid &points = grid_from_file(2, csv);
+
+    Coord center(2, 0.1);
+
+#ifdef OMP
+    printf("%8s %14s %14s %8s %20s\n", "threads", "atomic (ms)", "partial (ms)", "speedup",
+           "deterministic (ms)");
+    for (int threads = 1; threads <= 64; threads *= 2)
+    {
+        double start = omp_get_wtime();
+        for (int r = 0; r < repetitions; r++)
+            mean_shift_atomic(center, points, radius, bandwidth, threads);
+        double atomic = (omp_get_wtime() - start) / repetitions * 1000;
+
+        start = omp_get_wtime();
+        for (int r = 0; r < repetitions; r++)
+            mean_shift_parallel(center, points, threads);
+        double partial = (omp_get_wtime() - start) / repetitions * 1000;
+
+        start = omp_get_wtime();
+        for (int r = 0; r < repetitions; r++)
+            mean_shift_parallel(center, points, threads, true);
+        double deterministic = (omp_get_wtime() - start) / repetitions * 1000;
+
+        printf("%8d %14.3f %14.3f %7.2fx %20.3f\n", threads, atomic, partial, atomic / partial,
+               deterministic);
+    }
+#else
+    printf("Build with $(OMP) to compare the parallel reductions\n");
+#endif
+
+    delete &points;
+}
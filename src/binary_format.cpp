@@ -0,0 +1,175 @@
+/* 
+ * Author: Kamil S.
+ * Binary dataset format that loads without parsing: the points are mapped
+ * from the file and used where they are.
+ */
+
+#include "header/binary_format.h"
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+static size_t scalar_size(uint32_t type)
+{
+    return type == SCALAR_FLOAT32 ? sizeof(float) : sizeof(double);
+}
+
+/*
+ * @param path File to write, replaced if it exists
+ * @param points Points to store, all with the same number of dimensions
+ * @param area_radius AREA_RADIUS to store with them
+ * @param kernel_bandwidth KERNEL_BANDWIDTH to store with them
+ * @param type Scalar type to store, SCALAR_FLOAT32 halves the size but
+ *             rounds the points and can't be used in place
+ * The minimums and maximums of every column are computed on the way.
+ * Throws system_error if the file can't be written.
+ */
+void write_binary_dataset(const string &path, Grid &points, double area_radius,
+                          double kernel_bandwidth, ScalarType type)
+{
+    uint32_t dimensions = points.empty() ? 0 : points[0].size();
+
+    MinMaxData bounds;
+    bounds.mins.assign(dimensions, numeric_limits<double>::max());
+    bounds.maxs.assign(dimensions, numeric_limits<double>::lowest());
+    for (Coord &point : points)
+    {
+        for (uint32_t d = 0; d < dimensions; d++)
+        {
+            bounds.mins[d] = min(bounds.mins[d], point[d]);
+            bounds.maxs[d] = max(bounds.maxs[d], point[d]);
+        }
+    }
+
+    BinaryHeader header;
+    memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+    header.version = BINARY_VERSION;
+    header.scalar_type = type;
+    header.dimensions = dimensions;
+    header.count = points.size();
+    header.area_radius = area_radius;
+    header.kernel_bandwidth = kernel_bandwidth;
+    size_t bounds_end = sizeof(BinaryHeader) + 2 * dimensions * sizeof(double);
+    header.data_offset = (bounds_end + BINARY_ALIGNMENT - 1) / BINARY_ALIGNMENT * BINARY_ALIGNMENT;
+
+    ofstream out(path.c_str(), ios::binary | ios::trunc);
+    if (!out)
+        throw system_error(errno, system_category(), "open " + path);
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(bounds.mins.data()), dimensions * sizeof(double));
+    out.write(reinterpret_cast<const char *>(bounds.maxs.data()), dimensions * sizeof(double));
+    vector<char> padding(header.data_offset - bounds_end, 0);
+    out.write(padding.data(), padding.size());
+
+    vector<char> row(dimensions * scalar_size(type));
+    for (Coord &point : points)
+    {
+        if (type == SCALAR_FLOAT32)
+        {
+            float *values = reinterpret_cast<float *>(row.data());
+            for (uint32_t d = 0; d < dimensions; d++)
+                values[d] = static_cast<float>(point[d]);
+        }
+        else
+            memcpy(row.data(), point.data(), row.size());
+        out.write(row.data(), row.size());
+    }
+
+    out.flush();
+    if (!out)
+        throw system_error(errno, system_category(), "write " + path);
+}
+
+/*
+ * @param path Dataset written by write_binary_dataset()
+ */
+BinaryDataset::BinaryDataset(const string &path) : file(path)
+{
+    if (file.size() < sizeof(BinaryHeader))
+        throw runtime_error(path + ": too short for a dataset header");
+
+    memcpy(&stored, file.data(), sizeof(BinaryHeader));
+    if (memcmp(stored.magic, BINARY_MAGIC, sizeof(stored.magic)) != 0)
+        throw runtime_error(path + ": not a binary dataset");
+    if (stored.version != BINARY_VERSION)
+        throw runtime_error(path + ": unsupported version " + to_string(stored.version));
+    if (stored.scalar_type != SCALAR_FLOAT64 && stored.scalar_type != SCALAR_FLOAT32)
+        throw runtime_error(path + ": unknown scalar type " + to_string(stored.scalar_type));
+
+    // checked by dividing, count * row could wrap around
+    size_t bounds_end = sizeof(BinaryHeader) + 2 * (size_t)stored.dimensions * sizeof(double);
+    size_t row = (size_t)stored.dimensions * scalar_size(stored.scalar_type);
+    if (bounds_end > file.size() || stored.data_offset < bounds_end || stored.data_offset % BINARY_ALIGNMENT != 0
+        || file.size() < stored.data_offset
+        || (stored.count > 0
+            && (row == 0 || stored.count > (file.size() - stored.data_offset) / row)))
+        throw runtime_error(path + ": truncated or corrupt dataset");
+
+    const double *stored_bounds = reinterpret_cast<const double *>(file.data() + sizeof(BinaryHeader));
+    bounds.mins.assign(stored_bounds, stored_bounds + stored.dimensions);
+    bounds.maxs.assign(stored_bounds + stored.dimensions,
+                       stored_bounds + 2 * (size_t)stored.dimensions);
+
+    const char *data = file.data() + stored.data_offset;
+    if (stored.scalar_type == SCALAR_FLOAT64)
+    {
+        points = PointView(reinterpret_cast<const double *>(data), stored.count, stored.dimensions);
+        return;
+    }
+
+    const float *values = reinterpret_cast<const float *>(data);
+    widened.assign(values, values + stored.count * stored.dimensions);
+    points = PointView(widened.data(), stored.count, stored.dimensions);
+}
+
+const BinaryHeader &BinaryDataset::header() const
+{
+    return stored;
+}
+
+PointView BinaryDataset::view() const
+{
+    return points;
+}
+
+const MinMaxData &BinaryDataset::min_max() const
+{
+    return bounds;
+}
+
+/*
+ * Sets AREA_RADIUS and KERNEL_BANDWIDTH to the ones stored in the dataset
+ */
+void BinaryDataset::apply_parameters() const
+{
+    AREA_RADIUS = stored.area_radius;
+    KERNEL_BANDWIDTH = stored.kernel_bandwidth;
+}
+
+/*
+ * Copies the points into a Grid, for the code that needs one
+ */
+void BinaryDataset::to_grid(Grid &grid) const
+{
+    grid.resize(points.size);
+    for (size_t i = 0; i < points.size; i++)
+        grid[i].assign(points[i], points[i] + points.dimensions);
+}
+
+/*
+ * Same as get_grid_min_max() on the dataset's points, read from its header
+ * instead of scanning them.
+ */
+void get_grid_min_max(MinMaxData &data, const BinaryDataset &dataset)
+{
+    data = dataset.min_max();
+}
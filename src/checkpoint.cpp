@@ -0,0 +1,397 @@
+/*
+ * Author: Kamil S.
+ * Checkpoints for long clustering runs, so a preempted run picks up from
+ * its last checkpoint instead of starting over.
+ */
+
+#include "header/checkpoint.h"
+#include "header/job.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef OMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+/*
+ * CRC-32 of 'size' bytes, in pieces zlib's uInt can take
+ */
+static uint32_t crc_of(const void *data, size_t size, uint32_t crc = 0)
+{
+    const Bytef *bytes = static_cast<const Bytef *>(data);
+    while (size > 0)
+    {
+        uInt piece = size < (1u << 30) ? size : (1u << 30);
+        crc = crc32(crc, bytes, piece);
+        bytes += piece;
+        size -= piece;
+    }
+    return crc;
+}
+
+static void write_fully(int fd, const char *data, size_t size, const string &path)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw system_error(errno, system_category(), "write " + path);
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+/*
+ * @param seeds Starting points, one per seed
+ * @param points Points to shift over, they must stay alive and unchanged
+ *               for the whole run, and be the same when resuming
+ * @param checkpoint Where and how often to checkpoint, checkpoint.dataset
+ *                   is recorded so a checkpoint says what it was run over
+ * @param options Convergence threshold, iteration cap, bandwidth_scale and
+ *                an optional control, which is counted into and stops the
+ *                run between rounds once cancelled
+ * Throws invalid_argument if options ask for acceleration or snapping.
+ */
+CheckpointedRun::CheckpointedRun(Grid &seeds, const PointView &points,
+                                 const CheckpointOptions &checkpoint, const ShiftOptions &options)
+    : points(points), checkpoint(checkpoint), options(options), dimensions(points.dimensions),
+      positions(seeds), shifted(seeds.size()), iterations_done(seeds.size(), 0),
+      running(seeds.size(), 1), rounds_done(0), writing(false), closing(false), written(0)
+{
+    if (options.acceleration != ACCEL_NONE || options.snap_to_modes)
+        throw invalid_argument("checkpointed runs support neither acceleration nor snapping");
+
+    points_crc = crc_of(points.data, points.size * points.dimensions * sizeof(double));
+    seeds_crc = 0;
+    for (Coord &seed : seeds)
+        seeds_crc = crc_of(seed.data(), seed.size() * sizeof(double), seeds_crc);
+
+    writer = thread(&CheckpointedRun::write_checkpoints, this);
+}
+
+/*
+ * Waits for a checkpoint being written, not for one still waiting
+ */
+CheckpointedRun::~CheckpointedRun()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+        pending.clear();
+        changed.notify_all();
+    }
+    writer.join();
+}
+
+/*
+ * Loads checkpoint.path if there is one. Returns false if there isn't,
+ * throws runtime_error if it's corrupt or was written for other points,
+ * seeds or parameters, leaving the run as it was.
+ */
+bool CheckpointedRun::resume()
+{
+    FILE *file = fopen(checkpoint.path.c_str(), "rb");
+    if (!file)
+    {
+        if (errno == ENOENT)
+            return false;
+        throw system_error(errno, system_category(), "open " + checkpoint.path);
+    }
+
+    string problem;
+    CheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+        problem = "not a checkpoint";
+    else if (header.version != CHECKPOINT_VERSION)
+        problem = "unsupported version " + to_string(header.version);
+    else if (header.points != points.size || header.dimensions != (uint32_t)dimensions
+             || header.points_crc != points_crc)
+        problem = "written for other points";
+    else if (header.seeds != positions.size() || header.seeds_crc != seeds_crc)
+        problem = "written for other seeds";
+    else if (header.area_radius != AREA_RADIUS || header.kernel_bandwidth != KERNEL_BANDWIDTH
+             || header.epsilon != options.epsilon
+             || header.bandwidth_scale != options.bandwidth_scale
+             || header.max_iterations != options.max_iterations)
+        problem = "written with other parameters";
+    else
+    {
+        // read aside, so a truncated file leaves the run untouched
+        size_t seeds = positions.size(), row = dimensions;
+        Grid stored_positions(seeds, Coord(row)), stored_shifted(seeds, Coord(row));
+        vector<int32_t> stored_iterations(seeds);
+        vector<char> stored_running(seeds);
+        bool complete = fseek(file, header.dataset_length, SEEK_CUR) == 0;
+        for (size_t s = 0; s < seeds && complete; s++)
+            complete = fread(stored_positions[s].data(), sizeof(double), row, file) == row
+                       && fread(stored_shifted[s].data(), sizeof(double), row, file) == row;
+        complete = complete
+                   && fread(stored_iterations.data(), sizeof(int32_t), seeds, file) == seeds
+                   && fread(stored_running.data(), 1, seeds, file) == seeds;
+        if (complete)
+        {
+            positions.swap(stored_positions);
+            shifted.swap(stored_shifted);
+            iterations_done.assign(stored_iterations.begin(), stored_iterations.end());
+            running.swap(stored_running);
+            rounds_done = header.rounds;
+        }
+        else
+            problem = "truncated";
+    }
+    fclose(file);
+
+    if (!problem.empty())
+        throw runtime_error(checkpoint.path + ": " + problem);
+    return true;
+}
+
+/*
+ * One round of a seed: up to steps_per_round steps, stopping when it
+ * converges. The steps and the checks between them are shift_to_mode()'s.
+ */
+void CheckpointedRun::step(size_t seed)
+{
+    double epsilon_squared = options.epsilon * options.epsilon;
+    Coord &x = positions[seed];
+    int &iterations = iterations_done[seed];
+
+    for (int s = 0; s < max(checkpoint.steps_per_round, 1); s++)
+    {
+        if (iterations == 0)
+        {
+            shift_point(x, points, options, shifted[seed]);
+            iterations = 1;
+            continue;
+        }
+
+        if (iterations >= options.max_iterations)
+        {
+            running[seed] = 0;
+            report_converged(options, seed, x, iterations);
+            return;
+        }
+        if (squared_euclidean_distance(x, shifted[seed]) <= epsilon_squared)
+        {
+            x = shifted[seed];
+            running[seed] = 0;
+            report_converged(options, seed, x, iterations);
+            return;
+        }
+
+        x = shifted[seed];
+        shift_point(x, points, options, shifted[seed]);
+        iterations++;
+    }
+}
+
+/*
+ * @param modes Filled with the mode each seed converged to, in seed order
+ * @param iterations Filled with the iterations each seed needed
+ * Runs rounds until every seed has converged, checkpointing every
+ * checkpoint.every_rounds rounds and once more at the end. In the OMP
+ * build the active seeds of a round are shared out over options.threads
+ * threads. Returns false if options.control was cancelled, after
+ * checkpointing where the seeds got to; 'modes' and 'iterations' are then
+ * left alone. Throws system_error if a checkpoint couldn't be written.
+ */
+bool CheckpointedRun::run(Grid &modes, vector<int> &iterations)
+{
+    vector<size_t> active_seeds;
+    while (true)
+    {
+        active_seeds.clear();
+        for (size_t s = 0; s < positions.size(); s++)
+            if (running[s])
+                active_seeds.push_back(s);
+        if (active_seeds.empty())
+            break;
+
+        if (options.control && options.control->cancelled.load(memory_order_relaxed))
+        {
+            save();
+            flush();
+            return false;
+        }
+
+        long active_size = active_seeds.size();
+#ifdef OMP
+        int threads = options.threads > 0 ? options.threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+        for (long a = 0; a < active_size; a++)
+            step(active_seeds[a]);
+
+        rounds_done++;
+        if (rounds_done % max(checkpoint.every_rounds, 1) == 0)
+            save();
+    }
+
+    save();
+    flush();
+    modes = positions;
+    iterations = iterations_done;
+    return true;
+}
+
+/*
+ * Copies the state of every seed into a checkpoint for the writer thread.
+ * A checkpoint the writer hasn't started on yet is replaced, only the
+ * latest one matters.
+ */
+void CheckpointedRun::save()
+{
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.dimensions = dimensions;
+    header.max_iterations = options.max_iterations;
+    header.seeds = positions.size();
+    header.points = points.size;
+    header.rounds = rounds_done;
+    header.points_crc = points_crc;
+    header.seeds_crc = seeds_crc;
+    header.area_radius = AREA_RADIUS;
+    header.kernel_bandwidth = KERNEL_BANDWIDTH;
+    header.epsilon = options.epsilon;
+    header.bandwidth_scale = options.bandwidth_scale;
+    header.dataset_length = checkpoint.dataset.size();
+
+    size_t row = dimensions * sizeof(double);
+    vector<char> bytes(sizeof(header) + checkpoint.dataset.size()
+                       + positions.size() * (2 * row + sizeof(int32_t) + 1));
+    char *out = bytes.data();
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    memcpy(out, checkpoint.dataset.data(), checkpoint.dataset.size());
+    out += checkpoint.dataset.size();
+    for (size_t s = 0; s < positions.size(); s++)
+    {
+        // a seed that hasn't moved yet has nowhere to shift to
+        shifted[s].resize(dimensions);
+        memcpy(out, positions[s].data(), row);
+        memcpy(out + row, shifted[s].data(), row);
+        out += 2 * row;
+    }
+    for (int iterations : iterations_done)
+    {
+        int32_t stored = iterations;
+        memcpy(out, &stored, sizeof(stored));
+        out += sizeof(stored);
+    }
+    memcpy(out, running.data(), running.size());
+
+    lock_guard<mutex> guard(lock);
+    if (failure)
+        rethrow_exception(failure);
+    pending.swap(bytes);
+    changed.notify_all();
+}
+
+/*
+ * Waits until every saved checkpoint is on disk
+ */
+void CheckpointedRun::flush()
+{
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [this] { return (pending.empty() && !writing) || failure; });
+    if (failure)
+        rethrow_exception(failure);
+}
+
+/*
+ * The writer thread. A checkpoint goes to a temporary file that is synced
+ * and then renamed over checkpoint.path, so a crash mid-write leaves the
+ * previous checkpoint in place.
+ */
+void CheckpointedRun::write_checkpoints()
+{
+    string temporary = checkpoint.path + ".tmp";
+    vector<char> bytes;
+    while (true)
+    {
+        {
+            unique_lock<mutex> guard(lock);
+            writing = false;
+            changed.notify_all();
+            changed.wait(guard, [this] { return !pending.empty() || closing; });
+            if (closing)
+                return;
+            bytes.swap(pending);
+            pending.clear();
+            writing = true;
+        }
+
+        try
+        {
+            int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                throw system_error(errno, system_category(), "open " + temporary);
+            try
+            {
+                write_fully(fd, bytes.data(), bytes.size(), temporary);
+                if (fsync(fd) != 0)
+                    throw system_error(errno, system_category(), "fsync " + temporary);
+            }
+            catch (...)
+            {
+                close(fd);
+                throw;
+            }
+            if (close(fd) != 0)
+                throw system_error(errno, system_category(), "close " + temporary);
+            if (rename(temporary.c_str(), checkpoint.path.c_str()) != 0)
+                throw system_error(errno, system_category(), "rename " + temporary);
+
+            lock_guard<mutex> guard(lock);
+            written++;
+        }
+        catch (...)
+        {
+            lock_guard<mutex> guard(lock);
+            failure = current_exception();
+        }
+    }
+}
+
+long CheckpointedRun::rounds() const
+{
+    return rounds_done;
+}
+
+/*
+ * Checkpoints written so far
+ */
+int CheckpointedRun::checkpoints() const
+{
+    lock_guard<mutex> guard(lock);
+    return written;
+}
+
+/*
+ * Seeds that haven't converged yet
+ */
+size_t CheckpointedRun::active() const
+{
+    size_t active_seeds = 0;
+    for (char seed_running : running)
+        active_seeds += seed_running;
+    return active_seeds;
+}
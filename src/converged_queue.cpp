@@ -0,0 +1,82 @@
+/* 
+ * Author: Kamil S.
+ * Queue that seeds are published to as they converge, so results can be
+ * consumed while the rest of the run goes on.
+ */
+
+#include "header/converged_queue.h"
+#include <thread>
+
+using namespace std;
+
+/*
+ * @param capacity Minimum number of seeds the queue holds, rounded up to a
+ *                 power of two
+ */
+ConvergedQueue::ConvergedQueue(size_t capacity) : enqueue_position(0), dequeue_position(0)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+
+    slots = vector<Slot>(size);
+    for (size_t i = 0; i < size; i++)
+        slots[i].sequence.store(i, memory_order_relaxed);
+    mask = size - 1;
+}
+
+/*
+ * Returns false without waiting if the queue is full. Safe to call from
+ * any number of threads.
+ */
+bool ConvergedQueue::try_push(const ConvergedSeed &seed)
+{
+    size_t position = enqueue_position.load(memory_order_relaxed);
+    Slot *slot;
+    while (true)
+    {
+        slot = &slots[position & mask];
+        size_t sequence = slot->sequence.load(memory_order_acquire);
+        long lap = (long)(sequence - position);
+        if (lap == 0)
+        {
+            if (enqueue_position.compare_exchange_weak(position, position + 1,
+                                                       memory_order_relaxed))
+                break;
+        }
+        else if (lap < 0)
+            return false;
+        else
+            position = enqueue_position.load(memory_order_relaxed);
+    }
+
+    slot->seed = seed;
+    slot->sequence.store(position + 1, memory_order_release);
+    return true;
+}
+
+void ConvergedQueue::push(const ConvergedSeed &seed)
+{
+    while (!try_push(seed))
+        this_thread::yield();
+}
+
+/*
+ * Returns false if nothing has been published yet. Only one thread may pop.
+ */
+bool ConvergedQueue::try_pop(ConvergedSeed &seed)
+{
+    Slot &slot = slots[dequeue_position & mask];
+    if (slot.sequence.load(memory_order_acquire) != dequeue_position + 1)
+        return false;
+
+    seed = move(slot.seed);
+    slot.sequence.store(dequeue_position + mask + 1, memory_order_release);
+    dequeue_position++;
+    return true;
+}
+
+size_t ConvergedQueue::capacity() const
+{
+    return mask + 1;
+}
@@ -0,0 +1,312 @@
+/* 
+ * Author: Kamil S.
+ * CSV parsing for grid_from_file(), split in line-aligned chunks that are
+ * parsed in parallel straight into a pre-sized grid.
+ */
+
+#include "header/csv.h"
+#include <algorithm>
+#include <cstring>
+#include <locale>
+#include <sstream>
+
+#ifdef OMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+/*
+ * Chunks are at least this big, smaller ones aren't worth a thread
+ */
+static const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+/*
+ * Powers of ten that are exact doubles
+ */
+static const double EXACT_POWERS[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+CsvError::CsvError(size_t line, const string &problem)
+    : runtime_error("line " + to_string(line) + ": " + problem), line_number(line)
+{
+}
+
+size_t CsvError::line() const
+{
+    return line_number;
+}
+
+static inline bool is_separator(char c)
+{
+    return c == ' ' || c == ',' || c == '\t' || c == ';' || c == '\r';
+}
+
+static inline bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/*
+ * Slow path for numbers the fast one can't round exactly, parsed in the
+ * classic locale so the result doesn't depend on the user's.
+ */
+static bool parse_double_slow(const char *begin, const char *end, double &value)
+{
+    istringstream token(string(begin, end));
+    token.imbue(locale::classic());
+    token >> value;
+    return !token.fail() && token.peek() == char_traits<char>::eof();
+}
+
+/*
+ * @param cursor Start of the number, moved past it
+ * @param end End of the buffer
+ * @param value Set to the number
+ * Parses [+-]digits[.digits][(e|E)[+-]digits] without allocating or looking
+ * at the locale. When the digits fit in 53 bits and the power of ten is
+ * exact, one multiplication or division rounds correctly (Clinger's fast
+ * path), so it gives the same bits as strtod(). Anything else goes through
+ * the standard library. Returns false if it isn't a number followed by a
+ * separator or the end of the line.
+ */
+bool parse_double(const char *&cursor, const char *end, double &value)
+{
+    const char *begin = cursor, *p = cursor;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    unsigned long long mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any_digit = false, exact = true;
+    for (; p < end && is_digit(*p); p++)
+    {
+        any_digit = true;
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa)
+                digits++;
+        }
+        else
+        {
+            exact = false;
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && is_digit(*p); p++)
+        {
+            any_digit = true;
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa)
+                    digits++;
+                exponent--;
+            }
+            else
+                exact = false;
+        }
+    }
+    if (!any_digit)
+        return false;
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        bool negative_exponent = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative_exponent = *p++ == '-';
+        if (p == end || !is_digit(*p))
+            return false;
+
+        int explicit_exponent = 0;
+        for (; p < end && is_digit(*p); p++)
+            explicit_exponent = min(explicit_exponent * 10 + (*p - '0'), 100000);
+        exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+    }
+
+    if (p < end && !is_separator(*p) && *p != '\n')
+        return false;
+    cursor = p;
+
+    if (exact && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double result = static_cast<double>(mantissa);
+        result = exponent < 0 ? result / EXACT_POWERS[-exponent] : result * EXACT_POWERS[exponent];
+        value = negative ? -result : result;
+        return true;
+    }
+
+    return parse_double_slow(begin, p, value);
+}
+
+/*
+ * Parses one line into 'values', at most 'capacity' of them.
+ * Returns how many there were, or -1 if one isn't a number.
+ */
+static int parse_line(const char *&cursor, const char *end, double *values, int capacity)
+{
+    int count = 0;
+    while (cursor < end && *cursor != '\n')
+    {
+        if (is_separator(*cursor))
+        {
+            cursor++;
+            continue;
+        }
+
+        double value;
+        if (!parse_double(cursor, end, value))
+            return -1;
+        if (count < capacity)
+            values[count] = value;
+        count++;
+    }
+    if (cursor < end)
+        cursor++;
+    return count;
+}
+
+static string describe(int found, int expected)
+{
+    if (found < 0)
+        return "not a number";
+    return "expected " + to_string(expected) + " values, found " + to_string(found);
+}
+
+struct Chunk {
+    const char *begin, *end;
+    size_t first_line, first_row, rows;
+    size_t error_line;
+    string error;
+};
+
+/*
+ * @param begin Start of the CSV text
+ * @param end End of the CSV text
+ * @param dimensions Values on every line
+ * @param grid The points are appended to it
+ * @param parameters Optional, if given the first line holds 2 values
+ *                   (AREA_RADIUS and KERNEL_BANDWIDTH) that go in it
+ * @param threads How many threads parse in the OMP build, OpenMP's default
+ *                if 0
+ * @param first_line Number of the first line, for the errors
+ * Values are separated by spaces, tabs, commas or semicolons, one point per
+ * line, blank lines are skipped. The text is cut in line-aligned chunks;
+ * a first pass counts the lines of every chunk so the grid is sized once
+ * and every chunk knows which rows it fills and which line it starts on.
+ * Throws a CsvError for the first malformed line.
+ */
+void parse_csv(const char *begin, const char *end, int dimensions, Grid &grid,
+               double *parameters, int threads, size_t first_line)
+{
+    const char *cursor = begin;
+    size_t line = first_line;
+    if (parameters)
+    {
+        int found = 0;
+        while (cursor < end && found == 0)
+        {
+            found = parse_line(cursor, end, parameters, 2);
+            if (found != 0 && found != 2)
+                throw CsvError(line, describe(found, 2));
+            line++;
+        }
+        if (found == 0)
+            throw CsvError(line, "missing AREA_RADIUS and KERNEL_BANDWIDTH");
+    }
+
+#ifdef OMP
+    if (threads <= 0)
+        threads = omp_get_max_threads();
+#else
+    threads = 1;
+#endif
+
+    size_t bytes = end - cursor;
+    size_t chunks_size = max((size_t)1, min((size_t)threads * 4, bytes / MIN_CHUNK_BYTES));
+    vector<Chunk> chunks(chunks_size);
+    for (size_t c = 0; c < chunks_size; c++)
+    {
+        chunks[c].begin = c == 0 ? cursor : chunks[c - 1].end;
+        const char *split = max(chunks[c].begin, cursor + bytes * (c + 1) / chunks_size);
+        if (c + 1 == chunks_size)
+            split = end;
+        else if (split < end)
+        {
+            const char *newline = static_cast<const char *>(memchr(split, '\n', end - split));
+            split = newline ? newline + 1 : end;
+        }
+        chunks[c].end = split;
+    }
+
+#ifdef OMP
+#pragma omp parallel for num_threads(threads)
+#endif
+    for (size_t c = 0; c < chunks_size; c++)
+    {
+        size_t lines = 0;
+        const char *p = chunks[c].begin;
+        while ((p = static_cast<const char *>(memchr(p, '\n', chunks[c].end - p))))
+        {
+            lines++;
+            p++;
+        }
+        if (chunks[c].end > chunks[c].begin && chunks[c].end[-1] != '\n')
+            lines++;
+        chunks[c].rows = lines;
+    }
+
+    size_t first_row = grid.size();
+    for (Chunk &chunk : chunks)
+    {
+        chunk.first_row = first_row;
+        chunk.first_line = line;
+        first_row += chunk.rows;
+        line += chunk.rows;
+    }
+    grid.resize(first_row);
+
+#ifdef OMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+    for (size_t c = 0; c < chunks_size; c++)
+    {
+        Chunk &chunk = chunks[c];
+        const char *p = chunk.begin;
+        size_t rows = 0;
+        Coord values(dimensions + 1);
+        for (size_t l = 0; p < chunk.end; l++)
+        {
+            int found = parse_line(p, chunk.end, values.data(), dimensions + 1);
+            if (found == 0)
+                continue;
+            if (found != dimensions)
+            {
+                chunk.error_line = chunk.first_line + l;
+                chunk.error = describe(found, dimensions);
+                break;
+            }
+            grid[chunk.first_row + rows++].assign(values.begin(), values.begin() + dimensions);
+        }
+        chunk.rows = rows;
+    }
+
+    size_t rows = chunks[0].first_row;
+    for (Chunk &chunk : chunks)
+    {
+        if (!chunk.error.empty())
+            throw CsvError(chunk.error_line, chunk.error);
+        if (rows != chunk.first_row)
+            for (size_t r = 0; r < chunk.rows; r++)
+                grid[rows + r].swap(grid[chunk.first_row + r]);
+        rows += chunk.rows;
+    }
+    grid.resize(rows);
+}
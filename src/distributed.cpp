@@ -0,0 +1,256 @@
+/* 
+ * Author: Kamil S.
+ * Mean shift over datasets spread across ranks that don't share memory,
+ * talking through a pluggable Transport.
+ */
+
+#include "header/distributed.h"
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+extern double AREA_RADIUS;
+
+/*
+ * Extra room on the halo so rounding in the distance can't miss a neighbor
+ */
+static const double HALO_MARGIN = 1e-9;
+
+/*
+ * A seed travels as origin rank, index there, iterations so far and position.
+ * Finished seeds go home the same way, with their mode as position.
+ */
+static const int SEED_HEADER = 3;
+
+static void pack_seed(Message &message, int origin, int index, int iterations, const Coord &x)
+{
+    message.push_back(origin);
+    message.push_back(index);
+    message.push_back(iterations);
+    message.insert(message.end(), x.begin(), x.end());
+}
+
+/*
+ * @param transport Connects this rank to the others
+ * @param sample_size Points per rank sampled to place the slab boundaries
+ */
+DistributedEngine::DistributedEngine(Transport &transport, int sample_size)
+    : transport(transport), sample_size(sample_size), dimensions(0), migrated(0), ghosts(0)
+{
+}
+
+/*
+ * Seeds this rank handed to another one during the last cluster()
+ */
+long DistributedEngine::migrations() const
+{
+    return migrated;
+}
+
+/*
+ * Points this rank held in its halo during the last cluster()
+ */
+size_t DistributedEngine::halo_size() const
+{
+    return ghosts;
+}
+
+/*
+ * Rank whose slab contains x
+ */
+int DistributedEngine::owner(const Coord &x) const
+{
+    return upper_bound(splitters.begin(), splitters.end(), x[0]) - splitters.begin();
+}
+
+/*
+ * Sends outgoing[r] to every rank r and fills incoming[r] with what rank r
+ * sent here. Every rank must call it the same number of times.
+ */
+void DistributedEngine::exchange(vector<Message> &outgoing, vector<Message> &incoming)
+{
+    int self = transport.rank();
+    int ranks = transport.ranks();
+    incoming.assign(ranks, Message());
+
+    for (int r = 0; r < ranks; r++)
+        if (r != self)
+            transport.send(r, outgoing[r]);
+
+    for (int r = 0; r < ranks; r++)
+    {
+        if (r == self)
+            incoming[r].swap(outgoing[r]);
+        else
+            transport.receive(r, incoming[r]);
+    }
+}
+
+/*
+ * Places the slab boundaries at quantiles of a sample of every rank's
+ * points, then sends every point to the rank owning it and to the ranks
+ * whose halo it's in. Points arrive in rank order, so the local points keep
+ * the order they have in the concatenation of every rank's points.
+ */
+void DistributedEngine::partition(Grid &seeds, Grid &points, double halo)
+{
+    int self = transport.rank();
+    int ranks = transport.ranks();
+    vector<Message> outgoing(ranks), incoming;
+
+    Message sample;
+    sample.push_back(!points.empty() ? points[0].size() : !seeds.empty() ? seeds[0].size() : 0);
+    size_t stride = max((size_t)1, points.size() / max(sample_size, 1));
+    for (size_t i = 0; i < points.size(); i += stride)
+        sample.push_back(points[i][0]);
+    outgoing.assign(ranks, sample);
+    exchange(outgoing, incoming);
+
+    dimensions = 0;
+    vector<double> values;
+    for (Message &message : incoming)
+    {
+        dimensions = max(dimensions, (int)message[0]);
+        values.insert(values.end(), message.begin() + 1, message.end());
+    }
+    sort(values.begin(), values.end());
+
+    splitters.assign(ranks - 1, 0.0);
+    for (int r = 0; r < ranks - 1 && !values.empty(); r++)
+        splitters[r] = values[(r + 1) * values.size() / ranks];
+
+    double infinity = numeric_limits<double>::infinity();
+    outgoing.assign(ranks, Message());
+    for (Coord &point : points)
+    {
+        for (int r = 0; r < ranks; r++)
+        {
+            double low = r == 0 ? -infinity : splitters[r - 1];
+            double high = r == ranks - 1 ? infinity : splitters[r];
+            if (point[0] >= low - halo && point[0] < high + halo)
+                outgoing[r].insert(outgoing[r].end(), point.begin(), point.end());
+        }
+    }
+    exchange(outgoing, incoming);
+
+    local.clear();
+    ghosts = 0;
+    for (Message &message : incoming)
+    {
+        for (size_t i = 0; i + dimensions <= message.size(); i += dimensions)
+        {
+            local.push_back(Coord(message.begin() + i, message.begin() + i + dimensions));
+            if (owner(local.back()) != self)
+                ghosts++;
+        }
+    }
+}
+
+/*
+ * @param seeds This rank's seeds
+ * @param points This rank's share of the points, any split of the dataset
+ * @param modes Filled with the mode each of this rank's seeds converged to
+ * @param iterations Filled with the iterations each of them needed
+ * Collective, every rank calls it at the same time. Seeds are stepped like
+ * plain shift_to_mode() with options.epsilon, max_iterations and
+ * bandwidth_scale, over the points in the order of the concatenation of
+ * every rank's points, so for the same points that gives the same bits as
+ * cluster_seeds() whatever the number of ranks. The other options need
+ * state shared between every seed or point and are ignored.
+ * Between rounds of local steps the ranks swap the seeds that left their
+ * slab, until a round moves none.
+ */
+void DistributedEngine::cluster(Grid &seeds, Grid &points, Grid &modes, vector<int> &iterations,
+                                const ShiftOptions &options)
+{
+    int self = transport.rank();
+    int ranks = transport.ranks();
+    double epsilon_squared = options.epsilon * options.epsilon;
+    partition(seeds, points, AREA_RADIUS * options.bandwidth_scale * (1 + HALO_MARGIN));
+
+    ShiftOptions step_options;
+    step_options.bandwidth_scale = options.bandwidth_scale;
+    step_options.control = options.control;
+
+    vector<Message> outgoing(ranks, Message(1, 0.0)), incoming, results(ranks);
+    for (size_t s = 0; s < seeds.size(); s++)
+    {
+        pack_seed(outgoing[owner(seeds[s])], self, s, 0, seeds[s]);
+        outgoing[0][0]++;
+    }
+    for (int r = 1; r < ranks; r++)
+        outgoing[r][0] = outgoing[0][0];
+
+    migrated = 0;
+    while (true)
+    {
+        exchange(outgoing, incoming);
+
+        double moving = 0;
+        for (Message &message : incoming)
+            moving += message[0];
+        if (moving == 0)
+            break;
+
+        outgoing.assign(ranks, Message(1, 0.0));
+        long leaving = 0;
+        for (Message &message : incoming)
+        {
+            for (size_t i = 1; i < message.size(); i += SEED_HEADER + dimensions)
+            {
+                int origin = message[i], index = message[i + 1], seed_iterations = message[i + 2];
+                Coord x(message.begin() + i + SEED_HEADER,
+                        message.begin() + i + SEED_HEADER + dimensions);
+
+                Coord shifted;
+                while (true)
+                {
+                    shift_point(x, local, step_options, shifted);
+                    seed_iterations++;
+                    if (seed_iterations >= max(options.max_iterations, 1))
+                    {
+                        pack_seed(results[origin], origin, index, seed_iterations, x);
+                        break;
+                    }
+                    if (squared_euclidean_distance(x, shifted) <= epsilon_squared)
+                    {
+                        pack_seed(results[origin], origin, index, seed_iterations, shifted);
+                        break;
+                    }
+
+                    x = shifted;
+                    int next = owner(x);
+                    if (next != self)
+                    {
+                        pack_seed(outgoing[next], origin, index, seed_iterations, x);
+                        leaving++;
+                        break;
+                    }
+                }
+            }
+        }
+
+        migrated += leaving;
+        for (int r = 0; r < ranks; r++)
+            outgoing[r][0] = leaving;
+    }
+
+    exchange(results, incoming);
+
+    modes.resize(seeds.size());
+    iterations.resize(seeds.size());
+    for (Message &message : incoming)
+    {
+        size_t record = SEED_HEADER + dimensions;
+        for (size_t i = 0; i < message.size(); i += record)
+        {
+            int index = message[i + 1];
+            iterations[index] = message[i + 2];
+            modes[index].assign(message.begin() + i + SEED_HEADER, message.begin() + i + record);
+        }
+    }
+
+    for (size_t s = 0; s < seeds.size(); s++)
+        report_converged(options, s, modes[s], iterations[s]);
+}
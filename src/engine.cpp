@@ -0,0 +1,236 @@
+/* 
+ * Author: Kamil S.
+ * Clustering driver that owns its threads, for callers that run many jobs
+ * or that aren't built with OMP.
+ */
+
+#include "header/engine.h"
+#include "header/mode_registry.h"
+#include <algorithm>
+#include <exception>
+
+using namespace std;
+
+extern double KERNEL_BANDWIDTH;
+
+/*
+ * Topology to build the pool with, NULL for a NUMA-unaware engine
+ */
+static const NumaTopology *detected(NumaTopology &topology, bool numa_aware)
+{
+    if (!numa_aware)
+        return NULL;
+
+    detect_numa_topology(topology);
+    return &topology;
+}
+
+/*
+ * @param threads How many workers the engine keeps, one per CPU if 0
+ * @param numa_aware Whether to pin workers to NUMA nodes and replicate the
+ *                   points on every node
+ */
+Engine::Engine(int threads, bool numa_aware)
+    : pool(threads, detected(topology, numa_aware)), replicated(NULL), running(NULL),
+      closing(false)
+{
+}
+
+/*
+ * Cancels the jobs that are still queued or running and waits for them,
+ * their handles get cancelled results.
+ */
+Engine::~Engine()
+{
+    {
+        lock_guard<mutex> lock(jobs_lock);
+        closing = true;
+        for (unique_ptr<PendingJob> &pending : jobs)
+            pending->control->cancelled.store(true);
+        if (running)
+            running->cancelled.store(true);
+    }
+    jobs_changed.notify_all();
+
+    if (dispatcher.joinable())
+        dispatcher.join();
+}
+
+/*
+ * Copies the points once per node from a thread pinned to that node, so
+ * under the default first-touch policy each copy lives in its node's memory.
+ */
+void Engine::replicate(Grid &points, vector<Grid> &replicas)
+{
+    replicas.resize(pool.nodes());
+    vector<thread> copiers;
+    for (int node = 0; node < pool.nodes(); node++)
+    {
+        copiers.push_back(thread([this, &points, &replicas, node] {
+            pin_current_thread(topology.node_cpus[node]);
+            replicas[node] = points;
+        }));
+    }
+
+    for (thread &copier : copiers)
+        copier.join();
+}
+
+/*
+ * The per-node copies of 'points'. They're made by the first job over the
+ * points and kept for the jobs after it, as long as the points are still
+ * the same; checking that reads them once, which is cheaper than copying
+ * them to every node again.
+ */
+shared_ptr<vector<Grid>> Engine::replicas_for(Grid &points)
+{
+    lock_guard<mutex> lock(replicas_lock);
+    if (!cached_replicas || replicated != &points || (*cached_replicas)[0] != points)
+    {
+        cached_replicas.reset();
+        shared_ptr<vector<Grid>> fresh = make_shared<vector<Grid>>();
+        replicate(points, *fresh);
+        cached_replicas = fresh;
+        replicated = &points;
+    }
+    return cached_replicas;
+}
+
+int Engine::threads() const
+{
+    return pool.size();
+}
+
+/*
+ * Same as cluster_seeds() but the seeds are tasks on the engine's pool,
+ * which splits and steals them so threads don't sit idle behind seeds that
+ * take long to converge. options.threads is ignored, the pool has its size.
+ * On more than one NUMA node every worker reads its own node's replica, and
+ * the seeds start out split in contiguous blocks, one per node. The
+ * replicas are kept for the next call over the same points.
+ * Like cluster_seeds(), results only depend on the thread count through
+ * snapping, which options.deterministic turns off.
+ * The basin shortcut depends on seed order, so that runs cluster_seeds().
+ * A cancelled options.control stops it the way it stops cluster_seeds().
+ */
+void Engine::cluster(Grid &seeds, Grid &points, Grid &modes, vector<int> &iterations,
+                     const ShiftOptions &options)
+{
+    if (options.basin_shortcut)
+    {
+        cluster_seeds(seeds, points, modes, iterations, options);
+        return;
+    }
+
+    if (options.deterministic && options.snap_to_modes)
+    {
+        ShiftOptions unsnapped = options;
+        unsnapped.snap_to_modes = false;
+        cluster(seeds, points, modes, iterations, unsnapped);
+        return;
+    }
+
+    int seeds_size = seeds.size();
+    modes.resize(seeds_size);
+    iterations.resize(seeds_size);
+
+    ModeRegistry known_modes(options.snap_to_modes ? seeds_size : 0);
+    double snap_radius = options.snap_fraction * KERNEL_BANDWIDTH;
+
+    shared_ptr<vector<Grid>> replicas;
+    if (pool.nodes() > 1)
+        replicas = replicas_for(points);
+
+    pool.parallel_for(0, seeds_size, 1, [&](int begin, int end) {
+        Grid &local = replicas ? (*replicas)[ThreadPool::current_node()] : points;
+        for (int s = begin; s < end; s++)
+        {
+            modes[s] = shift_to_mode(seeds[s], local, iterations[s], options, NULL, &known_modes);
+            if (cancelled(options))
+                continue;
+            if (options.snap_to_modes)
+                known_modes.add(modes[s], snap_radius);
+            report_converged(options, s, modes[s], iterations[s]);
+        }
+    });
+}
+
+/*
+ * Queues the job and returns at once. The handle gives the result when it's
+ * ready, the progress so far and a way to cancel. job.on_progress, if set,
+ * is called from the pool's threads every job.progress_every converged
+ * seeds (or every 1% of them if 0) and when the last one converges.
+ */
+JobHandle Engine::submit(const ClusterJob &job)
+{
+    unique_ptr<PendingJob> pending(new PendingJob());
+    pending->job = job;
+    pending->control = make_shared<JobControl>();
+
+    JobControl &control = *pending->control;
+    control.seeds_total = job.seeds.size();
+    control.on_progress = job.on_progress;
+    control.progress_every = job.progress_every > 0 ? job.progress_every
+                                                    : max(1L, control.seeds_total / 100);
+
+    JobHandle handle(pending->result.get_future().share(), pending->control);
+    {
+        lock_guard<mutex> lock(jobs_lock);
+        jobs.push_back(move(pending));
+        if (!dispatcher.joinable())
+            dispatcher = thread(&Engine::dispatch, this);
+    }
+    jobs_changed.notify_one();
+
+    return handle;
+}
+
+/*
+ * Dispatcher thread, started by the first submit(). Runs queued jobs until
+ * the engine is destroyed and the queue is empty.
+ */
+void Engine::dispatch()
+{
+    while (true)
+    {
+        unique_ptr<PendingJob> pending;
+        {
+            unique_lock<mutex> lock(jobs_lock);
+            jobs_changed.wait(lock, [this] { return closing || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            pending = move(jobs.front());
+            jobs.pop_front();
+            if (closing)
+                pending->control->cancelled.store(true);
+            running = pending->control.get();
+        }
+
+        ClusterResult result;
+        exception_ptr failure;
+        try
+        {
+            ShiftOptions options = pending->job.options;
+            options.control = pending->control.get();
+            result.modes = pending->job.seeds;
+            result.iterations.assign(result.modes.size(), 0);
+            if (!options.control->cancelled.load())
+                cluster(pending->job.seeds, *pending->job.points, result.modes,
+                        result.iterations, options);
+            result.cancelled = options.control->cancelled.load();
+        }
+        catch (...)
+        {
+            failure = current_exception();
+        }
+        {
+            lock_guard<mutex> lock(jobs_lock);
+            running = NULL;
+        }
+
+        if (failure)
+            pending->result.set_exception(failure);
+        else
+            pending->result.set_value(move(result));
+    }
+}
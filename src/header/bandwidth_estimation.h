@@ -0,0 +1,24 @@
+#pragma once
+
+#include "mean_shift.h"
+
+enum BandwidthRule {
+    BANDWIDTH_KNN_QUANTILE,
+    BANDWIDTH_SCOTT,
+    BANDWIDTH_SILVERMAN
+};
+
+struct BandwidthEstimate {
+    BandwidthRule rule;
+    double quantile;
+    size_t sample_size;
+    double radius_ratio;
+    unsigned seed;
+
+    BandwidthEstimate()
+        : rule(BANDWIDTH_KNN_QUANTILE), quantile(0.3), sample_size(1000),
+          radius_ratio(1.0), seed(0) {}
+};
+
+double estimate_bandwidth(Grid &points, const BandwidthEstimate &options = BandwidthEstimate());
+void estimate_parameters(Grid &points, const BandwidthEstimate &options = BandwidthEstimate());
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "mean_shift.h"
+#include "mapped_file.h"
+#include <cstdint>
+#include <string>
+
+enum ScalarType {
+    SCALAR_FLOAT64 = 0,
+    SCALAR_FLOAT32 = 1
+};
+
+/*
+ * On-disk header of a binary dataset, in the machine's byte order. It's
+ * followed by the per-column minimums and maximums (doubles), then, at
+ * data_offset (a multiple of BINARY_ALIGNMENT), the points one after
+ * another with 'dimensions' scalars each.
+ */
+struct BinaryHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t scalar_type;
+    uint32_t dimensions;
+    uint64_t count;
+    double area_radius;
+    double kernel_bandwidth;
+    uint64_t data_offset;
+};
+
+static const char BINARY_MAGIC[4] = {'M', 'S', 'D', 'S'};
+static const uint32_t BINARY_VERSION = 1;
+static const size_t BINARY_ALIGNMENT = 64;
+
+/*
+ * A binary dataset mapped from disk. Float64 points are used in place,
+ * float32 ones are widened once into memory owned by the dataset.
+ * Throws runtime_error if the file isn't a dataset this version can read.
+ */
+class BinaryDataset {
+public:
+    explicit BinaryDataset(const std::string &path);
+
+    const BinaryHeader &header() const;
+    PointView view() const;
+    const MinMaxData &min_max() const;
+    void apply_parameters() const;
+    void to_grid(Grid &grid) const;
+
+private:
+    MappedFile file;
+    BinaryHeader stored;
+    MinMaxData bounds;
+    std::vector<double> widened;
+    PointView points;
+};
+
+void write_binary_dataset(const std::string &path, Grid &points, double area_radius,
+                          double kernel_bandwidth, ScalarType type = SCALAR_FLOAT64);
+void get_grid_min_max(MinMaxData &data, const BinaryDataset &dataset);
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct CheckpointOptions {
+    std::string path;
+    std::string dataset;
+    int every_rounds;
+    int steps_per_round;
+
+    CheckpointOptions() : path("mean_shift.checkpoint"), every_rounds(10), steps_per_round(1) {}
+};
+
+/*
+ * On-disk header of a checkpoint, in the machine's byte order. It's
+ * followed by the dataset path (dataset_length chars), then for every seed
+ * its position and where it shifts to next ('dimensions' doubles each),
+ * its iterations (int32) and whether it's still active (one byte).
+ * The points themselves aren't stored, only their count and a CRC-32 to
+ * check a resumed run is given the same ones.
+ */
+struct CheckpointHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dimensions;
+    int32_t max_iterations;
+    uint64_t seeds;
+    uint64_t points;
+    uint64_t rounds;
+    uint32_t points_crc;
+    uint32_t seeds_crc;
+    double area_radius;
+    double kernel_bandwidth;
+    double epsilon;
+    double bandwidth_scale;
+    uint64_t dataset_length;
+};
+
+static const char CHECKPOINT_MAGIC[4] = {'M', 'S', 'C', 'P'};
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+/*
+ * Plain mean shift of 'seeds' over 'points' in rounds, each moving every
+ * active seed by up to steps_per_round steps. Every every_rounds rounds the
+ * state of all seeds is copied and written to checkpoint.path by a
+ * background thread while the next rounds run; the file is replaced
+ * atomically, so it always holds a whole checkpoint. A run resumed from it
+ * takes the seeds through the same steps, so its modes and iterations are
+ * the same bits as an uninterrupted run's, and as cluster_seeds() with the
+ * same options. Acceleration and snapping aren't supported.
+ */
+class CheckpointedRun {
+public:
+    CheckpointedRun(Grid &seeds, const PointView &points, const CheckpointOptions &checkpoint,
+                    const ShiftOptions &options = ShiftOptions());
+    ~CheckpointedRun();
+
+    bool resume();
+    bool run(Grid &modes, std::vector<int> &iterations);
+    long rounds() const;
+    int checkpoints() const;
+    size_t active() const;
+
+private:
+    CheckpointedRun(const CheckpointedRun &);
+    CheckpointedRun &operator=(const CheckpointedRun &);
+
+    void step(size_t seed);
+    void save();
+    void flush();
+    void write_checkpoints();
+
+    PointView points;
+    CheckpointOptions checkpoint;
+    ShiftOptions options;
+    int dimensions;
+    uint32_t points_crc;
+    uint32_t seeds_crc;
+
+    Grid positions;
+    Grid shifted;
+    std::vector<int> iterations_done;
+    std::vector<char> running;
+    long rounds_done;
+
+    mutable std::mutex lock;
+    std::condition_variable changed;
+    std::vector<char> pending;
+    bool writing;
+    bool closing;
+    int written;
+    std::exception_ptr failure;
+    std::thread writer;
+};
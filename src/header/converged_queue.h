@@ -0,0 +1,39 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <atomic>
+
+struct ConvergedSeed {
+    int index;
+    Coord mode;
+    int iterations;
+};
+
+/*
+ * Bounded lock-free queue of converged seeds, many producers and one consumer.
+ * Every slot carries a sequence number telling whose turn it is: producers
+ * claim a position with a CAS and publish the slot by bumping its sequence,
+ * the consumer takes it and hands the slot to the next lap. When the queue
+ * is full push() yields until the consumer makes room, so a run that
+ * publishes here needs someone draining it.
+ */
+class ConvergedQueue {
+public:
+    explicit ConvergedQueue(size_t capacity = 1024);
+
+    bool try_push(const ConvergedSeed &seed);
+    void push(const ConvergedSeed &seed);
+    bool try_pop(ConvergedSeed &seed);
+    size_t capacity() const;
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        ConvergedSeed seed;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_position;
+    alignas(64) size_t dequeue_position;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <stdexcept>
+#include <string>
+
+/*
+ * Malformed CSV, with the 1-based line it was found on
+ */
+class CsvError : public std::runtime_error {
+public:
+    CsvError(size_t line, const std::string &problem);
+
+    size_t line() const;
+
+private:
+    size_t line_number;
+};
+
+bool parse_double(const char *&cursor, const char *end, double &value);
+void parse_csv(const char *begin, const char *end, int dimensions, Grid &grid,
+               double *parameters = NULL, int threads = 0, size_t first_line = 1);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "mean_shift.h"
+#include "transport.h"
+
+/*
+ * One rank of a distributed clustering job. The points are partitioned in
+ * slabs along the first dimension, each rank also holding the points that
+ * lie within one radius of its slab (the halo), so a mean shift step from
+ * anywhere in the slab only needs local points. Seeds are stepped by the
+ * rank that owns their position and handed to the next one when a step
+ * takes them out of the slab.
+ */
+class DistributedEngine {
+public:
+    explicit DistributedEngine(Transport &transport, int sample_size = 1000);
+
+    void cluster(Grid &seeds, Grid &points, Grid &modes, std::vector<int> &iterations,
+                 const ShiftOptions &options = ShiftOptions());
+    long migrations() const;
+    size_t halo_size() const;
+
+private:
+    int owner(const Coord &x) const;
+    void exchange(std::vector<Message> &outgoing, std::vector<Message> &incoming);
+    void partition(Grid &seeds, Grid &points, double halo);
+
+    Transport &transport;
+    int sample_size;
+    std::vector<double> splitters;
+    Grid local;
+    int dimensions;
+    long migrated;
+    size_t ghosts;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "mean_shift.h"
+#include "job.h"
+#include "numa.h"
+#include "thread_pool.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/*
+ * Runs clustering jobs on a ThreadPool that lives as long as the engine,
+ * so the worker threads are started once and reused by every job.
+ * A NUMA-aware engine pins its workers to nodes and gives every node its
+ * own copy of the points, allocated and first touched on that node.
+ * Jobs handed to submit() run one at a time, in order, on a dispatcher
+ * thread, each using the whole pool.
+ */
+class Engine {
+public:
+    explicit Engine(int threads = 0, bool numa_aware = false);
+    ~Engine();
+
+    void cluster(Grid &seeds, Grid &points, Grid &modes, std::vector<int> &iterations,
+                 const ShiftOptions &options = ShiftOptions());
+    JobHandle submit(const ClusterJob &job);
+    int threads() const;
+
+private:
+    struct PendingJob {
+        ClusterJob job;
+        std::shared_ptr<JobControl> control;
+        std::promise<ClusterResult> result;
+    };
+
+    void replicate(Grid &points, std::vector<Grid> &replicas);
+    std::shared_ptr<std::vector<Grid>> replicas_for(Grid &points);
+    void dispatch();
+
+    NumaTopology topology;
+    ThreadPool pool;
+
+    std::mutex replicas_lock;
+    const Grid *replicated;
+    std::shared_ptr<std::vector<Grid>> cached_replicas;
+
+    std::mutex jobs_lock;
+    std::condition_variable jobs_changed;
+    std::deque<std::unique_ptr<PendingJob>> jobs;
+    JobControl *running;
+    bool closing;
+    std::thread dispatcher;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+
+struct JobProgress {
+    long seeds_converged;
+    long seeds_total;
+    long iterations;
+};
+
+typedef std::function<void(const JobProgress &)> ProgressCallback;
+
+/*
+ * Shared between a running job and whoever submitted it. The drivers count
+ * into it and stop between iterations once 'cancelled' is set. on_progress
+ * is called from worker threads, every 'progress_every' converged seeds and
+ * once more when the last one converges, so it must be thread safe.
+ */
+struct JobControl {
+    std::atomic<bool> cancelled;
+    std::atomic<long> seeds_converged;
+    std::atomic<long> iterations;
+    long seeds_total;
+    ProgressCallback on_progress;
+    long progress_every;
+
+    JobControl()
+        : cancelled(false), seeds_converged(0), iterations(0),
+          seeds_total(0), progress_every(1) {}
+
+    JobProgress progress() const;
+    void seed_converged();
+};
+
+/*
+ * A clustering job for Engine::submit(). The job keeps its own copy of the
+ * seeds, 'points' must stay alive until the job's result is ready.
+ */
+struct ClusterJob {
+    Grid seeds;
+    Grid *points;
+    ShiftOptions options;
+    ProgressCallback on_progress;
+    long progress_every;
+
+    ClusterJob() : points(NULL), progress_every(0) {}
+};
+
+/*
+ * Modes and iterations per seed, in seed order. In a cancelled job the
+ * modes are wherever the seeds had got to, seeds it never reached stay
+ * where they started with 0 iterations.
+ */
+struct ClusterResult {
+    Grid modes;
+    std::vector<int> iterations;
+    bool cancelled;
+
+    ClusterResult() : cancelled(false) {}
+};
+
+class JobHandle {
+public:
+    JobHandle(std::shared_future<ClusterResult> result, std::shared_ptr<JobControl> control);
+
+    const ClusterResult &get() const;
+    bool ready() const;
+    JobProgress progress() const;
+    void cancel();
+
+private:
+    std::shared_future<ClusterResult> result;
+    std::shared_ptr<JobControl> control;
+};
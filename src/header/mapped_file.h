@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+/*
+ * A whole file mapped read-only, unmapped when this goes away.
+ * Throws system_error if the file can't be opened or mapped.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+
+    const char *data() const;
+    size_t size() const;
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    void *mapping;
+    size_t bytes;
+};
@@ -1,22 +1,97 @@
+#pragma once
+
 #include <utility>
 #include <vector>
 #include <iostream>
+#include <string>
 #include <cmath>
 
 typedef std::vector<double> Coord;
 typedef std::vector<Coord> Grid;
 
+class ModeRegistry;
+struct VariableBandwidth;
+struct JobControl;
+class ConvergedQueue;
+
 struct MinMaxData {
     std::vector<double> mins;
     std::vector<double> maxs;
 };
 
+enum Acceleration {
+    ACCEL_NONE,
+    ACCEL_OVER_RELAXED,
+    ACCEL_ANDERSON
+};
+
+struct ShiftOptions {
+    int max_iterations;
+    double epsilon;
+    Acceleration acceleration;
+    double max_relaxation;
+    bool basin_shortcut;
+    double basin_fraction;
+    bool snap_to_modes;
+    double snap_fraction;
+    const VariableBandwidth *variable_bandwidth;
+    double bandwidth_scale;
+    int threads;
+    bool deterministic;
+    JobControl *control;
+    ConvergedQueue *converged;
+
+    ShiftOptions()
+        : max_iterations(300), epsilon(1e-5),
+          acceleration(ACCEL_NONE), max_relaxation(2.0),
+          basin_shortcut(false), basin_fraction(0.1),
+          snap_to_modes(false), snap_fraction(0.05),
+          variable_bandwidth(NULL), bandwidth_scale(1.0), threads(0),
+          deterministic(false), control(NULL),
+          converged(NULL) {}
+};
+
+/*
+ * Points stored contiguously, 'dimensions' doubles each, owned by someone
+ * else (a mapped file, shared memory, ...).
+ */
+struct PointView {
+    const double *data;
+    size_t size;
+    int dimensions;
+
+    PointView() : data(NULL), size(0), dimensions(0) {}
+    PointView(const double *data, size_t size, int dimensions)
+        : data(data), size(size), dimensions(dimensions) {}
+
+    const double *operator[](size_t i) const { return data + i * dimensions; }
+};
+
 void get_neighbors(Coord center, Grid &points, Grid &neighbors);
-Grid &grid_from_file(int dimensions = 2, std::istream &stream = std::cin);
+Grid &grid_from_file(int dimensions = 2, std::istream &stream = std::cin,
+                     bool has_parameters = true);
+Grid &grid_from_path(const std::string &path, int dimensions = 2, bool has_parameters = true);
 Coord mean_shift(Coord x, Grid &points);
-bool inside_circle(Coord p1, Coord p2, double radius);
-double squared_euclidean_distance(Coord p1, Coord p2);
+Coord mean_shift_parallel(Coord x, Grid &points, int threads = 0, bool deterministic = false);
+bool inside_circle(const Coord &p1, const Coord &p2, double radius);
+double squared_euclidean_distance(const Coord &p1, const Coord &p2);
 void get_grid_min_max(MinMaxData &data, Grid *grid);
+double kernel_density(Coord x, Grid &points);
+double shift_point(Coord &x, Grid &points, const ShiftOptions &options, Coord &shifted);
+double shift_point(Coord &x, const PointView &points, const ShiftOptions &options, Coord &shifted);
+Coord shift_to_mode(Coord x, Grid &points, int &iterations,
+                    const ShiftOptions &options = ShiftOptions(), Grid *trajectory = NULL,
+                    const ModeRegistry *known_modes = NULL);
+Coord shift_to_mode(Coord x, const PointView &points, int &iterations,
+                    const ShiftOptions &options = ShiftOptions(), Grid *trajectory = NULL,
+                    const ModeRegistry *known_modes = NULL);
+void report_converged(const ShiftOptions &options, int seed, const Coord &mode, int iterations);
+bool cancelled(const ShiftOptions &options);
+void cluster_seeds(Grid &seeds, Grid &points, Grid &modes, std::vector<int> &iterations,
+                   const ShiftOptions &options = ShiftOptions());
+void cluster_multiscale(Grid &seeds, Grid &points, Grid &modes, std::vector<int> &iterations,
+                        const ShiftOptions &options = ShiftOptions(), int levels = 2,
+                        double level_scale = 1.05);
 
 inline double gaussian_kernel(double x, double bandwidth) {
     return exp(x / (2 * (bandwidth * bandwidth)));
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <atomic>
+#include <mutex>
+
+/*
+ * Append-only set of confirmed modes shared between seeds.
+ * Readers never lock: a mode is written before 'count' is published, so
+ * any index below count() is fully initialized. Writers are serialized.
+ */
+class ModeRegistry {
+public:
+    explicit ModeRegistry(size_t capacity);
+
+    bool find_within(const Coord &point, double radius, Coord &mode) const;
+    bool add(const Coord &mode, double radius);
+    size_t size() const;
+
+private:
+    std::vector<Coord> modes;
+    std::atomic<size_t> count;
+    std::mutex writer;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "binary_format.h"
+#include "mapped_file.h"
+#include <string>
+#include <vector>
+
+/*
+ * A 2-D array of points read from a .npy file or from one member of a
+ * .npz archive. A 1-D array reads as one-dimensional points.
+ * Little-endian, C-ordered float64 data is used in place in the mapped
+ * file. Float32 data, deflated .npz members and members that aren't
+ * 8-byte aligned are expanded once into memory owned by the array.
+ * Throws runtime_error for any other dtype, order or shape.
+ */
+class NpyArray {
+public:
+    explicit NpyArray(const std::string &path);
+    NpyArray(const std::string &path, const std::string &member);
+
+    ScalarType type() const;
+    PointView view() const;
+    void to_grid(Grid &grid) const;
+
+private:
+    void open_member(const std::string &path, const std::string &member);
+    void parse(const char *data, size_t size, const std::string &where);
+
+    MappedFile file;
+    ScalarType scalar;
+    std::vector<char> inflated;
+    std::vector<double> widened;
+    PointView points;
+};
+
+std::string npy_header(ScalarType type, size_t rows, size_t columns);
+std::vector<std::string> npz_members(const std::string &path);
+void write_npy(const std::string &path, Grid &points, ScalarType type = SCALAR_FLOAT64);
+void write_npz(const std::string &path, const std::vector<std::string> &names,
+               const std::vector<Grid *> &arrays, bool compressed = false);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/*
+ * CPUs of every NUMA node that has any, in node id order, so node_cpus[n]
+ * is the n-th such node whatever its id. Machines without NUMA, or where
+ * it can't be read, show up as one node.
+ */
+struct NumaTopology {
+    std::vector<std::vector<int>> node_cpus;
+};
+
+void detect_numa_topology(NumaTopology &topology,
+                          const std::string &sysfs = "/sys/devices/system/node");
+bool pin_current_thread(const std::vector<int> &cpus);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "mean_shift.h"
+#include "spatial_hash.h"
+#include <vector>
+
+struct StreamOptions {
+    int dimensions;
+    size_t batch_size;
+    size_t window;
+    size_t queue_depth;
+    bool has_parameters;
+    double merge_radius;
+    ShiftOptions shift;
+
+    StreamOptions()
+        : dimensions(2), batch_size(256), window(1 << 16), queue_depth(4), has_parameters(true),
+          merge_radius(0) {}
+};
+
+/*
+ * A cluster whose size changed, with its mode. A size of 0 means the
+ * cluster has no points left in the window and its label is free again.
+ */
+struct ModeUpdate {
+    int label;
+    Coord mode;
+    size_t size;
+};
+
+/*
+ * How a run_stream() went. reader_waits counts the times the reader found
+ * the batch queue full and stopped reading, i.e. pushed back on the pipe.
+ */
+struct StreamStats {
+    size_t points;
+    size_t batches;
+    size_t clusters;
+    size_t reader_waits;
+
+    StreamStats() : points(0), batches(0), clusters(0), reader_waits(0) {}
+};
+
+/*
+ * Mean shift over an unbounded stream of points in bounded memory. The
+ * density is estimated over the last 'window' points, kept in a ring, and
+ * every new point is shifted to its mode over them. Modes within
+ * merge_radius (half of KERNEL_BANDWIDTH if 0) of a known cluster's mode
+ * join it, like label_modes(); the others start a new cluster. A cluster's
+ * size counts its points still in the window and its mode is the latest
+ * one found for it, so it follows the density as the window moves. A
+ * cluster with no points left in the window is dropped, so the clusters
+ * kept never outnumber the window.
+ */
+class OnlineEngine {
+public:
+    OnlineEngine(int dimensions, size_t window, double merge_radius = 0,
+                 const ShiftOptions &options = ShiftOptions());
+
+    void add(const Grid &batch, std::vector<ModeUpdate> &updates);
+    size_t points() const;
+    size_t clusters() const;
+
+private:
+    int dimensions;
+    size_t window;
+    double merge_radius;
+    ShiftOptions options;
+    void move_mode(int label, const Coord &mode);
+
+    std::vector<double> recent;
+    std::vector<int> labels;
+    size_t next;
+    SpatialHash index;
+    Grid modes;
+    std::vector<size_t> sizes;
+    std::vector<int> free_labels;
+};
+
+StreamStats run_stream(int input, int output, const StreamOptions &options = StreamOptions());
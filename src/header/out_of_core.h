@@ -0,0 +1,64 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <string>
+
+struct OutOfCoreOptions {
+    std::string directory;
+    size_t memory_budget;
+    double bandwidth_scale;
+    size_t sample_size;
+
+    OutOfCoreOptions()
+        : directory("."), memory_budget(size_t(1) << 30), bandwidth_scale(1.0),
+          sample_size(100000) {}
+};
+
+/*
+ * Mean shift over more points than fit in memory. The points are cut once
+ * into slabs along the first dimension, written to tile files in
+ * options.directory together with a halo one radius wide, and then
+ * clustered one tile at a time while the next one is read in the
+ * background. Only two tiles are in memory at a time, so tiles are sized
+ * for half of options.memory_budget, counting their points and the seeds
+ * made of them (a very dense slab can still exceed it). The tile files go
+ * in a directory of their own under options.directory, removed with them.
+ */
+class OutOfCoreEngine {
+public:
+    OutOfCoreEngine(const PointView &points, const OutOfCoreOptions &options = OutOfCoreOptions());
+    ~OutOfCoreEngine();
+
+    void cluster(const ShiftOptions &options = ShiftOptions(), Grid *modes = NULL,
+                 std::vector<int> *iterations = NULL);
+    int tiles() const;
+    size_t largest_tile() const;
+    long migrations() const;
+
+private:
+    struct SeedState {
+        size_t index;
+        int iterations;
+        Coord x;
+    };
+
+    OutOfCoreEngine(const OutOfCoreEngine &);
+    OutOfCoreEngine &operator=(const OutOfCoreEngine &);
+
+    int owner(double first_coordinate) const;
+    size_t seed_bytes() const;
+    std::string tile_path(int tile, const char *kind) const;
+    void remove_tiles() const;
+    void write_tiles(const PointView &points);
+    void load_tile(int tile, std::vector<double> &points, std::vector<SeedState> &seeds) const;
+
+    OutOfCoreOptions settings;
+    int dimensions;
+    size_t count;
+    double halo;
+    std::vector<double> splitters;
+    std::string tile_directory;
+    std::vector<size_t> tile_bytes;
+    std::vector<size_t> seed_counts;
+    long migrated;
+};
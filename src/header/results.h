@@ -0,0 +1,49 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <cstdint>
+#include <string>
+
+enum ResultsFormat {
+    RESULTS_CSV,
+    RESULTS_BINARY,
+    RESULTS_NPY
+};
+
+enum SyncPolicy {
+    SYNC_NONE,
+    SYNC_AT_CLOSE,
+    SYNC_EVERY_BATCH
+};
+
+struct WriteOptions {
+    ResultsFormat format;
+    SyncPolicy sync;
+    int threads;
+    size_t chunk_rows;
+
+    WriteOptions() : format(RESULTS_CSV), sync(SYNC_NONE), threads(0), chunk_rows(1 << 16) {}
+};
+
+/*
+ * On-disk header of binary results, followed by 'count' records of
+ * 'dimensions' doubles and two int32 values each.
+ */
+struct ResultsHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dimensions;
+    uint32_t columns;
+    uint64_t count;
+};
+
+static const char RESULTS_MAGIC[4] = {'M', 'S', 'R', 'S'};
+static const uint32_t RESULTS_VERSION = 1;
+
+void label_modes(Grid &modes, Grid &clusters, std::vector<int> &labels,
+                 std::vector<int> &sizes, double merge_radius = 0);
+size_t format_double(double value, char *buffer);
+void write_seed_results(const std::string &path, Grid &modes, std::vector<int> &labels,
+                        std::vector<int> &iterations, const WriteOptions &options = WriteOptions());
+void write_cluster_results(const std::string &path, Grid &clusters, std::vector<int> &sizes,
+                           const WriteOptions &options = WriteOptions());
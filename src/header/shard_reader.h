@@ -0,0 +1,76 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * A block of one shard, valid until it's given back with release()
+ */
+struct ShardBlock {
+    size_t slot;
+    size_t shard;
+    uint64_t offset;
+    const char *data;
+    size_t size;
+    bool last;
+};
+
+class UringQueue;
+
+/*
+ * Reads a set of files ("shards") in blocks, handing the blocks over as
+ * they complete. With io_uring (built WITH_URING, on a kernel that allows
+ * it) up to 'depth' reads are in flight at once across shards, into
+ * buffers registered with the kernel, so the caller works on one block
+ * while the others are read. Otherwise, or with use_uring false, the
+ * blocks are read one at a time with pread(). Blocks of a shard are issued
+ * in order but may complete out of order. Throws system_error if a shard
+ * can't be opened or read.
+ */
+class ShardReader {
+public:
+    ShardReader(const std::vector<std::string> &paths, size_t block_size = 1 << 20,
+                unsigned depth = 32, bool use_uring = true);
+    ~ShardReader();
+
+    bool next(ShardBlock &block);
+    void release(const ShardBlock &block);
+    bool uses_uring() const;
+
+private:
+    struct Slot {
+        std::vector<char> buffer;
+        size_t shard;
+        uint64_t offset;
+        size_t size;
+        size_t filled;
+        bool busy;
+    };
+
+    ShardReader(const ShardReader &);
+    ShardReader &operator=(const ShardReader &);
+
+    void open_shard(size_t shard);
+    void close_shard(size_t shard);
+    bool issue(size_t slot);
+    void read_slot(size_t slot);
+
+    std::vector<std::string> paths;
+    std::vector<int> fds;
+    std::vector<uint64_t> sizes;
+    std::vector<size_t> blocks_left;
+    size_t block_size;
+    size_t next_shard;
+    uint64_t next_offset;
+    std::vector<Slot> slots;
+    std::vector<size_t> completed;
+    size_t in_flight;
+    std::unique_ptr<UringQueue> uring;
+};
+
+Grid &grid_from_shards(const std::vector<std::string> &paths, int dimensions = 2,
+                       bool has_parameters = true, bool use_uring = true,
+                       size_t block_size = 1 << 20);
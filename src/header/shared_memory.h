@@ -0,0 +1,33 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <string>
+
+/*
+ * The points in a POSIX shared memory segment, copied in once by the
+ * coordinator and mapped read-only. Worker processes forked afterwards
+ * share the same physical pages, so memory use doesn't grow with them.
+ * The segment is unlinked as soon as it's mapped, it goes away with the
+ * last process that has it mapped.
+ */
+class SharedPoints {
+public:
+    explicit SharedPoints(const Grid &points);
+    ~SharedPoints();
+
+    PointView view() const;
+
+private:
+    SharedPoints(const SharedPoints &);
+    SharedPoints &operator=(const SharedPoints &);
+
+    void *mapping;
+    size_t bytes;
+    PointView points;
+};
+
+void *map_shared_segment(const std::string &tag, size_t bytes);
+size_t cluster_processes(Grid &seeds, const SharedPoints &points, Grid &modes,
+                         std::vector<int> &iterations,
+                         const ShiftOptions &options = ShiftOptions(), int workers = 0,
+                         int chunk = 16);
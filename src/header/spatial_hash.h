@@ -0,0 +1,39 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <unordered_map>
+#include <utility>
+
+/*
+ * Uniform grid of cells of side 'cell_size' over an N-dimensional space,
+ * stored sparsely in a hash map. Each stored point carries an int value.
+ */
+class SpatialHash {
+public:
+    explicit SpatialHash(double cell_size);
+
+    void insert(const Coord &point, int value);
+    bool remove(const Coord &point, int value);
+    bool find_within(const Coord &center, double radius, int &value) const;
+    void query(const Coord &center, double radius, std::vector<int> &values,
+               std::vector<double> *distances = NULL) const;
+    double kth_nearest_distance(const Coord &center, size_t k) const;
+    size_t size() const;
+    void clear();
+
+private:
+    typedef std::vector<long> Cell;
+
+    struct CellHash {
+        size_t operator()(const Cell &cell) const;
+    };
+
+    Cell cell_of(const Coord &point) const;
+
+    template <typename Visit>
+    void for_each_within(const Coord &center, double radius, Visit visit) const;
+
+    double cell_size;
+    size_t stored;
+    std::unordered_map<Cell, std::vector<std::pair<Coord, int>>, CellHash> cells;
+};
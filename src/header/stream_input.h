@@ -0,0 +1,23 @@
+#pragma once
+
+#include "mean_shift.h"
+#include <memory>
+
+/*
+ * A stream of bytes read in blocks, decompressed on the way if needed
+ */
+class BlockSource {
+public:
+    virtual ~BlockSource() {}
+
+    /*
+     * Fills up to 'size' bytes, returns how many, 0 only at the end.
+     * Throws runtime_error if the data is corrupt.
+     */
+    virtual size_t read(char *buffer, size_t size) = 0;
+};
+
+bool is_compressed(const char *data, size_t size);
+std::unique_ptr<BlockSource> open_block_source(std::istream &stream);
+void parse_csv_stream(BlockSource &source, int dimensions, Grid &grid,
+                      double *parameters = NULL, size_t block_size = 4 << 20);
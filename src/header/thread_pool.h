@@ -0,0 +1,71 @@
+#pragma once
+
+#include "numa.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+ * Fixed set of worker threads that run parallel_for() jobs. Every worker
+ * owns a deque of index ranges: it splits its range in halves, keeps
+ * working on the front half and pushes the back half onto its own deque,
+ * where idle workers steal from the other end. Ranges are only split while
+ * some worker is idle, so there's no splitting overhead when all are busy.
+ * Plain std::thread, so it doesn't need the OMP build.
+ * Given a NumaTopology, workers are spread evenly over the nodes in order,
+ * pinned to their node's CPUs, and steal from their own node first.
+ * Tasks mustn't call parallel_for() on the pool that runs them.
+ */
+class ThreadPool {
+public:
+    typedef std::function<void(int, int)> RangeTask;
+
+    explicit ThreadPool(int threads = 0, const NumaTopology *topology = NULL);
+    ~ThreadPool();
+
+    void parallel_for(int begin, int end, int grain, const RangeTask &task);
+    int size() const;
+    int nodes() const;
+    static int current_node();
+
+private:
+    typedef std::pair<int, int> Range;
+
+    struct alignas(64) Worker {
+        std::mutex lock;
+        std::deque<Range> ranges;
+        int node;
+    };
+
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    void work(int index, std::vector<int> cpus);
+    bool pop(int index, Range &range);
+    bool steal(int index, Range &range);
+    void push(int index, const Range &range);
+    void run(int index, Range range);
+
+    std::vector<Worker> workers;
+    std::vector<std::thread> threads;
+    int node_count;
+
+    std::mutex job_lock;
+    const RangeTask *task;
+    int grain;
+    std::atomic<int> remaining;
+    std::atomic<int> queued;
+    std::atomic<int> idle;
+    std::exception_ptr failure;
+
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping;
+};
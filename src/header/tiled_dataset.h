@@ -0,0 +1,73 @@
+#pragma once
+
+#include "mean_shift.h"
+#include "mapped_file.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * On-disk header of a tiled dataset, in the machine's byte order. It's
+ * followed by the block index: a TiledBlock for every block, then every
+ * block's bounding box (its minimums, then its maximums, 'dimensions'
+ * doubles each). The blocks' points (doubles) start at data_offset, every
+ * block on a TILED_ALIGNMENT boundary so no page holds two blocks.
+ */
+struct TiledHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dimensions;
+    uint32_t block_points;
+    uint64_t count;
+    uint64_t blocks;
+    double area_radius;
+    double kernel_bandwidth;
+    uint64_t data_offset;
+};
+
+struct TiledBlock {
+    uint64_t offset;
+    uint64_t count;
+};
+
+static const char TILED_MAGIC[4] = {'M', 'S', 'T', 'L'};
+static const uint32_t TILED_VERSION = 1;
+static const size_t TILED_ALIGNMENT = 4096;
+
+/*
+ * A tiled dataset mapped from disk. Nearby points are stored together in
+ * blocks, and a query only touches the blocks whose bounding box comes
+ * within its radius, so the pages of the others are never faulted in.
+ * Throws runtime_error if the file isn't a dataset this version can read.
+ */
+class TiledDataset {
+public:
+    explicit TiledDataset(const std::string &path);
+
+    const TiledHeader &header() const;
+    PointView block(size_t index) const;
+    void apply_parameters() const;
+    void to_grid(Grid &grid) const;
+
+    void blocks_within(const Coord &center, double radius, std::vector<size_t> &blocks) const;
+    void points_within(const Coord &center, double radius, Grid &points) const;
+    Coord shift_to_mode(Coord x, int &iterations,
+                        const ShiftOptions &options = ShiftOptions()) const;
+    size_t blocks_read() const;
+
+private:
+    TiledDataset(const TiledDataset &);
+    TiledDataset &operator=(const TiledDataset &);
+
+    void gather(const std::vector<size_t> &blocks, std::vector<double> &points) const;
+
+    MappedFile file;
+    TiledHeader stored;
+    const TiledBlock *index;
+    const double *boxes;
+    mutable std::atomic<size_t> touched;
+};
+
+void write_tiled_dataset(const std::string &path, Grid &points, double area_radius,
+                         double kernel_bandwidth, size_t block_points = 4096);
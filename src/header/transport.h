@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+typedef std::vector<double> Message;
+
+/*
+ * How the ranks of a DistributedEngine talk to each other. Messages between
+ * two ranks must arrive in the order they were sent, send() must not block
+ * waiting for the receiver.
+ */
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    virtual int rank() const = 0;
+    virtual int ranks() const = 0;
+    virtual void send(int to, const Message &message) = 0;
+    virtual void receive(int from, Message &message) = 0;
+};
+
+/*
+ * Mailboxes for 'ranks' ranks living in one process, one per ordered pair.
+ */
+class LoopbackNetwork {
+public:
+    explicit LoopbackNetwork(int ranks);
+
+    int ranks() const;
+    void post(int from, int to, const Message &message);
+    void collect(int from, int to, Message &message);
+
+private:
+    struct Mailbox {
+        std::mutex lock;
+        std::condition_variable arrived;
+        std::deque<Message> messages;
+    };
+
+    int size;
+    std::vector<Mailbox> mailboxes;
+};
+
+/*
+ * One rank's end of a LoopbackNetwork, to run every rank of a distributed
+ * job as a thread of one process.
+ */
+class LoopbackTransport : public Transport {
+public:
+    LoopbackTransport(LoopbackNetwork &network, int rank);
+
+    int rank() const;
+    int ranks() const;
+    void send(int to, const Message &message);
+    void receive(int from, Message &message);
+
+private:
+    LoopbackNetwork &network;
+    int own_rank;
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "mean_shift.h"
+#include "spatial_hash.h"
+
+typedef std::vector<double> Bandwidths;
+
+/*
+ * Per-point bandwidths for the sample point estimator, stored in the same
+ * order as the Grid they were computed from, plus an index over that Grid.
+ * Point i is a neighbor of x when it's within AREA_RADIUS scaled by
+ * bandwidths[i] / KERNEL_BANDWIDTH, so max_radius bounds every query.
+ */
+struct VariableBandwidth {
+    Bandwidths bandwidths;
+    double max_radius;
+    SpatialHash index;
+
+    VariableBandwidth() : max_radius(0), index(1.0) {}
+};
+
+void compute_point_bandwidths(Grid &points, VariableBandwidth &variable, int k = 16);
+void get_neighbors(const Coord &center, const VariableBandwidth &variable,
+                   std::vector<int> &neighbors);
+Coord mean_shift(Coord x, Grid &points, const VariableBandwidth &variable);
+double mean_shift_with_density(Coord &x, Grid &points, const VariableBandwidth &variable,
+                               Coord &shifted);
@@ -0,0 +1,60 @@
+/* 
+ * Author: Kamil S.
+ * Progress, cancellation and result handles for jobs submitted to an Engine.
+ */
+
+#include "header/job.h"
+#include <chrono>
+
+using namespace std;
+
+JobProgress JobControl::progress() const
+{
+    JobProgress progress;
+    progress.seeds_converged = seeds_converged.load(memory_order_relaxed);
+    progress.seeds_total = seeds_total;
+    progress.iterations = iterations.load(memory_order_relaxed);
+    return progress;
+}
+
+/*
+ * Called by the drivers once per finished seed
+ */
+void JobControl::seed_converged()
+{
+    long converged = seeds_converged.fetch_add(1, memory_order_relaxed) + 1;
+    if (on_progress && (converged % progress_every == 0 || converged == seeds_total))
+        on_progress(progress());
+}
+
+JobHandle::JobHandle(shared_future<ClusterResult> result, shared_ptr<JobControl> control)
+    : result(result), control(control)
+{
+}
+
+/*
+ * Blocks until the job is done, then returns its result
+ */
+const ClusterResult &JobHandle::get() const
+{
+    return result.get();
+}
+
+bool JobHandle::ready() const
+{
+    return result.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+
+JobProgress JobHandle::progress() const
+{
+    return control->progress();
+}
+
+/*
+ * Asks the job to stop. Seeds stop at their next iteration and the result
+ * is marked as cancelled. A job that hasn't started yet won't run at all.
+ */
+void JobHandle::cancel()
+{
+    control->cancelled.store(true, memory_order_relaxed);
+}
@@ -30,8 +30,11 @@ int main(int argc, char *argv[])
 
     for (int z = 0; z < 40; z++)
     {
-        for (auto &coord : test_points_grid)
-            coord = mean_shift(coord, grid);
+#ifdef OMP
+#pragma omp parallel for
+#endif
+        for (size_t c = 0; c < test_points_grid.size(); c++)
+            test_points_grid[c] = mean_shift(test_points_grid[c], grid);
 
         plt::clf(); //Can't remove just test_points_grid so it must all be redrawn
         plt::scatter(grid);
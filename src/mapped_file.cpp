@@ -0,0 +1,60 @@
+/* 
+ * Author: Kamil S.
+ * Read-only file mappings for the loaders, so the kernel pages data in as
+ * it's parsed instead of it being copied through a stream buffer.
+ */
+
+#include "header/mapped_file.h"
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+MappedFile::MappedFile(const string &path) : mapping(NULL), bytes(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw system_error(errno, system_category(), "open " + path);
+
+    struct stat status;
+    if (fstat(fd, &status) != 0)
+    {
+        int error = errno;
+        close(fd);
+        throw system_error(error, system_category(), "fstat " + path);
+    }
+
+    bytes = status.st_size;
+    if (bytes > 0)
+    {
+        mapping = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            int error = errno;
+            close(fd);
+            throw system_error(error, system_category(), "mmap " + path);
+        }
+        madvise(mapping, bytes, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (mapping)
+        munmap(mapping, bytes);
+}
+
+const char *MappedFile::data() const
+{
+    return static_cast<const char *>(mapping);
+}
+
+size_t MappedFile::size() const
+{
+    return bytes;
+}
@@ -4,8 +4,18 @@
  */
 
 #include "header/mean_shift.h"
+#include "header/spatial_hash.h"
+#include "header/mode_registry.h"
+#include "header/variable_bandwidth.h"
+#include "header/bandwidth_estimation.h"
+#include "header/job.h"
+#include "header/converged_queue.h"
+#include "header/csv.h"
+#include "header/mapped_file.h"
+#include "header/stream_input.h"
 #include "header/matplotlibcpp.h"
 #include <algorithm>
+#include <fstream>
 
 #ifdef OMP
 #include <omp.h>
@@ -16,6 +26,19 @@ using namespace std;
 double AREA_RADIUS;
 double KERNEL_BANDWIDTH;
 
+/*
+ * How many times more points each level of cluster_multiscale() uses than
+ * the coarser one before it, and how close to a mode (in bandwidths) the
+ * coarse levels take the seeds
+ */
+static const size_t SAMPLE_GROWTH = 4;
+static const double COARSE_EPSILON = 0.01;
+
+/*
+ * Points per block in the deterministic mean_shift_parallel() reduction
+ */
+static const int REDUCTION_BLOCK = 256;
+
 /*
  * @param center Checks for the neighbors of circle with center 'center'
  * @param points Reference to the whole grid
@@ -24,20 +47,23 @@ double KERNEL_BANDWIDTH;
  */
 void get_neighbors(Coord center, Grid &points, Grid &neighbors) 
 {
-#ifdef OMP
-    int points_size = points.size();
-#pragma omp declare reduction (merge : Grid : omp_out.insert(omp_out.end(), omp_in.begin(), omp_in.end()))
-#pragma omp parallel for reduction(merge: neighbors) num_threads(4)
-    for (int x = 0; x < points_size; x++) {
-        if (inside_circle(center, points[x], AREA_RADIUS)) {
-            neighbors.push_back(points[x]);
-        }
-    }
-#else
     for (Coord coord : points)
         if (inside_circle(center, coord, AREA_RADIUS))
             neighbors.push_back(coord);
-#endif
+}
+
+/*
+ * Sets the globals from the parameters row, or estimates them if there was none
+ */
+static void set_parameters(Grid &grid, bool has_parameters, double *parameters)
+{
+    if (has_parameters)
+    {
+        AREA_RADIUS = parameters[0];
+        KERNEL_BANDWIDTH = parameters[1];
+    }
+    else
+        estimate_parameters(grid);
 }
 
 /*
@@ -47,27 +73,62 @@ void get_neighbors(Coord center, Grid &points, Grid &neighbors)
  *               the file, if it isn't specified then the default value is std::cin.
  * Creates a new Grid in heap, populates it from the stream and then returns a 
  * reference to it. It's up to the callee to free it.
+ * @param has_parameters Optional parameter, if false the file has no AREA_RADIUS
+ *                       and KERNEL_BANDWIDTH row and they are estimated from
+ *                       the points with estimate_parameters() instead.
  * The file must be a CSV with each row being a different point and the first
  * row representing the AREA_RADIUS and KERNEL_BANDWIDTH
+ * gzip and zstd (if built WITH_ZSTD) input is decompressed on the fly.
+ * The stream goes through parse_csv_stream(), which throws a CsvError with
+ * the line number if a row is malformed.
  */
-Grid &grid_from_file(int dimensions, istream &stream)
+Grid &grid_from_file(int dimensions, istream &stream, bool has_parameters)
 {
     Grid *grid = new Grid();
-    stream >> AREA_RADIUS;
-    stream >> KERNEL_BANDWIDTH;
-    
-    double curr;
-    while (!stream.eof())
-    {
-        Coord coord;
-        for (int x = 0; x < dimensions; x++)
-        {
-            stream >> curr;
-            coord.push_back(curr);
-        }
-        grid->push_back(coord);
+    double parameters[2];
+    try
+    {
+        unique_ptr<BlockSource> source = open_block_source(stream);
+        parse_csv_stream(*source, dimensions, *grid, has_parameters ? parameters : NULL);
+    }
+    catch (...)
+    {
+        delete grid;
+        throw;
+    }
+
+    set_parameters(*grid, has_parameters, parameters);
+    return *grid;
+}
+
+/*
+ * Same as grid_from_file() but maps the file at 'path' and parses it in
+ * place, which is what large files should use. Compressed files are
+ * streamed through grid_from_file() instead.
+ */
+Grid &grid_from_path(const string &path, int dimensions, bool has_parameters)
+{
+    MappedFile file(path);
+    if (is_compressed(file.data(), file.size()))
+    {
+        ifstream stream(path.c_str(), ios::binary);
+        return grid_from_file(dimensions, stream, has_parameters);
     }
 
+    Grid *grid = new Grid();
+    double parameters[2];
+    try
+    {
+        parse_csv(file.data(), file.data() + file.size(), dimensions, *grid,
+                  has_parameters ? parameters : NULL);
+    }
+    catch (...)
+    {
+        delete grid;
+        throw;
+    }
+
+    set_parameters(*grid, has_parameters, parameters);
     return *grid;
 }
 
@@ -77,7 +138,7 @@ Grid &grid_from_file(int dimensions, istream &stream)
  * @param radius Radius of circle
  * The "circle" is actually an N-dimensional sphere
  */
-bool inside_circle(Coord p1, Coord p2, double radius) 
+bool inside_circle(const Coord &p1, const Coord &p2, double radius) 
 {
     assert(p1.size() == p2.size());
 
@@ -91,7 +152,7 @@ bool inside_circle(Coord p1, Coord p2, double radius)
 /*
  * https://en.wikipedia.org/wiki/Euclidean_distance#Squared_Euclidean_distance
  */
-double squared_euclidean_distance(Coord p1, Coord p2) 
+double squared_euclidean_distance(const Coord &p1, const Coord &p2) 
 {
     assert(p1.size() == p2.size());
 
@@ -124,36 +185,117 @@ Coord mean_shift(Coord x, Grid &points) {
     if (neighbors.size() == 0)
         return numerator;
 
-#ifdef OMP 
-    int neighbors_size = neighbors.size();
-#pragma omp parallel for reduction(+:denominator) num_threads(4)
-    for (int it = 0; it < neighbors_size; ++it) 
+    for (vector<Coord>::iterator it = neighbors.begin(); it != neighbors.end(); ++it) 
     {
-        Coord x_i = neighbors[it];
+        Coord x_i = *it;
         double distance = squared_euclidean_distance(x, x_i);
         double weight = gaussian_kernel(distance, KERNEL_BANDWIDTH);
 
         for (int p = 0; p < numerator_size; p++)
-        {
-            #pragma omp atomic
             numerator[p] += (weight * x_i[p]);
-        }
 
         denominator += weight;
     }
+
+    for (double &num_i : numerator)
+        num_i /= denominator;
+
+    return numerator;
+}
+
+/*
+ * Adds x_i's weighted coordinates and weight to partial[0..size] if it's
+ * inside the AREA_RADIUS window around x
+ */
+static inline void accumulate_neighbor(const Coord &x, const Coord &x_i, double radius_squared,
+                                       double *partial)
+{
+    double distance = squared_euclidean_distance(x, x_i);
+    if (distance > radius_squared)
+        return;
+
+    int numerator_size = x.size();
+    double weight = gaussian_kernel(distance, KERNEL_BANDWIDTH);
+    for (int p = 0; p < numerator_size; p++)
+        partial[p] += (weight * x_i[p]);
+    partial[numerator_size] += weight;
+}
+
+/*
+ * @param x Center point from with which to calculate the mean shift
+ * @param points The whole grid from which to calculate the neighbors
+ * @param threads How many threads to split the grid over, OpenMP's default if 0
+ * @param deterministic Whether the result must be the same bits for any threads
+ * @return Returns the Coord to where x should shift to.
+ * Same as mean_shift() but for when there are too few seeds to keep every
+ * thread busy, so the neighbors of a single point are split over threads
+ * instead. Each thread sums its numerator and denominator into its own
+ * cache lines, which are merged once at the end. Serial outside OMP builds.
+ * Deterministic runs sum fixed blocks of REDUCTION_BLOCK points instead, in
+ * point order, and merge the blocks pairwise in a fixed tree, so the order
+ * of every addition depends only on the number of points.
+ */
+Coord mean_shift_parallel(Coord x, Grid &points, int threads, bool deterministic)
+{
+    int numerator_size = x.size();
+    int points_size = points.size();
+    double radius_squared = AREA_RADIUS * AREA_RADIUS;
+
+#ifdef OMP
+    if (threads <= 0)
+        threads = omp_get_max_threads();
 #else
-    for (vector<Coord>::iterator it = neighbors.begin(); it != neighbors.end(); ++it) 
-    {
-        Coord x_i = *it;
-        double distance = squared_euclidean_distance(x, x_i);
-        double weight = gaussian_kernel(distance, KERNEL_BANDWIDTH);
+    threads = 1;
+#endif
 
-        for (int p = 0; p < numerator_size; p++)
-            numerator[p] += (weight * x_i[p]);
+    // numerator_size sums plus the denominator, padded with a spare cache
+    // line so no two threads' sums ever share one
+    const int line = 64 / sizeof(double);
+    int stride = ((numerator_size + line) / line + 1) * line;
+    int blocks = max(1, (points_size + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK);
+    int slots = deterministic ? blocks : threads;
+    vector<double> partials(slots * stride, 0.0);
 
-        denominator += weight;
-    }
+#ifdef OMP
+#pragma omp parallel num_threads(threads)
+#endif
+    {
+        if (deterministic)
+        {
+#ifdef OMP
+#pragma omp for schedule(static)
 #endif
+            for (int block = 0; block < blocks; block++)
+            {
+                double *partial = &partials[block * stride];
+                int end = min(points_size, (block + 1) * REDUCTION_BLOCK);
+                for (int i = block * REDUCTION_BLOCK; i < end; i++)
+                    accumulate_neighbor(x, points[i], radius_squared, partial);
+            }
+        }
+        else
+        {
+#ifdef OMP
+            double *partial = &partials[omp_get_thread_num() * stride];
+#pragma omp for schedule(static)
+#else
+            double *partial = &partials[0];
+#endif
+            for (int i = 0; i < points_size; i++)
+                accumulate_neighbor(x, points[i], radius_squared, partial);
+        }
+    }
+
+    // Pairwise: slot b takes in slot b + width for width = 1, 2, 4...
+    for (int width = 1; width < slots; width *= 2)
+        for (int b = 0; b + width < slots; b += 2 * width)
+            for (int p = 0; p <= numerator_size; p++)
+                partials[b * stride + p] += partials[(b + width) * stride + p];
+
+    Coord numerator(partials.begin(), partials.begin() + numerator_size);
+    double denominator = partials[numerator_size];
+    if (denominator == 0)
+        return numerator;
 
     for (double &num_i : numerator)
         num_i /= denominator;
@@ -188,4 +330,451 @@ void get_grid_min_max(MinMaxData &data, Grid *grid)
         }
         first = false;
     }
+}
+
+/*
+ * @param x Point at which to estimate the density
+ * @param points The whole grid from which to calculate the neighbors
+ * Unnormalized density whose gradient the mean_shift() step follows: each
+ * neighbor contributes the kernel profile that has gaussian_kernel as its
+ * shadow, offset so that it falls to 0 at AREA_RADIUS.
+ */
+double kernel_density(Coord x, Grid &points)
+{
+    Grid neighbors;
+    get_neighbors(x, points, neighbors);
+
+    double edge = gaussian_kernel(AREA_RADIUS * AREA_RADIUS, KERNEL_BANDWIDTH);
+    double density = 0;
+    for (Coord &x_i : neighbors)
+        density += edge - gaussian_kernel(squared_euclidean_distance(x, x_i), KERNEL_BANDWIDTH);
+
+    return density;
+}
+
+/*
+ * Same as mean_shift() but also returns the kernel_density() at x,
+ * so both come out of a single neighbor scan. AREA_RADIUS and
+ * KERNEL_BANDWIDTH are both multiplied by 'scale'.
+ */
+static double mean_shift_with_density(Coord &x, Grid &points, double scale, Coord &shifted)
+{
+    int numerator_size = x.size();
+    double radius = AREA_RADIUS * scale;
+    double bandwidth = KERNEL_BANDWIDTH * scale;
+    double radius_squared = radius * radius;
+    double edge = gaussian_kernel(radius_squared, bandwidth);
+    double denominator = 0, density = 0;
+    shifted.assign(numerator_size, 0.0);
+
+    for (Coord &x_i : points)
+    {
+        double distance = squared_euclidean_distance(x, x_i);
+        if (distance > radius_squared)
+            continue;
+
+        double weight = gaussian_kernel(distance, bandwidth);
+
+        for (int p = 0; p < numerator_size; p++)
+            shifted[p] += (weight * x_i[p]);
+
+        denominator += weight;
+        density += edge - weight;
+    }
+
+    if (denominator == 0)
+        return 0;
+
+    for (double &num_i : shifted)
+        num_i /= denominator;
+
+    return density;
+}
+
+/*
+ * Same as above over a PointView, with the same arithmetic so both give
+ * the same bits.
+ */
+static double mean_shift_with_density(Coord &x, const PointView &points, double scale,
+                                      Coord &shifted)
+{
+    int numerator_size = x.size();
+    double radius = AREA_RADIUS * scale;
+    double bandwidth = KERNEL_BANDWIDTH * scale;
+    double radius_squared = radius * radius;
+    double edge = gaussian_kernel(radius_squared, bandwidth);
+    double denominator = 0, density = 0;
+    shifted.assign(numerator_size, 0.0);
+
+    for (size_t i = 0; i < points.size; i++)
+    {
+        const double *x_i = points[i];
+        double distance = 0;
+        for (int p = 0; p < numerator_size; p++)
+        {
+            double curr_distance = x[p] - x_i[p];
+            distance += curr_distance * curr_distance;
+        }
+        if (distance > radius_squared)
+            continue;
+
+        double weight = gaussian_kernel(distance, bandwidth);
+
+        for (int p = 0; p < numerator_size; p++)
+            shifted[p] += (weight * x_i[p]);
+
+        denominator += weight;
+        density += edge - weight;
+    }
+
+    if (denominator == 0)
+        return 0;
+
+    for (double &num_i : shifted)
+        num_i /= denominator;
+
+    return density;
+}
+
+/*
+ * One mean shift step from x, with the per-point bandwidths when
+ * options.variable_bandwidth is set and KERNEL_BANDWIDTH scaled by
+ * options.bandwidth_scale otherwise. Counted in options.control if any.
+ * Sets 'shifted' to where x moves and returns the density at x.
+ */
+double shift_point(Coord &x, Grid &points, const ShiftOptions &options, Coord &shifted)
+{
+    if (options.control)
+        options.control->iterations.fetch_add(1, memory_order_relaxed);
+
+    if (options.variable_bandwidth)
+        return mean_shift_with_density(x, points, *options.variable_bandwidth, shifted);
+    return mean_shift_with_density(x, points, options.bandwidth_scale, shifted);
+}
+
+/*
+ * Same as above over a PointView, options.variable_bandwidth isn't supported
+ */
+double shift_point(Coord &x, const PointView &points, const ShiftOptions &options, Coord &shifted)
+{
+    assert(!options.variable_bandwidth);
+    assert(points.dimensions == (int)x.size());
+
+    if (options.control)
+        options.control->iterations.fetch_add(1, memory_order_relaxed);
+
+    return mean_shift_with_density(x, points, options.bandwidth_scale, shifted);
+}
+
+/*
+ * Whether options.control, if any, has been cancelled
+ */
+bool cancelled(const ShiftOptions &options)
+{
+    return options.control && options.control->cancelled.load(memory_order_relaxed);
+}
+
+/*
+ * shift_to_mode() for any kind of points shift_point() takes
+ */
+template <class Points>
+static Coord shift_points_to_mode(Coord x, Points &points, int &iterations,
+                                  const ShiftOptions &options, Grid *trajectory,
+                                  const ModeRegistry *known_modes)
+{
+    double epsilon_squared = options.epsilon * options.epsilon;
+    double snap_radius = options.snap_fraction * KERNEL_BANDWIDTH;
+    if (!options.snap_to_modes)
+        known_modes = NULL;
+    double relaxation = 1.0;
+    int dimensions = x.size();
+
+    iterations = 0;
+    if (cancelled(options))
+        return x;
+
+    Coord shifted, previous_x, previous_shifted;
+    double density = shift_point(x, points, options, shifted);
+    iterations = 1;
+
+    while (iterations < options.max_iterations)
+    {
+        if (cancelled(options))
+            return x;
+
+        if (trajectory)
+            trajectory->push_back(x);
+
+        Coord known_mode;
+        if (known_modes && known_modes->find_within(shifted, snap_radius, known_mode))
+            shifted = known_mode;
+
+        if (!known_mode.empty() || squared_euclidean_distance(x, shifted) <= epsilon_squared)
+        {
+            if (trajectory)
+                trajectory->push_back(shifted);
+            return shifted;
+        }
+
+        Coord candidate;
+        if (options.acceleration == ACCEL_OVER_RELAXED && relaxation > 1.0)
+        {
+            candidate.resize(dimensions);
+            for (int p = 0; p < dimensions; p++)
+                candidate[p] = x[p] + relaxation * (shifted[p] - x[p]);
+        }
+        else if (options.acceleration == ACCEL_ANDERSON && !previous_x.empty())
+        {
+            double dot = 0, norm = 0;
+            for (int p = 0; p < dimensions; p++)
+            {
+                double delta = (shifted[p] - x[p]) - (previous_shifted[p] - previous_x[p]);
+                dot += (shifted[p] - x[p]) * delta;
+                norm += delta * delta;
+            }
+
+            if (norm > 0)
+            {
+                double gamma = dot / norm;
+                candidate.resize(dimensions);
+                for (int p = 0; p < dimensions; p++)
+                    candidate[p] = shifted[p] - gamma * (shifted[p] - previous_shifted[p]);
+            }
+        }
+
+        previous_x = x;
+        previous_shifted = shifted;
+
+        if (!candidate.empty())
+        {
+            Coord candidate_shifted;
+            double candidate_density = shift_point(candidate, points, options, candidate_shifted);
+            iterations++;
+            if (candidate_density >= density)
+            {
+                x = candidate;
+                shifted = candidate_shifted;
+                density = candidate_density;
+                relaxation = min(relaxation * 1.5, options.max_relaxation);
+                continue;
+            }
+            relaxation = 1.0;
+        }
+        else if (options.acceleration == ACCEL_OVER_RELAXED)
+        {
+            relaxation = min(1.5, options.max_relaxation);
+        }
+
+        x = shifted;
+        density = shift_point(x, points, options, shifted);
+        iterations++;
+    }
+
+    return x;
+}
+
+/*
+ * @param x Seed from which to start shifting
+ * @param points The whole grid from which to calculate the neighbors
+ * @param iterations Set to the number of mean shift evaluations (neighbor
+ *                   scans) it took to converge
+ * @param options Convergence threshold, iteration cap and acceleration scheme
+ * @param trajectory Optional, filled with every position the seed visited
+ * @param known_modes Optional, modes other seeds already converged to
+ * @return Returns the mode the seed converged to.
+ * The accelerated schemes propose a longer step than plain mean shift:
+ * ACCEL_OVER_RELAXED steps x + w * (mean_shift(x) - x) with w growing while
+ * proposals are accepted, ACCEL_ANDERSON extrapolates from the last two
+ * steps (Anderson acceleration with a history of one). A proposal is only
+ * taken if it doesn't lower kernel_density(), otherwise the plain step is.
+ * With options.snap_to_modes the seed stops as soon as it gets within
+ * snap_fraction * KERNEL_BANDWIDTH of one of the known_modes and takes it.
+ * A cancelled options.control stops it where it is.
+ */
+Coord shift_to_mode(Coord x, Grid &points, int &iterations, const ShiftOptions &options,
+                    Grid *trajectory, const ModeRegistry *known_modes)
+{
+    return shift_points_to_mode(x, points, iterations, options, trajectory, known_modes);
+}
+
+/*
+ * Same as above over a flat array of points, e.g. mapped from a file or
+ * shared memory. options.variable_bandwidth isn't supported.
+ */
+Coord shift_to_mode(Coord x, const PointView &points, int &iterations, const ShiftOptions &options,
+                    Grid *trajectory, const ModeRegistry *known_modes)
+{
+    return shift_points_to_mode(x, points, iterations, options, trajectory, known_modes);
+}
+
+/*
+ * Called by the drivers once a seed is done: counts it in options.control
+ * and publishes it to options.converged, whichever are set.
+ */
+void report_converged(const ShiftOptions &options, int seed, const Coord &mode, int iterations)
+{
+    if (options.control)
+        options.control->seed_converged();
+
+    if (options.converged)
+    {
+        ConvergedSeed converged;
+        converged.index = seed;
+        converged.mode = mode;
+        converged.iterations = iterations;
+        options.converged->push(converged);
+    }
+}
+
+/*
+ * @param seeds Starting points, one per seed
+ * @param points The whole grid from which to calculate the neighbors
+ * @param modes Filled with the mode each seed converged to, in seed order
+ * @param iterations Filled with the iterations each seed needed
+ * Runs shift_to_mode() on every seed. In the OMP build the seeds are shared
+ * out dynamically over one team of options.threads threads (OpenMP's default
+ * if 0) for the whole call, each seed's mean shift steps stay serial, so
+ * every seed's result is the same whatever the number of threads. Only
+ * snapping depends on timing, options.deterministic turns it off.
+ * With options.snap_to_modes every converged mode goes into a ModeRegistry
+ * that the seeds still running check on each iteration.
+ * With options.basin_shortcut every visited position is recorded in a
+ * SpatialHash, and a seed that starts within basin_fraction * KERNEL_BANDWIDTH
+ * of a recorded position takes that trajectory's mode with 0 iterations
+ * (Comaniciu & Meer, "Mean Shift: A Robust Approach Toward Feature Space
+ * Analysis", section 4.1). That depends on seed order so it runs serially.
+ * Every seed is passed to report_converged() as soon as it's done. Once
+ * options.control is cancelled the seeds still running stop where they are
+ * and the rest stay where they started with 0 iterations, none of them are
+ * reported.
+ */
+void cluster_seeds(Grid &seeds, Grid &points, Grid &modes, vector<int> &iterations,
+                   const ShiftOptions &options)
+{
+    int seeds_size = seeds.size();
+    modes.resize(seeds_size);
+    iterations.resize(seeds_size);
+
+    ModeRegistry known_modes(options.snap_to_modes ? seeds_size : 0);
+    double snap_radius = options.snap_fraction * KERNEL_BANDWIDTH;
+
+    if (options.deterministic && options.snap_to_modes)
+    {
+        ShiftOptions unsnapped = options;
+        unsnapped.snap_to_modes = false;
+        cluster_seeds(seeds, points, modes, iterations, unsnapped);
+        return;
+    }
+
+    if (!options.basin_shortcut)
+    {
+#ifdef OMP
+        int threads = options.threads > 0 ? options.threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+        for (int s = 0; s < seeds_size; s++)
+        {
+            modes[s] = shift_to_mode(seeds[s], points, iterations[s], options, NULL, &known_modes);
+            if (cancelled(options))
+                continue;
+            if (options.snap_to_modes)
+                known_modes.add(modes[s], snap_radius);
+            report_converged(options, s, modes[s], iterations[s]);
+        }
+        return;
+    }
+
+    double basin_radius = options.basin_fraction * KERNEL_BANDWIDTH;
+    SpatialHash visited(basin_radius);
+    for (int s = 0; s < seeds_size; s++)
+    {
+        if (cancelled(options))
+        {
+            modes[s] = seeds[s];
+            iterations[s] = 0;
+            continue;
+        }
+
+        int owner;
+        if (visited.find_within(seeds[s], basin_radius, owner))
+        {
+            modes[s] = modes[owner];
+            iterations[s] = 0;
+            report_converged(options, s, modes[s], 0);
+            continue;
+        }
+
+        Grid trajectory;
+        modes[s] = shift_to_mode(seeds[s], points, iterations[s], options, &trajectory, &known_modes);
+        if (cancelled(options))
+            continue;
+        if (options.snap_to_modes)
+            known_modes.add(modes[s], snap_radius);
+        for (Coord &position : trajectory)
+            visited.insert(position, s);
+        report_converged(options, s, modes[s], iterations[s]);
+    }
+}
+
+/*
+ * @param seeds Starting points, one per seed
+ * @param points The whole grid from which to calculate the neighbors
+ * @param modes Filled with the mode each seed converged to, in seed order
+ * @param iterations Filled with the iterations each seed needed at full
+ *                   resolution, the coarser levels aren't counted
+ * @param levels Number of scales, the last one is the full grid
+ * @param level_scale How much the bandwidth grows per coarser level
+ * Coarse-to-fine cluster_seeds(). Level l runs over every
+ * SAMPLE_GROWTH^(levels - 1 - l)-th point with the bandwidth and radius
+ * multiplied by level_scale^(levels - 1 - l), and takes the seeds to within
+ * COARSE_EPSILON bandwidths of that level's modes. The subsample's modes
+ * are close to the full grid's, so the last level, run with the given
+ * options on the whole grid, starts next to them. The bandwidth can only
+ * grow a little per level: a wider kernel merges modes the finer levels
+ * can't split again. The coarse levels run on options.threads threads in
+ * the OMP build and stop once options.control is cancelled; only the last
+ * level reports seeds as converged.
+ */
+void cluster_multiscale(Grid &seeds, Grid &points, Grid &modes, vector<int> &iterations,
+                        const ShiftOptions &options, int levels, double level_scale)
+{
+    Grid positions = seeds;
+    if (points.empty() || positions.empty())
+        levels = 1;
+
+    for (int level = 0; level < levels - 1; level++)
+    {
+        double scale = pow(level_scale, levels - 1 - level);
+        size_t stride = 1;
+        for (int l = level; l < levels - 1 && stride < points.size(); l++)
+            stride *= SAMPLE_GROWTH;
+        if (stride >= points.size())
+            continue;
+
+        Grid sample;
+        sample.reserve(points.size() / stride + 1);
+        for (size_t i = 0; i < points.size(); i += stride)
+            sample.push_back(points[i]);
+
+        ShiftOptions coarse;
+        coarse.max_iterations = options.max_iterations;
+        coarse.acceleration = options.acceleration;
+        coarse.bandwidth_scale = scale;
+        coarse.epsilon = COARSE_EPSILON * scale * KERNEL_BANDWIDTH;
+        coarse.control = options.control;
+
+        // Seeds aren't reported from here, only once they reach the last level
+        int seeds_size = positions.size();
+#ifdef OMP
+        int threads = options.threads > 0 ? options.threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+        for (int s = 0; s < seeds_size; s++)
+        {
+            int coarse_iterations;
+            positions[s] = shift_to_mode(positions[s], sample, coarse_iterations, coarse);
+        }
+    }
+
+    cluster_seeds(positions, points, modes, iterations, options);
 }
\ No newline at end of file
@@ -0,0 +1,68 @@
+/* 
+ * Author: Kamil S.
+ * Registry of modes that some seed already converged to, so that later
+ * seeds can stop as soon as they get close to one.
+ */
+
+#include "header/mode_registry.h"
+
+using namespace std;
+
+/*
+ * @param capacity Maximum number of modes, usually the number of seeds.
+ * The storage is allocated up front so readers never see it reallocate.
+ */
+ModeRegistry::ModeRegistry(size_t capacity) : modes(capacity), count(0)
+{
+}
+
+/*
+ * @param point Position to look around
+ * @param radius Maximum distance to a registered mode
+ * @param mode Set to the closest registered mode within radius
+ * Returns whether such a mode exists. Safe to call while other threads add.
+ */
+bool ModeRegistry::find_within(const Coord &point, double radius, Coord &mode) const
+{
+    size_t published = count.load(memory_order_acquire);
+    double best = radius * radius;
+    bool found = false;
+
+    for (size_t m = 0; m < published; m++)
+    {
+        double distance = squared_euclidean_distance(point, modes[m]);
+        if (distance <= best)
+        {
+            best = distance;
+            mode = modes[m];
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * @param mode Mode some seed converged to
+ * @param radius Modes closer than this to a registered one are duplicates
+ * Returns whether the mode was added. Full registries silently drop modes,
+ * which only costs later seeds the shortcut.
+ */
+bool ModeRegistry::add(const Coord &mode, double radius)
+{
+    lock_guard<mutex> lock(writer);
+
+    Coord existing;
+    size_t current = count.load(memory_order_relaxed);
+    if (current == modes.size() || find_within(mode, radius, existing))
+        return false;
+
+    modes[current] = mode;
+    count.store(current + 1, memory_order_release);
+    return true;
+}
+
+size_t ModeRegistry::size() const
+{
+    return count.load(memory_order_acquire);
+}
@@ -0,0 +1,569 @@
+/*
+ * Author: Kamil S.
+ * NumPy .npy and .npz files, so arrays from the Python side are mapped and
+ * used as points without a detour through CSV.
+ */
+
+#include "header/npy.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <zlib.h>
+
+using namespace std;
+
+static const char NPY_MAGIC[6] = {'\x93', 'N', 'U', 'M', 'P', 'Y'};
+static const size_t NPY_ALIGNMENT = 64;
+
+static const uint32_t ZIP_LOCAL_HEADER = 0x04034b50;
+static const uint32_t ZIP_CENTRAL_HEADER = 0x02014b50;
+static const uint32_t ZIP_END = 0x06054b50;
+static const uint32_t ZIP64_END = 0x06064b50;
+static const uint32_t ZIP64_LOCATOR = 0x07064b50;
+// extra field padding a member's data to the alignment it holds, as
+// Android's zipalign writes it
+static const uint16_t ZIP_PADDING = 0xD935;
+static const uint16_t ZIP_STORED = 0;
+static const uint16_t ZIP_DEFLATED = 8;
+
+/*
+ * Both formats are little-endian, like every machine this runs on
+ */
+template <typename T>
+static T read_le(const char *data)
+{
+    T value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+template <typename T>
+static void append_le(string &out, T value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+/*
+ * Finds "'key':" in a header dict and returns where its value starts
+ */
+static const char *find_key(const string &header, const char *key, const string &where)
+{
+    string quoted = string("'") + key + "'";
+    size_t at = header.find(quoted);
+    if (at == string::npos)
+        throw runtime_error(where + ": .npy header has no " + key);
+    at = header.find(':', at + quoted.size());
+    if (at == string::npos)
+        throw runtime_error(where + ": malformed .npy header");
+    at++;
+    while (at < header.size() && header[at] == ' ')
+        at++;
+    return header.c_str() + at;
+}
+
+/*
+ * Parses the header and checks the data behind it. Data that can't be
+ * used where it is gets copied or widened into 'widened'.
+ */
+void NpyArray::parse(const char *data, size_t size, const string &where)
+{
+    if (size < 10 || memcmp(data, NPY_MAGIC, sizeof(NPY_MAGIC)) != 0)
+        throw runtime_error(where + ": not a .npy array");
+
+    int major = (unsigned char)data[6];
+    size_t header_start = major == 1 ? 10 : 12;
+    if (major < 1 || major > 3 || size < header_start)
+        throw runtime_error(where + ": unsupported .npy version " + to_string(major));
+    size_t header_size = major == 1 ? read_le<uint16_t>(data + 8) : read_le<uint32_t>(data + 8);
+    if (size < header_start + header_size)
+        throw runtime_error(where + ": truncated .npy header");
+    string header(data + header_start, header_size);
+
+    const char *descr = find_key(header, "descr", where);
+    if (strncmp(descr, "'<f8'", 5) == 0)
+        scalar = SCALAR_FLOAT64;
+    else if (strncmp(descr, "'<f4'", 5) == 0)
+        scalar = SCALAR_FLOAT32;
+    else
+        throw runtime_error(where + ": only little-endian float32 and float64 arrays are supported");
+
+    bool fortran_order = strncmp(find_key(header, "fortran_order", where), "True", 4) == 0;
+
+    const char *shape = find_key(header, "shape", where);
+    if (*shape != '(')
+        throw runtime_error(where + ": malformed .npy shape");
+    vector<size_t> extents;
+    for (const char *cursor = shape + 1; *cursor != ')';)
+    {
+        char *end;
+        unsigned long long extent = strtoull(cursor, &end, 10);
+        if (end == cursor)
+            throw runtime_error(where + ": malformed .npy shape");
+        extents.push_back(extent);
+        cursor = end;
+        while (*cursor == ',' || *cursor == ' ')
+            cursor++;
+    }
+    if (extents.empty() || extents.size() > 2)
+        throw runtime_error(where + ": expected a 1-D or 2-D array, got " +
+                            to_string(extents.size()) + "-D");
+
+    size_t rows = extents[0];
+    if (extents.size() == 2 && extents[1] > (size_t)numeric_limits<int>::max())
+        throw runtime_error(where + ": too many columns in the .npy shape");
+    int dimensions = extents.size() == 2 ? extents[1] : 1;
+    if (fortran_order && dimensions > 1 && rows > 1)
+        throw runtime_error(where + ": Fortran-ordered arrays are not supported");
+
+    // checked by dividing, rows * row could wrap around
+    size_t scalar_bytes = scalar == SCALAR_FLOAT32 ? sizeof(float) : sizeof(double);
+    size_t row = dimensions * scalar_bytes;
+    const char *values = data + header_start + header_size;
+    if (row > 0 && rows > (size - header_start - header_size) / row)
+        throw runtime_error(where + ": truncated .npy data");
+    size_t count = rows * dimensions;
+
+    if (scalar == SCALAR_FLOAT64 && reinterpret_cast<uintptr_t>(values) % alignof(double) == 0)
+    {
+        points = PointView(reinterpret_cast<const double *>(values), rows, dimensions);
+        return;
+    }
+
+    widened.resize(count);
+    if (scalar == SCALAR_FLOAT64)
+        memcpy(widened.data(), values, count * sizeof(double));
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+            widened[i] = read_le<float>(values + i * sizeof(float));
+    }
+    points = PointView(widened.data(), rows, dimensions);
+}
+
+/*
+ * A member of a .npz archive, as listed in its central directory
+ */
+struct ZipMember {
+    string name;
+    uint16_t method;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint64_t local_offset;
+};
+
+/*
+ * Reads the central directory of the zip archive in 'data', including the
+ * zip64 records numpy writes for large arrays
+ */
+static vector<ZipMember> zip_directory(const char *data, size_t size, const string &path)
+{
+    if (size < 22)
+        throw runtime_error(path + ": not a .npz archive");
+    size_t end = size - 22;
+    size_t lowest = size > 22 + 0xFFFF ? size - 22 - 0xFFFF : 0;
+    while (read_le<uint32_t>(data + end) != ZIP_END)
+    {
+        if (end == lowest)
+            throw runtime_error(path + ": not a .npz archive");
+        end--;
+    }
+
+    uint64_t entries = read_le<uint16_t>(data + end + 10);
+    uint64_t directory = read_le<uint32_t>(data + end + 16);
+    if ((entries == 0xFFFF || directory == 0xFFFFFFFF) && end >= 20
+        && read_le<uint32_t>(data + end - 20) == ZIP64_LOCATOR)
+    {
+        uint64_t end64 = read_le<uint64_t>(data + end - 12);
+        // offsets and sizes from the archive are compared by subtracting,
+        // adding them could wrap around
+        if (size < 56 || end64 > size - 56 || read_le<uint32_t>(data + end64) != ZIP64_END)
+            throw runtime_error(path + ": corrupt zip64 directory");
+        entries = read_le<uint64_t>(data + end64 + 32);
+        directory = read_le<uint64_t>(data + end64 + 48);
+    }
+
+    vector<ZipMember> members;
+    size_t at = directory;
+    for (uint64_t e = 0; e < entries; e++)
+    {
+        if (size < 46 || at > size - 46 || read_le<uint32_t>(data + at) != ZIP_CENTRAL_HEADER)
+            throw runtime_error(path + ": corrupt zip directory");
+
+        ZipMember member;
+        member.method = read_le<uint16_t>(data + at + 10);
+        member.compressed_size = read_le<uint32_t>(data + at + 20);
+        member.size = read_le<uint32_t>(data + at + 24);
+        member.local_offset = read_le<uint32_t>(data + at + 42);
+        size_t name_size = read_le<uint16_t>(data + at + 28);
+        size_t extra_size = read_le<uint16_t>(data + at + 30);
+        size_t comment_size = read_le<uint16_t>(data + at + 32);
+        if (name_size + extra_size + comment_size > size - at - 46)
+            throw runtime_error(path + ": corrupt zip directory");
+        member.name.assign(data + at + 46, name_size);
+
+        // the zip64 extra field holds the sizes and offset that didn't fit,
+        // in this order
+        const char *extra = data + at + 46 + name_size;
+        for (size_t x = 0; x + 4 <= extra_size;)
+        {
+            uint16_t id = read_le<uint16_t>(extra + x);
+            size_t length = min<size_t>(read_le<uint16_t>(extra + x + 2), extra_size - x - 4);
+            if (id == 0x0001)
+            {
+                const char *field = extra + x + 4;
+                const char *field_end = field + length;
+                uint64_t *wide[3] = {&member.size, &member.compressed_size, &member.local_offset};
+                for (int w = 0; w < 3 && field + 8 <= field_end; w++)
+                {
+                    if (*wide[w] == 0xFFFFFFFF)
+                    {
+                        *wide[w] = read_le<uint64_t>(field);
+                        field += 8;
+                    }
+                }
+            }
+            x += 4 + length;
+        }
+
+        members.push_back(member);
+        at += 46 + name_size + extra_size + comment_size;
+    }
+    return members;
+}
+
+static bool is_zip(const char *data, size_t size)
+{
+    return size >= 4 && read_le<uint32_t>(data) == ZIP_LOCAL_HEADER;
+}
+
+/*
+ * Drops the ".npy" numpy adds to every member name
+ */
+static string array_name(const string &member)
+{
+    if (member.size() > 4 && member.compare(member.size() - 4, 4, ".npy") == 0)
+        return member.substr(0, member.size() - 4);
+    return member;
+}
+
+/*
+ * @param path A .npy file, or a .npz archive whose first array is read
+ */
+NpyArray::NpyArray(const string &path) : file(path), scalar(SCALAR_FLOAT64)
+{
+    if (is_zip(file.data(), file.size()))
+        open_member(path, "");
+    else
+        parse(file.data(), file.size(), path);
+}
+
+/*
+ * @param path A .npz archive
+ * @param member Name of the array, with or without ".npy"
+ */
+NpyArray::NpyArray(const string &path, const string &member) : file(path), scalar(SCALAR_FLOAT64)
+{
+    open_member(path, member);
+}
+
+void NpyArray::open_member(const string &path, const string &member)
+{
+    vector<ZipMember> members = zip_directory(file.data(), file.size(), path);
+    const ZipMember *found = NULL;
+    for (const ZipMember &candidate : members)
+    {
+        if (member.empty() || array_name(candidate.name) == array_name(member))
+        {
+            found = &candidate;
+            break;
+        }
+    }
+    if (!found)
+        throw runtime_error(path + ": no array named '" + member + "'");
+
+    string where = path + ":" + found->name;
+    size_t at = found->local_offset;
+    if (file.size() < 30 || at > file.size() - 30
+        || read_le<uint32_t>(file.data() + at) != ZIP_LOCAL_HEADER)
+        throw runtime_error(where + ": corrupt zip member");
+    at += 30 + read_le<uint16_t>(file.data() + at + 26) + read_le<uint16_t>(file.data() + at + 28);
+    if (at > file.size() || found->compressed_size > file.size() - at)
+        throw runtime_error(where + ": truncated zip member");
+
+    if (found->method == ZIP_STORED)
+    {
+        if (found->size != found->compressed_size)
+            throw runtime_error(where + ": corrupt zip member");
+        parse(file.data() + at, found->size, where);
+        return;
+    }
+    if (found->method != ZIP_DEFLATED)
+        throw runtime_error(where + ": unsupported compression method " +
+                            to_string(found->method));
+
+    // np.savez_compressed: raw deflate, inflated once into memory we own
+    inflated.resize(found->size);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+        throw runtime_error(where + ": inflateInit2 failed");
+    const char *input = file.data() + at;
+    uint64_t input_left = found->compressed_size, output_left = found->size;
+    int status = Z_OK;
+    while (status == Z_OK)
+    {
+        uInt input_chunk = input_left < 0x40000000 ? input_left : 0x40000000;
+        uInt output_chunk = output_left < 0x40000000 ? output_left : 0x40000000;
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input));
+        stream.avail_in = input_chunk;
+        stream.next_out = reinterpret_cast<Bytef *>(inflated.data() + found->size - output_left);
+        stream.avail_out = output_chunk;
+        status = inflate(&stream, Z_NO_FLUSH);
+        input += input_chunk - stream.avail_in;
+        input_left -= input_chunk - stream.avail_in;
+        output_left -= output_chunk - stream.avail_out;
+        if (status == Z_BUF_ERROR && input_left > 0 && output_left > 0)
+            status = Z_OK;
+    }
+    inflateEnd(&stream);
+    if (status != Z_STREAM_END || output_left != 0)
+        throw runtime_error(where + ": corrupt deflated data");
+
+    parse(inflated.data(), inflated.size(), where);
+}
+
+ScalarType NpyArray::type() const
+{
+    return scalar;
+}
+
+PointView NpyArray::view() const
+{
+    return points;
+}
+
+/*
+ * Copies the points into a Grid, for the code that needs one
+ */
+void NpyArray::to_grid(Grid &grid) const
+{
+    grid.resize(points.size);
+    for (size_t i = 0; i < points.size; i++)
+        grid[i].assign(points[i], points[i] + points.dimensions);
+}
+
+/*
+ * Returns the magic, version, header length and header dict numpy expects
+ * in front of a C-ordered rows x columns array, padded so the data starts
+ * at a multiple of 64 bytes.
+ */
+string npy_header(ScalarType type, size_t rows, size_t columns)
+{
+    string dict = string("{'descr': '") + (type == SCALAR_FLOAT32 ? "<f4" : "<f8") +
+                  "', 'fortran_order': False, 'shape': (" + to_string(rows) + ", " +
+                  to_string(columns) + "), }";
+
+    bool wide = dict.size() + 11 > 0xFFFF;
+    size_t preamble = wide ? 12 : 10;
+    size_t total = (preamble + dict.size() + 1 + NPY_ALIGNMENT - 1) / NPY_ALIGNMENT * NPY_ALIGNMENT;
+    dict.append(total - preamble - dict.size() - 1, ' ');
+    dict.push_back('\n');
+
+    string header(NPY_MAGIC, sizeof(NPY_MAGIC));
+    header.push_back(wide ? 2 : 1);
+    header.push_back(0);
+    if (wide)
+        append_le<uint32_t>(header, dict.size());
+    else
+        append_le<uint16_t>(header, dict.size());
+    return header + dict;
+}
+
+/*
+ * The whole .npy file for 'points' in memory, for write_npz()
+ */
+static string npy_bytes(Grid &points, ScalarType type)
+{
+    size_t columns = points.empty() ? 0 : points[0].size();
+    string bytes = npy_header(type, points.size(), columns);
+    for (Coord &point : points)
+    {
+        for (double value : point)
+        {
+            if (type == SCALAR_FLOAT32)
+                append_le<float>(bytes, static_cast<float>(value));
+            else
+                append_le<double>(bytes, value);
+        }
+    }
+    return bytes;
+}
+
+/*
+ * @param path File to write, replaced if it exists
+ * @param points Points to store as a points.size() x dimensions array
+ * @param type Scalar type to store
+ * Throws system_error if the file can't be written.
+ */
+void write_npy(const string &path, Grid &points, ScalarType type)
+{
+    ofstream out(path.c_str(), ios::binary | ios::trunc);
+    if (!out)
+        throw system_error(errno, system_category(), "open " + path);
+
+    size_t columns = points.empty() ? 0 : points[0].size();
+    string header = npy_header(type, points.size(), columns);
+    out.write(header.data(), header.size());
+
+    vector<char> row(columns * (type == SCALAR_FLOAT32 ? sizeof(float) : sizeof(double)));
+    for (Coord &point : points)
+    {
+        if (type == SCALAR_FLOAT32)
+        {
+            float *values = reinterpret_cast<float *>(row.data());
+            for (size_t d = 0; d < columns; d++)
+                values[d] = static_cast<float>(point[d]);
+        }
+        else
+            memcpy(row.data(), point.data(), row.size());
+        out.write(row.data(), row.size());
+    }
+
+    out.flush();
+    if (!out)
+        throw system_error(errno, system_category(), "write " + path);
+}
+
+/*
+ * @param path A .npz archive
+ * Returns the names of its arrays, without ".npy", like numpy's NpzFile.files
+ */
+vector<string> npz_members(const string &path)
+{
+    MappedFile file(path);
+    vector<string> names;
+    for (const ZipMember &member : zip_directory(file.data(), file.size(), path))
+        names.push_back(array_name(member.name));
+    return names;
+}
+
+/*
+ * @param path File to write, replaced if it exists
+ * @param names Name of every array, ".npy" is added
+ * @param arrays Arrays to store, as float64
+ * @param compressed Deflate the arrays, like np.savez_compressed()
+ * A stored member's local header is padded with an extra field so its
+ * data starts NPY_ALIGNMENT-aligned, and it's mapped in place when read
+ * back. The archive must stay under 4 GB and 65535 members, which is what
+ * the plain zip format can describe. Throws system_error if the file can't
+ * be written.
+ */
+void write_npz(const string &path, const vector<string> &names, const vector<Grid *> &arrays,
+               bool compressed)
+{
+    ofstream out(path.c_str(), ios::binary | ios::trunc);
+    if (!out)
+        throw system_error(errno, system_category(), "open " + path);
+
+    string directory;
+    uint64_t offset = 0;
+    for (size_t a = 0; a < arrays.size(); a++)
+    {
+        string name = names[a] + ".npy";
+        string content = npy_bytes(*arrays[a], SCALAR_FLOAT64);
+        uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(content.data()), content.size());
+
+        string stored = content;
+        if (compressed)
+        {
+            z_stream stream;
+            memset(&stream, 0, sizeof(stream));
+            if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK)
+                throw runtime_error(path + ": deflateInit2 failed");
+            stored.resize(deflateBound(&stream, content.size()));
+            stream.next_in = reinterpret_cast<Bytef *>(&content[0]);
+            stream.avail_in = content.size();
+            stream.next_out = reinterpret_cast<Bytef *>(&stored[0]);
+            stream.avail_out = stored.size();
+            int status = deflate(&stream, Z_FINISH);
+            stored.resize(stream.total_out);
+            deflateEnd(&stream);
+            if (status != Z_STREAM_END)
+                throw runtime_error(path + ": deflate failed");
+        }
+
+        // the data starts after the 30-byte header, the name and the extra
+        // field, which takes at least 6 bytes: its id, length and alignment
+        size_t padding = 0;
+        if (!compressed)
+        {
+            padding = (NPY_ALIGNMENT - (offset + 30 + name.size()) % NPY_ALIGNMENT) % NPY_ALIGNMENT;
+            if (padding > 0 && padding < 6)
+                padding += NPY_ALIGNMENT;
+        }
+
+        string local;
+        append_le<uint32_t>(local, ZIP_LOCAL_HEADER);
+        append_le<uint16_t>(local, 20);
+        append_le<uint16_t>(local, 0);
+        append_le<uint16_t>(local, compressed ? ZIP_DEFLATED : ZIP_STORED);
+        append_le<uint16_t>(local, 0);
+        append_le<uint16_t>(local, 0x21);
+        append_le<uint32_t>(local, crc);
+        append_le<uint32_t>(local, stored.size());
+        append_le<uint32_t>(local, content.size());
+        append_le<uint16_t>(local, name.size());
+        append_le<uint16_t>(local, padding);
+        local += name;
+        if (padding > 0)
+        {
+            append_le<uint16_t>(local, ZIP_PADDING);
+            append_le<uint16_t>(local, padding - 4);
+            append_le<uint16_t>(local, NPY_ALIGNMENT);
+            local.append(padding - 6, '\0');
+        }
+
+        if (content.size() >= 0xFFFFFFFF || offset + local.size() + stored.size() >= 0xFFFFFFFF
+            || a >= 0xFFFF)
+            throw runtime_error(path + ": array '" + names[a] + "' doesn't fit a .npz, use .npy");
+
+        // the padding is only in the local header
+        append_le<uint32_t>(directory, ZIP_CENTRAL_HEADER);
+        append_le<uint16_t>(directory, 20);
+        directory.append(local, 4, 24);
+        append_le<uint16_t>(directory, 0);
+        append_le<uint16_t>(directory, 0);
+        append_le<uint16_t>(directory, 0);
+        append_le<uint16_t>(directory, 0);
+        append_le<uint32_t>(directory, 0);
+        append_le<uint32_t>(directory, offset);
+        directory += name;
+
+        out.write(local.data(), local.size());
+        out.write(stored.data(), stored.size());
+        offset += local.size() + stored.size();
+    }
+
+    string end;
+    append_le<uint32_t>(end, ZIP_END);
+    append_le<uint16_t>(end, 0);
+    append_le<uint16_t>(end, 0);
+    append_le<uint16_t>(end, arrays.size());
+    append_le<uint16_t>(end, arrays.size());
+    append_le<uint32_t>(end, directory.size());
+    append_le<uint32_t>(end, offset);
+    append_le<uint16_t>(end, 0);
+    out.write(directory.data(), directory.size());
+    out.write(end.data(), end.size());
+
+    out.flush();
+    if (!out)
+        throw system_error(errno, system_category(), "write " + path);
+}
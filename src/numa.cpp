@@ -0,0 +1,97 @@
+/* 
+ * Author: Kamil S.
+ * NUMA topology from sysfs and thread pinning, Linux only. Elsewhere there
+ * is always a single node and pinning does nothing.
+ */
+
+#include "header/numa.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+/*
+ * Parses a sysfs CPU or node list such as "0-3,8-11"
+ */
+static void parse_cpu_list(const string &list, vector<int> &cpus)
+{
+    stringstream stream(list);
+    string range;
+    while (getline(stream, range, ','))
+    {
+        int first, last;
+        int read = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (read < 1)
+            continue;
+        if (read == 1)
+            last = first;
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+}
+
+/*
+ * @param topology Filled with the CPUs of every node that has any
+ * @param sysfs Directory describing the nodes
+ * Reads node<N>/cpulist for every node listed in 'online', whose ids can
+ * have gaps.
+ */
+void detect_numa_topology(NumaTopology &topology, const string &sysfs)
+{
+    topology.node_cpus.clear();
+
+#ifdef __linux__
+    ifstream online((sysfs + "/online").c_str());
+    string online_list;
+    getline(online, online_list);
+    vector<int> nodes;
+    parse_cpu_list(online_list, nodes);
+
+    for (int node : nodes)
+    {
+        ifstream file((sysfs + "/node" + to_string(node) + "/cpulist").c_str());
+        string list;
+        getline(file, list);
+        vector<int> cpus;
+        parse_cpu_list(list, cpus);
+        if (!cpus.empty())
+            topology.node_cpus.push_back(cpus);
+    }
+#else
+    (void) sysfs;
+#endif
+
+    if (topology.node_cpus.empty())
+    {
+        vector<int> cpus;
+        for (unsigned cpu = 0; cpu < max(1u, thread::hardware_concurrency()); cpu++)
+            cpus.push_back(cpu);
+        topology.node_cpus.push_back(cpus);
+    }
+}
+
+/*
+ * @param cpus CPUs the calling thread may run on
+ * Returns whether the affinity could be set.
+ */
+bool pin_current_thread(const vector<int> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) cpus;
+    return false;
+#endif
+}
@@ -0,0 +1,475 @@
+/*
+ * Author: Kamil S.
+ * Online mean shift for points arriving on a pipe: a reader, the
+ * clustering and a writer run as stages joined by bounded queues, so a
+ * slow stage stops the ones before it instead of letting memory grow.
+ */
+
+#include "header/online.h"
+#include "header/csv.h"
+#include "header/results.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef OMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+/*
+ * @param dimensions Coordinates of every point
+ * @param window How many of the latest points the density is estimated over
+ * @param merge_radius Modes closer than this are the same cluster, half of
+ *                     KERNEL_BANDWIDTH if 0
+ * @param options Passed to shift_to_mode()
+ */
+OnlineEngine::OnlineEngine(int dimensions, size_t window, double merge_radius,
+                           const ShiftOptions &options)
+    : dimensions(dimensions), window(max(window, (size_t)1)),
+      merge_radius(merge_radius > 0 ? merge_radius : 0.5 * KERNEL_BANDWIDTH), options(options),
+      next(0), index(this->merge_radius)
+{
+}
+
+/*
+ * Re-keys the cluster in the index under its new mode
+ */
+void OnlineEngine::move_mode(int label, const Coord &mode)
+{
+    index.remove(modes[label], label);
+    modes[label] = mode;
+    index.insert(mode, label);
+}
+
+/*
+ * @param batch New points
+ * @param updates Filled with every cluster the batch changed the size of,
+ *                in the order they were first changed
+ * The batch enters the window first, replacing the oldest points once it's
+ * full, then every new point is shifted to its mode over the window. In the
+ * OMP build the points are shared out over options.threads threads, the
+ * labeling after that is serial so labels don't depend on timing. Clusters
+ * whose last point left the window are reported with size 0 and their
+ * labels are given to the next new clusters.
+ */
+void OnlineEngine::add(const Grid &batch, vector<ModeUpdate> &updates)
+{
+    updates.clear();
+    vector<int> touched;
+    vector<size_t> slots(batch.size());
+    for (size_t p = 0; p < batch.size(); p++)
+    {
+        const Coord &point = batch[p];
+        if (recent.size() < window * dimensions)
+        {
+            recent.insert(recent.end(), point.begin(), point.end());
+            labels.push_back(-1);
+        }
+        else
+        {
+            copy(point.begin(), point.end(), recent.begin() + next * dimensions);
+            int evicted = labels[next];
+            labels[next] = -1;
+            if (evicted >= 0)
+            {
+                sizes[evicted]--;
+                if (find(touched.begin(), touched.end(), evicted) == touched.end())
+                    touched.push_back(evicted);
+            }
+        }
+        slots[p] = next;
+        next = (next + 1) % window;
+    }
+    PointView view(recent.data(), recent.size() / dimensions, dimensions);
+
+    int batch_size = batch.size();
+    Grid found(batch_size);
+    vector<int> iterations(batch_size);
+#ifdef OMP
+    int threads = options.threads > 0 ? options.threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+    for (int s = 0; s < batch_size; s++)
+        found[s] = shift_to_mode(batch[s], view, iterations[s], options);
+
+    // only the last 'window' points of an oversized batch stay in the window
+    size_t kept = batch.size() > window ? batch.size() - window : 0;
+    for (size_t p = 0; p < batch.size(); p++)
+    {
+        const Coord &mode = found[p];
+        int label;
+        if (index.find_within(mode, merge_radius, label))
+        {
+            move_mode(label, mode);
+        }
+        else if (!free_labels.empty())
+        {
+            label = free_labels.back();
+            free_labels.pop_back();
+            modes[label] = mode;
+            index.insert(mode, label);
+        }
+        else
+        {
+            label = modes.size();
+            modes.push_back(mode);
+            sizes.push_back(0);
+            index.insert(mode, label);
+        }
+        if (p >= kept)
+        {
+            labels[slots[p]] = label;
+            sizes[label]++;
+        }
+        if (find(touched.begin(), touched.end(), label) == touched.end())
+            touched.push_back(label);
+    }
+
+    for (int label : touched)
+    {
+        ModeUpdate update;
+        update.label = label;
+        update.mode = modes[label];
+        update.size = sizes[label];
+        updates.push_back(update);
+        if (sizes[label] == 0)
+        {
+            index.remove(modes[label], label);
+            free_labels.push_back(label);
+        }
+    }
+}
+
+/*
+ * Points in the window
+ */
+size_t OnlineEngine::points() const
+{
+    return recent.size() / dimensions;
+}
+
+/*
+ * Clusters with points in the window
+ */
+size_t OnlineEngine::clusters() const
+{
+    return modes.size() - free_labels.size();
+}
+
+/*
+ * A queue of at most 'depth' items between two stages. An empty item marks
+ * the end of the stream. push() waits for room, which is what holds the
+ * producing stage back.
+ */
+template <typename T>
+class StageQueue {
+public:
+    explicit StageQueue(size_t depth) : depth(max(depth, (size_t)1)), stopped(false) {}
+
+    /*
+     * Returns false once the consumer has stopped taking items. 'waited'
+     * is set if the queue was full.
+     */
+    bool push(T &item, bool *waited = NULL)
+    {
+        unique_lock<mutex> guard(lock);
+        if (waited)
+            *waited = items.size() >= depth && !stopped;
+        changed.wait(guard, [this] { return items.size() < depth || stopped; });
+        if (stopped)
+            return false;
+        items.push_back(T());
+        items.back().swap(item);
+        changed.notify_all();
+        return true;
+    }
+
+    void pop(T &item)
+    {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this] { return !items.empty(); });
+        item.swap(items.front());
+        items.pop_front();
+        changed.notify_all();
+        if (item.empty() && failure)
+            rethrow_exception(failure);
+    }
+
+    /*
+     * Ends the stream with 'error', rethrown by the pop() that reaches it
+     */
+    void fail(exception_ptr error)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            failure = error;
+        }
+        T end;
+        push(end);
+    }
+
+    /*
+     * Lets a blocked push() return when the consumer gave up
+     */
+    void stop()
+    {
+        lock_guard<mutex> guard(lock);
+        stopped = true;
+        changed.notify_all();
+    }
+
+    bool is_stopped()
+    {
+        lock_guard<mutex> guard(lock);
+        return stopped;
+    }
+
+private:
+    size_t depth;
+    mutex lock;
+    condition_variable changed;
+    deque<T> items;
+    exception_ptr failure;
+    bool stopped;
+};
+
+static size_t count_lines(const char *begin, const char *end)
+{
+    size_t lines = 0;
+    while ((begin = static_cast<const char *>(memchr(begin, '\n', end - begin))))
+    {
+        lines++;
+        begin++;
+    }
+    return lines;
+}
+
+/*
+ * Waits up to 'timeout' ms for 'fd' to have data or reach its end
+ */
+static bool readable(int fd, int timeout = 0)
+{
+    pollfd waiting = {fd, POLLIN, 0};
+    return poll(&waiting, 1, timeout) > 0;
+}
+
+/*
+ * The reader stage. Whatever read() returns is parsed up to its last
+ * complete line, full batches are queued straight away and a partial one
+ * as soon as the pipe has nothing more for now, so a slow producer doesn't
+ * wait for a batch to fill.
+ */
+static void read_batches(int input, const StreamOptions &options, StageQueue<Grid> &batches,
+                         StreamStats &stats)
+{
+    vector<char> block(64 << 10), text;
+    Grid pending;
+    size_t line = 1;
+    bool parameters_pending = options.has_parameters;
+    size_t batch_size = max(options.batch_size, (size_t)1);
+    bool end = false;
+    while (!end)
+    {
+        // a reader blocked in read() couldn't notice that the stages after
+        // it gave up
+        if (!readable(input, 100))
+        {
+            if (batches.is_stopped())
+                return;
+            continue;
+        }
+        ssize_t got = read(input, block.data(), block.size());
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw system_error(errno, system_category(), "read");
+        }
+        end = got == 0;
+        text.insert(text.end(), block.data(), block.data() + got);
+
+        const char *begin = text.data(), *stop = begin + text.size();
+        if (!end)
+        {
+            const char *newline = static_cast<const char *>(memrchr(begin, '\n', text.size()));
+            stop = newline ? newline + 1 : begin;
+        }
+        if (stop > begin)
+        {
+            bool blank = all_of(begin, stop, [](char c) { return isspace((unsigned char)c); });
+            if (!(parameters_pending && blank))
+            {
+                double parameters[2];
+                parse_csv(begin, stop, options.dimensions, pending,
+                          parameters_pending ? parameters : NULL, 1, line);
+                if (parameters_pending)
+                {
+                    AREA_RADIUS = parameters[0];
+                    KERNEL_BANDWIDTH = parameters[1];
+                    parameters_pending = false;
+                }
+            }
+            line += count_lines(begin, stop);
+            text.erase(text.begin(), text.begin() + (stop - begin));
+        }
+
+        size_t taken = 0;
+        while (pending.size() - taken >= batch_size || (taken < pending.size()
+                                                        && (end || !readable(input))))
+        {
+            size_t size = min(batch_size, pending.size() - taken);
+            Grid batch(make_move_iterator(pending.begin() + taken),
+                       make_move_iterator(pending.begin() + taken + size));
+            taken += size;
+            bool waited;
+            if (!batches.push(batch, &waited))
+                return;
+            stats.reader_waits += waited;
+        }
+        pending.erase(pending.begin(), pending.begin() + taken);
+    }
+
+    if (parameters_pending)
+        throw CsvError(line, "missing AREA_RADIUS and KERNEL_BANDWIDTH");
+}
+
+/*
+ * The writer stage: one "label x y ... size" line per update, written
+ * straight to the descriptor once per batch
+ */
+static void write_updates(int output, StageQueue<vector<ModeUpdate>> &updates)
+{
+    vector<ModeUpdate> batch;
+    string text;
+    char number[32];
+    for (updates.pop(batch); !batch.empty(); updates.pop(batch))
+    {
+        text.clear();
+        for (const ModeUpdate &update : batch)
+        {
+            text += to_string(update.label);
+            for (double coordinate : update.mode)
+            {
+                text += ' ';
+                text.append(number, format_double(coordinate, number));
+            }
+            text += ' ';
+            text += to_string(update.size);
+            text += '\n';
+        }
+
+        const char *data = text.data();
+        size_t left = text.size();
+        while (left > 0)
+        {
+            ssize_t written = write(output, data, left);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw system_error(errno, system_category(), "write");
+            }
+            data += written;
+            left -= written;
+        }
+    }
+}
+
+/*
+ * @param input Descriptor the points are read from, usually a pipe
+ * @param output Descriptor the mode updates are written to
+ * Reads points like the CSV datasets (the first line holds AREA_RADIUS and
+ * KERNEL_BANDWIDTH if options.has_parameters) until the end of 'input' and
+ * clusters them in batches of at most options.batch_size with an
+ * OnlineEngine. After every batch each cluster it touched is written as
+ * "label mode size", a size of 0 meaning the cluster is gone. Reading,
+ * clustering and writing run on their own threads with
+ * options.queue_depth batches between them; when clustering or writing
+ * falls behind the reader stops reading, and the pipe pushes back on
+ * whoever feeds it. Throws CsvError for malformed input and
+ * system_error if reading or writing fails.
+ */
+StreamStats run_stream(int input, int output, const StreamOptions &options)
+{
+    StreamStats stats;
+    StageQueue<Grid> batches(options.queue_depth);
+    StageQueue<vector<ModeUpdate>> updates(options.queue_depth);
+
+    thread reader([&] {
+        try
+        {
+            read_batches(input, options, batches, stats);
+            Grid end;
+            batches.push(end);
+        }
+        catch (...)
+        {
+            batches.fail(current_exception());
+        }
+    });
+
+    exception_ptr write_failure;
+    thread writer([&] {
+        try
+        {
+            write_updates(output, updates);
+        }
+        catch (...)
+        {
+            write_failure = current_exception();
+            updates.stop();
+        }
+    });
+
+    exception_ptr failure;
+    try
+    {
+        unique_ptr<OnlineEngine> engine;
+        Grid batch;
+        vector<ModeUpdate> changed;
+        for (batches.pop(batch); !batch.empty(); batches.pop(batch))
+        {
+            if (!engine)
+                engine.reset(new OnlineEngine(options.dimensions, options.window,
+                                              options.merge_radius, options.shift));
+            engine->add(batch, changed);
+            stats.points += batch.size();
+            stats.batches++;
+            stats.clusters = engine->clusters();
+            if (!updates.push(changed))
+                break;
+        }
+    }
+    catch (...)
+    {
+        failure = current_exception();
+    }
+
+    batches.stop();
+    vector<ModeUpdate> end;
+    updates.push(end);
+    reader.join();
+    writer.join();
+
+    if (failure)
+        rethrow_exception(failure);
+    if (write_failure)
+        rethrow_exception(write_failure);
+    return stats;
+}
@@ -0,0 +1,333 @@
+/* 
+ * Author: Kamil S.
+ * Tile-by-tile clustering for datasets larger than memory, keeping only the
+ * tile being clustered and the one being read ahead.
+ */
+
+#include "header/out_of_core.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <system_error>
+#include <unistd.h>
+
+using namespace std;
+
+extern double AREA_RADIUS;
+
+/*
+ * Extra room on the halo so rounding in the distance can't miss a neighbor
+ */
+static const double HALO_MARGIN = 1e-9;
+
+/*
+ * Bytes buffered per open tile file while the tiles are written
+ */
+static const size_t TILE_BUFFER = 1 << 16;
+
+/*
+ * Rough heap overhead of one allocation, for the seeds' coordinates
+ */
+static const size_t ALLOCATION_OVERHEAD = 16;
+
+/*
+ * @param points The whole dataset, read once front to back, e.g. the view
+ *               of a mapped BinaryDataset
+ * @param options Where the tiles go, how much memory they may take and the
+ *                largest bandwidth_scale cluster() will be called with
+ */
+OutOfCoreEngine::OutOfCoreEngine(const PointView &points, const OutOfCoreOptions &options)
+    : settings(options), dimensions(points.dimensions), count(points.size),
+      halo(AREA_RADIUS * options.bandwidth_scale * (1 + HALO_MARGIN)), migrated(0)
+{
+    // every point is in its tile's file and, while the tile is loaded, a seed
+    size_t total_bytes = count * (dimensions * sizeof(double) + seed_bytes());
+    size_t tile_budget = max(settings.memory_budget / 2, (size_t)1);
+    int tiles_size = max((size_t)1, (total_bytes + tile_budget - 1) / tile_budget);
+
+    vector<double> sample;
+    size_t stride = max((size_t)1, count / max(settings.sample_size, (size_t)1));
+    for (size_t i = 0; i < count; i += stride)
+        sample.push_back(points[i][0]);
+    sort(sample.begin(), sample.end());
+
+    for (int t = 1; t < tiles_size && !sample.empty(); t++)
+    {
+        double splitter = sample[t * sample.size() / tiles_size];
+        if (splitters.empty() || splitter > splitters.back())
+            splitters.push_back(splitter);
+    }
+
+    // a directory of its own, so engines sharing options.directory can't
+    // overwrite or remove each other's tiles
+    string pattern = settings.directory + "/mean_shift_tiles_XXXXXX";
+    vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    if (!mkdtemp(name.data()))
+        throw system_error(errno, system_category(), "mkdtemp " + pattern);
+    tile_directory = name.data();
+
+    try
+    {
+        write_tiles(points);
+    }
+    catch (...)
+    {
+        remove_tiles();
+        throw;
+    }
+}
+
+OutOfCoreEngine::~OutOfCoreEngine()
+{
+    remove_tiles();
+}
+
+/*
+ * Removes the tile files and their directory
+ */
+void OutOfCoreEngine::remove_tiles() const
+{
+    for (int t = 0; t < tiles(); t++)
+    {
+        unlink(tile_path(t, "points").c_str());
+        unlink(tile_path(t, "seeds").c_str());
+    }
+    rmdir(tile_directory.c_str());
+}
+
+/*
+ * Bytes a seed takes while its tile is loaded, its coordinates included
+ */
+size_t OutOfCoreEngine::seed_bytes() const
+{
+    return sizeof(SeedState) + dimensions * sizeof(double) + ALLOCATION_OVERHEAD;
+}
+
+int OutOfCoreEngine::tiles() const
+{
+    return splitters.size() + 1;
+}
+
+/*
+ * Bytes of the biggest tile once loaded: its points, halo included, and
+ * its seeds
+ */
+size_t OutOfCoreEngine::largest_tile() const
+{
+    size_t largest = 0;
+    for (int t = 0; t < tiles(); t++)
+        largest = max(largest, tile_bytes[t] + seed_counts[t] * seed_bytes());
+    return largest;
+}
+
+/*
+ * Seeds that moved to another tile during the last cluster()
+ */
+long OutOfCoreEngine::migrations() const
+{
+    return migrated;
+}
+
+int OutOfCoreEngine::owner(double first_coordinate) const
+{
+    return upper_bound(splitters.begin(), splitters.end(), first_coordinate) - splitters.begin();
+}
+
+string OutOfCoreEngine::tile_path(int tile, const char *kind) const
+{
+    return tile_directory + "/tile_" + to_string(tile) + "." + kind;
+}
+
+/*
+ * One pass over the points. Every point is appended to its own tile and to
+ * the tiles whose halo it's in, so every tile keeps the points in dataset
+ * order. Its own points are also listed in the tile's seeds file as
+ * (index in the dataset, row in the tile).
+ */
+void OutOfCoreEngine::write_tiles(const PointView &points)
+{
+    int tiles_size = tiles();
+    vector<ofstream> tile_points(tiles_size), tile_seeds(tiles_size);
+    vector<vector<char>> buffers(2 * tiles_size, vector<char>(TILE_BUFFER));
+    vector<uint64_t> rows(tiles_size, 0);
+    seed_counts.assign(tiles_size, 0);
+    for (int t = 0; t < tiles_size; t++)
+    {
+        tile_points[t].rdbuf()->pubsetbuf(buffers[2 * t].data(), TILE_BUFFER);
+        tile_seeds[t].rdbuf()->pubsetbuf(buffers[2 * t + 1].data(), TILE_BUFFER);
+        tile_points[t].open(tile_path(t, "points").c_str(), ios::binary | ios::trunc);
+        tile_seeds[t].open(tile_path(t, "seeds").c_str(), ios::binary | ios::trunc);
+        if (!tile_points[t] || !tile_seeds[t])
+            throw system_error(errno, system_category(), "open " + tile_path(t, "points"));
+    }
+
+    size_t row_bytes = dimensions * sizeof(double);
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *point = reinterpret_cast<const char *>(points[i]);
+        double x = points[i][0];
+        int own = owner(x);
+        int first = owner(x - halo), last = owner(x + halo);
+        for (int t = first; t <= last; t++)
+        {
+            tile_points[t].write(point, row_bytes);
+            if (t == own)
+            {
+                uint64_t seed[2] = {i, rows[t]};
+                tile_seeds[t].write(reinterpret_cast<const char *>(seed), sizeof(seed));
+                seed_counts[t]++;
+            }
+            rows[t]++;
+        }
+    }
+
+    tile_bytes.resize(tiles_size);
+    for (int t = 0; t < tiles_size; t++)
+    {
+        tile_points[t].close();
+        tile_seeds[t].close();
+        if (!tile_points[t] || !tile_seeds[t])
+            throw system_error(errno, system_category(), "write " + tile_path(t, "points"));
+        tile_bytes[t] = rows[t] * row_bytes;
+    }
+}
+
+/*
+ * Reads a tile's points and makes a seed of each of its own points
+ */
+void OutOfCoreEngine::load_tile(int tile, vector<double> &points, vector<SeedState> &seeds) const
+{
+    points.resize(tile_bytes[tile] / sizeof(double));
+    ifstream tile_points(tile_path(tile, "points").c_str(), ios::binary);
+    tile_points.read(reinterpret_cast<char *>(points.data()), tile_bytes[tile]);
+
+    ifstream tile_seeds(tile_path(tile, "seeds").c_str(), ios::binary);
+    uint64_t seed[2];
+    seeds.clear();
+    while (tile_seeds.read(reinterpret_cast<char *>(seed), sizeof(seed)))
+    {
+        SeedState state;
+        state.index = seed[0];
+        state.iterations = 0;
+        state.x.assign(points.begin() + seed[1] * dimensions,
+                       points.begin() + (seed[1] + 1) * dimensions);
+        seeds.push_back(state);
+    }
+
+    if (!tile_points)
+        throw system_error(errno, system_category(), "read " + tile_path(tile, "points"));
+}
+
+/*
+ * @param options Convergence threshold, iteration cap and bandwidth_scale
+ *                (no bigger than the one the tiles were cut for)
+ * @param modes Optional, filled with the mode of every point
+ * @param iterations Optional, filled with the iterations of every point
+ * Every point is a seed. A first sweep clusters the tiles in order, seeds
+ * whose step leaves their tile carry on in the tile they enter: later in
+ * the same sweep, or in a further sweep over the tiles that still have
+ * seeds waiting. Each finished seed goes to report_converged(), the way to
+ * get results out without holding them all. Seeds step like plain
+ * shift_to_mode() over the points in dataset order, so the results have
+ * the same bits as cluster_seeds() on the whole grid. The other options
+ * are ignored.
+ */
+void OutOfCoreEngine::cluster(const ShiftOptions &options, Grid *modes, vector<int> *iterations)
+{
+    assert(AREA_RADIUS * options.bandwidth_scale <= halo);
+
+    double epsilon_squared = options.epsilon * options.epsilon;
+    ShiftOptions step_options;
+    step_options.bandwidth_scale = options.bandwidth_scale;
+    step_options.control = options.control;
+
+    if (modes)
+        modes->resize(count);
+    if (iterations)
+        iterations->resize(count);
+
+    int tiles_size = tiles();
+    vector<vector<SeedState>> waiting(tiles_size);
+    vector<int> order;
+    for (int t = 0; t < tiles_size; t++)
+        order.push_back(t);
+
+    migrated = 0;
+    bool first_sweep = true;
+    while (!order.empty())
+    {
+        vector<double> points, next_points;
+        vector<SeedState> seeds, next_seeds;
+        load_tile(order[0], points, seeds);
+
+        for (size_t o = 0; o < order.size(); o++)
+        {
+            future<void> prefetch;
+            if (o + 1 < order.size())
+                prefetch = async(launch::async, [&, o] {
+                    load_tile(order[o + 1], next_points, next_seeds);
+                });
+
+            int tile = order[o];
+            PointView view(points.data(), points.size() / max(dimensions, 1), dimensions);
+            if (!first_sweep)
+                seeds.clear();
+            seeds.insert(seeds.end(), waiting[tile].begin(), waiting[tile].end());
+            waiting[tile].clear();
+
+            for (SeedState &seed : seeds)
+            {
+                Coord shifted;
+                while (true)
+                {
+                    shift_point(seed.x, view, step_options, shifted);
+                    seed.iterations++;
+
+                    Coord *mode = NULL;
+                    if (seed.iterations >= max(options.max_iterations, 1))
+                        mode = &seed.x;
+                    else if (squared_euclidean_distance(seed.x, shifted) <= epsilon_squared)
+                        mode = &shifted;
+                    if (mode)
+                    {
+                        if (modes)
+                            (*modes)[seed.index] = *mode;
+                        if (iterations)
+                            (*iterations)[seed.index] = seed.iterations;
+                        report_converged(options, seed.index, *mode, seed.iterations);
+                        break;
+                    }
+
+                    seed.x = shifted;
+                    int next = owner(seed.x[0]);
+                    if (next != tile)
+                    {
+                        waiting[next].push_back(seed);
+                        migrated++;
+                        break;
+                    }
+                }
+            }
+
+            if (prefetch.valid())
+            {
+                prefetch.get();
+                points.swap(next_points);
+                seeds.swap(next_seeds);
+            }
+        }
+
+        order.clear();
+        for (int t = 0; t < tiles_size; t++)
+            if (!waiting[t].empty())
+                order.push_back(t);
+        first_sweep = false;
+    }
+}
@@ -0,0 +1,555 @@
+/* 
+ * Author: Kamil S.
+ * Turns converged modes into clusters and writes them out, formatting and
+ * encoding rows in parallel chunks.
+ */
+
+#include "header/results.h"
+#include "header/npy.h"
+#include "header/spatial_hash.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef OMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+extern double KERNEL_BANDWIDTH;
+
+/*
+ * Longest text format_double() and format_int() produce, sign included
+ */
+static const size_t MAX_NUMBER_TEXT = 32;
+
+/*
+ * @param modes Mode every seed converged to
+ * @param clusters Filled with one mode per cluster, the first one found
+ * @param labels Filled with the cluster of every seed
+ * @param sizes Filled with the number of seeds in every cluster
+ * @param merge_radius Modes closer than this are the same cluster,
+ *                     half of KERNEL_BANDWIDTH if 0
+ * Seeds are labeled in order, each joining the closest cluster within
+ * merge_radius or starting a new one, so labels don't depend on threads.
+ */
+void label_modes(Grid &modes, Grid &clusters, vector<int> &labels, vector<int> &sizes,
+                 double merge_radius)
+{
+    if (merge_radius <= 0)
+        merge_radius = 0.5 * KERNEL_BANDWIDTH;
+
+    SpatialHash index(merge_radius);
+    clusters.clear();
+    sizes.clear();
+    labels.resize(modes.size());
+    for (size_t s = 0; s < modes.size(); s++)
+    {
+        int label;
+        if (!index.find_within(modes[s], merge_radius, label))
+        {
+            label = clusters.size();
+            clusters.push_back(modes[s]);
+            sizes.push_back(0);
+            index.insert(modes[s], label);
+        }
+        labels[s] = label;
+        sizes[label]++;
+    }
+}
+
+static size_t format_int(long value, char *buffer)
+{
+    char digits[MAX_NUMBER_TEXT];
+    size_t length = 0;
+    unsigned long magnitude = value < 0 ? -(unsigned long)value : value;
+    do
+    {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+
+    size_t written = 0;
+    if (value < 0)
+        buffer[written++] = '-';
+    while (length)
+        buffer[written++] = digits[--length];
+    return written;
+}
+
+/*
+ * A double as f * 2^e with a 64 bit f, the number type of Grisu
+ */
+struct DiyFp
+{
+    uint64_t f;
+    int e;
+    DiyFp(uint64_t f, int e) : f(f), e(e) {}
+};
+
+/*
+ * Normalized 10^k for k = -348, -340, ..., 340: CACHED_POWER_F[i] * 2^CACHED_POWER_E[i]
+ */
+static const uint64_t CACHED_POWER_F[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+static const int16_t CACHED_POWER_E[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066
+};
+static const uint32_t POW10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static DiyFp multiply(const DiyFp &a, const DiyFp &b)
+{
+    const uint64_t M32 = 0xFFFFFFFFu;
+    uint64_t a_hi = a.f >> 32, a_lo = a.f & M32, b_hi = b.f >> 32, b_lo = b.f & M32;
+    uint64_t hi_hi = a_hi * b_hi, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, lo_lo = a_lo * b_lo;
+    uint64_t middle = (lo_lo >> 32) + (hi_lo & M32) + (lo_hi & M32) + (1u << 31);
+    return DiyFp(hi_hi + (hi_lo >> 32) + (lo_hi >> 32) + (middle >> 32), a.e + b.e + 64);
+}
+
+static DiyFp normalize(DiyFp value)
+{
+    while (!(value.f & (1ULL << 63)))
+    {
+        value.f <<= 1;
+        value.e--;
+    }
+    return value;
+}
+
+/*
+ * Nudges the last digit down while that stays inside the rounding interval
+ * and gets closer to the exact value
+ */
+static void round_last_digit(char *digits, int length, uint64_t delta, uint64_t rest,
+                             uint64_t ten_kappa, uint64_t distance)
+{
+    while (rest < distance && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < distance || distance - rest > rest + ten_kappa - distance))
+    {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/*
+ * Grisu2: writes the digits of a positive finite 'value' to 'digits' and
+ * returns how many, the value being digits * 10^exponent. The digits always
+ * read back to 'value' and are the shortest such for all but about 1% of
+ * doubles, which get one digit more.
+ */
+static int shortest_digits(double value, char *digits, int &exponent)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint64_t HIDDEN_BIT = 1ULL << 52;
+    uint64_t significand = bits & (HIDDEN_BIT - 1);
+    int biased = (bits >> 52) & 0x7FF;
+    DiyFp v = biased ? DiyFp(significand + HIDDEN_BIT, biased - 1075) : DiyFp(significand, -1074);
+
+    // the neighbours halfway to the next doubles bound the digits we may pick
+    DiyFp upper = normalize(DiyFp((v.f << 1) + 1, v.e - 1));
+    DiyFp lower = v.f == HIDDEN_BIT ? DiyFp((v.f << 2) - 1, v.e - 2) : DiyFp((v.f << 1) - 1, v.e - 1);
+    lower.f <<= lower.e - upper.e;
+    lower.e = upper.e;
+
+    // a power of ten that brings the upper bound's exponent to about -61
+    double estimate = (-61 - upper.e) * 0.30102999566398114 + 347;
+    int k = (int)estimate;
+    if (estimate - k > 0)
+        k++;
+    int index = (k >> 3) + 1;
+    exponent = 348 - index * 8;
+    DiyFp power(CACHED_POWER_F[index], CACHED_POWER_E[index]);
+
+    DiyFp w = multiply(normalize(v), power);
+    DiyFp high = multiply(upper, power), low = multiply(lower, power);
+    high.f--;
+    low.f++;
+    uint64_t delta = high.f - low.f;
+    uint64_t distance = high.f - w.f;
+
+    DiyFp one(1ULL << -high.e, high.e);
+    uint32_t integral = high.f >> -one.e;
+    uint64_t fraction = high.f & (one.f - 1);
+    int kappa = 10;
+    while (kappa > 0 && integral < POW10[kappa - 1])
+        kappa--;
+
+    int length = 0;
+    while (kappa > 0)
+    {
+        uint32_t digit = integral / POW10[kappa - 1];
+        integral %= POW10[kappa - 1];
+        if (digit || length)
+            digits[length++] = '0' + digit;
+        kappa--;
+        uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest <= delta)
+        {
+            exponent += kappa;
+            round_last_digit(digits, length, delta, rest, (uint64_t)POW10[kappa] << -one.e, distance);
+            return length;
+        }
+    }
+    for (;;)
+    {
+        fraction *= 10;
+        delta *= 10;
+        char digit = fraction >> -one.e;
+        if (digit || length)
+            digits[length++] = '0' + digit;
+        fraction &= one.f - 1;
+        kappa--;
+        if (fraction < delta)
+        {
+            exponent += kappa;
+            round_last_digit(digits, length, delta, fraction, one.f,
+                             -kappa < 10 ? distance * POW10[-kappa] : 0);
+            return length;
+        }
+    }
+}
+
+/*
+ * Writes the shortest text that parses back to exactly 'value' into
+ * 'buffer' (at least MAX_NUMBER_TEXT bytes) and returns its length.
+ * Digits come from shortest_digits(), laid out like %g would.
+ */
+size_t format_double(double value, char *buffer)
+{
+    if (value != value || value - value != 0)
+        return snprintf(buffer, MAX_NUMBER_TEXT, "%g", value);
+
+    char *out = buffer;
+    if (signbit(value))
+    {
+        *out++ = '-';
+        value = -value;
+    }
+    if (value == 0)
+    {
+        *out++ = '0';
+        return out - buffer;
+    }
+
+    char digits[MAX_NUMBER_TEXT];
+    int exponent;
+    int length = shortest_digits(value, digits, exponent);
+    int point = length + exponent;
+    if (point > 0 && point <= 17)
+    {
+        // 123, 1230 or 1.23
+        if (point >= length)
+        {
+            memcpy(out, digits, length);
+            memset(out + length, '0', point - length);
+            out += point;
+        }
+        else
+        {
+            memcpy(out, digits, point);
+            out[point] = '.';
+            memcpy(out + point + 1, digits + point, length - point);
+            out += length + 1;
+        }
+    }
+    else if (point > -4 && point <= 0)
+    {
+        // 0.00123
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -point);
+        out += -point;
+        memcpy(out, digits, length);
+        out += length;
+    }
+    else
+    {
+        // 1.23e-45
+        *out++ = digits[0];
+        if (length > 1)
+        {
+            *out++ = '.';
+            memcpy(out, digits + 1, length - 1);
+            out += length - 1;
+        }
+        *out++ = 'e';
+        out += format_int(point - 1, out);
+    }
+    return out - buffer;
+}
+
+static void write_fully(int fd, const char *data, size_t size, off_t offset, const string &path)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw system_error(errno, system_category(), "write " + path);
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+/*
+ * Row writers fill 'out' with row 'row' and return how many bytes they used
+ */
+typedef function<size_t(size_t row, char *out)> RowWriter;
+
+/*
+ * Writes 'rows' rows in batches of options.threads chunks of
+ * options.chunk_rows rows. The chunks of a batch are formatted in parallel
+ * in the OMP build. Binary rows have a fixed size so every chunk is written
+ * at its offset straight away, CSV chunks are written in order once the
+ * batch is formatted. 'prefix' goes at the start of the file.
+ */
+static void write_rows(const string &path, const string &prefix, size_t rows, size_t max_row_bytes,
+                       bool fixed_size, RowWriter write_row, const WriteOptions &options)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw system_error(errno, system_category(), "open " + path);
+
+    int threads = 1;
+#ifdef OMP
+    threads = options.threads > 0 ? options.threads : omp_get_max_threads();
+#endif
+    size_t chunk_rows = max(options.chunk_rows, (size_t)1);
+
+    try
+    {
+        write_fully(fd, prefix.data(), prefix.size(), 0, path);
+        off_t offset = prefix.size();
+
+        vector<vector<char>> buffers(threads);
+        vector<size_t> used(threads);
+        for (size_t batch = 0; batch < rows; batch += threads * chunk_rows)
+        {
+            int failure = 0;
+#ifdef OMP
+#pragma omp parallel for num_threads(threads)
+#endif
+            for (int c = 0; c < threads; c++)
+            {
+                size_t begin = min(rows, batch + c * chunk_rows);
+                size_t end = min(rows, begin + chunk_rows);
+                buffers[c].resize((end - begin) * max_row_bytes);
+                char *out = buffers[c].data();
+                for (size_t row = begin; row < end; row++)
+                    out += write_row(row, out);
+                used[c] = out - buffers[c].data();
+
+                if (fixed_size && used[c] > 0)
+                {
+                    try
+                    {
+                        write_fully(fd, buffers[c].data(), used[c],
+                                    offset + begin * max_row_bytes - batch * max_row_bytes, path);
+                    }
+                    catch (const system_error &error)
+                    {
+#ifdef OMP
+#pragma omp atomic write
+#endif
+                        failure = error.code().value();
+                    }
+                }
+            }
+
+            if (failure)
+                throw system_error(failure, system_category(), "write " + path);
+
+            for (int c = 0; c < threads; c++)
+            {
+                if (!fixed_size)
+                    write_fully(fd, buffers[c].data(), used[c], offset, path);
+                offset += used[c];
+            }
+
+            if (options.sync == SYNC_EVERY_BATCH && fdatasync(fd) != 0)
+                throw system_error(errno, system_category(), "fdatasync " + path);
+        }
+
+        if (options.sync != SYNC_NONE && fsync(fd) != 0)
+            throw system_error(errno, system_category(), "fsync " + path);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+
+    if (close(fd) != 0)
+        throw system_error(errno, system_category(), "close " + path);
+}
+
+static string binary_header(size_t dimensions, uint32_t columns, size_t count)
+{
+    ResultsHeader header;
+    memcpy(header.magic, RESULTS_MAGIC, sizeof(header.magic));
+    header.version = RESULTS_VERSION;
+    header.dimensions = dimensions;
+    header.columns = columns;
+    header.count = count;
+    return string(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+/*
+ * What goes in front of the rows: nothing for CSV, a ResultsHeader or a
+ * .npy header of count x (dimensions + columns) float64
+ */
+static string results_prefix(ResultsFormat format, size_t dimensions, uint32_t columns,
+                             size_t count)
+{
+    if (format == RESULTS_BINARY)
+        return binary_header(dimensions, columns, count);
+    if (format == RESULTS_NPY)
+        return npy_header(SCALAR_FLOAT64, count, dimensions + columns);
+    return string();
+}
+
+/*
+ * Writes a point followed by 'values', as text, binary or a .npy row
+ */
+static size_t write_record(const Coord &point, const int *values, int values_size,
+                           ResultsFormat format, char *out)
+{
+    char *start = out;
+    if (format != RESULTS_CSV)
+    {
+        memcpy(out, point.data(), point.size() * sizeof(double));
+        out += point.size() * sizeof(double);
+        for (int v = 0; v < values_size; v++)
+        {
+            if (format == RESULTS_NPY)
+            {
+                double value = values[v];
+                memcpy(out, &value, sizeof(value));
+                out += sizeof(value);
+            }
+            else
+            {
+                int32_t value = values[v];
+                memcpy(out, &value, sizeof(value));
+                out += sizeof(value);
+            }
+        }
+        return out - start;
+    }
+
+    for (double coordinate : point)
+    {
+        out += format_double(coordinate, out);
+        *out++ = ' ';
+    }
+    for (int v = 0; v < values_size; v++)
+    {
+        out += format_int(values[v], out);
+        *out++ = v + 1 < values_size ? ' ' : '\n';
+    }
+    return out - start;
+}
+
+static size_t max_record_bytes(size_t dimensions, int values_size, ResultsFormat format)
+{
+    if (format == RESULTS_BINARY)
+        return dimensions * sizeof(double) + values_size * sizeof(int32_t);
+    if (format == RESULTS_NPY)
+        return (dimensions + values_size) * sizeof(double);
+    return (dimensions + values_size) * (MAX_NUMBER_TEXT + 1);
+}
+
+/*
+ * @param path File to write, replaced if it exists
+ * @param modes Mode every seed converged to
+ * @param labels Cluster of every seed, from label_modes()
+ * @param iterations Iterations every seed needed
+ * One row per seed: the mode's coordinates, the label and the iterations.
+ * CSV rows are space separated like the datasets, doubles are written with
+ * format_double() so they read back to the same bits. Binary results start
+ * with a ResultsHeader. RESULTS_NPY writes a float64 .npy array with the
+ * same columns, for numpy.load().
+ */
+void write_seed_results(const string &path, Grid &modes, vector<int> &labels,
+                        vector<int> &iterations, const WriteOptions &options)
+{
+    size_t dimensions = modes.empty() ? 0 : modes[0].size();
+    ResultsFormat format = options.format;
+    write_rows(path, results_prefix(format, dimensions, 2, modes.size()), modes.size(),
+               max_record_bytes(dimensions, 2, format), format != RESULTS_CSV,
+               [&](size_t row, char *out) {
+                   int values[2] = {labels[row], iterations[row]};
+                   return write_record(modes[row], values, 2, format, out);
+               },
+               options);
+}
+
+/*
+ * @param path File to write, replaced if it exists
+ * @param clusters One mode per cluster, from label_modes()
+ * @param sizes Seeds in every cluster
+ * One row per cluster: the mode's coordinates and the size, in the same
+ * formats as write_seed_results().
+ */
+void write_cluster_results(const string &path, Grid &clusters, vector<int> &sizes,
+                           const WriteOptions &options)
+{
+    size_t dimensions = clusters.empty() ? 0 : clusters[0].size();
+    ResultsFormat format = options.format;
+    write_rows(path, results_prefix(format, dimensions, 1, clusters.size()), clusters.size(),
+               max_record_bytes(dimensions, 1, format), format != RESULTS_CSV,
+               [&](size_t row, char *out) {
+                   return write_record(clusters[row], &sizes[row], 1, format, out);
+               },
+               options);
+}
@@ -0,0 +1,567 @@
+/*
+ * Author: Kamil S.
+ * Reads datasets split over many files with many reads in flight, through
+ * io_uring where the kernel has it, and parses the blocks as they land.
+ */
+
+#include "header/shard_reader.h"
+#include "header/bandwidth_estimation.h"
+#include "header/csv.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef WITH_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+#ifdef WITH_URING
+
+/*
+ * The bare io_uring system calls: a submission and a completion ring
+ * mapped from the kernel, without liburing. Throws system_error if the
+ * kernel won't set one up (too old, or disabled by a sysctl or seccomp).
+ */
+class UringQueue {
+public:
+    explicit UringQueue(unsigned entries) : ring_fd(-1), submit_ring(MAP_FAILED),
+        complete_ring(MAP_FAILED), entries_map(MAP_FAILED), queued(0), fixed(false),
+        vectors(entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0)
+            throw system_error(errno, system_category(), "io_uring_setup");
+
+        submit_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        complete_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            submit_bytes = complete_bytes = max(submit_bytes, complete_bytes);
+        entries_bytes = params.sq_entries * sizeof(io_uring_sqe);
+
+        submit_ring = mmap(NULL, submit_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            complete_ring = submit_ring;
+        else
+            complete_ring = mmap(NULL, complete_bytes, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        entries_map = mmap(NULL, entries_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_SQES);
+        if (submit_ring == MAP_FAILED || complete_ring == MAP_FAILED || entries_map == MAP_FAILED)
+        {
+            int error = errno;
+            unmap();
+            throw system_error(error, system_category(), "mmap io_uring");
+        }
+
+        char *submit = static_cast<char *>(submit_ring);
+        submit_tail = reinterpret_cast<unsigned *>(submit + params.sq_off.tail);
+        submit_mask = *reinterpret_cast<unsigned *>(submit + params.sq_off.ring_mask);
+        submit_array = reinterpret_cast<unsigned *>(submit + params.sq_off.array);
+        char *complete = static_cast<char *>(complete_ring);
+        complete_head = reinterpret_cast<unsigned *>(complete + params.cq_off.head);
+        complete_tail = reinterpret_cast<unsigned *>(complete + params.cq_off.tail);
+        complete_mask = *reinterpret_cast<unsigned *>(complete + params.cq_off.ring_mask);
+        completions = reinterpret_cast<io_uring_cqe *>(complete + params.cq_off.cqes);
+        submissions = static_cast<io_uring_sqe *>(entries_map);
+    }
+
+    ~UringQueue()
+    {
+        unmap();
+    }
+
+    /*
+     * Registers one buffer per slot so reads go straight into pinned
+     * memory. Returns false if the kernel refused, e.g. over RLIMIT_MEMLOCK,
+     * then plain vectored reads are used.
+     */
+    bool register_buffers(vector<iovec> &buffers)
+    {
+        fixed = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS,
+                        buffers.data(), buffers.size()) == 0;
+        return fixed;
+    }
+
+    /*
+     * Queues a read of 'size' bytes into slot 'slot''s buffer at 'buffer'
+     */
+    void read(size_t slot, int fd, char *buffer, size_t size, uint64_t offset)
+    {
+        unsigned tail = *submit_tail;
+        unsigned index = tail & submit_mask;
+        io_uring_sqe &entry = submissions[index];
+        memset(&entry, 0, sizeof(entry));
+        entry.fd = fd;
+        entry.off = offset;
+        entry.user_data = slot;
+        if (fixed)
+        {
+            entry.opcode = IORING_OP_READ_FIXED;
+            entry.addr = reinterpret_cast<uint64_t>(buffer);
+            entry.len = size;
+            entry.buf_index = slot;
+        }
+        else
+        {
+            vectors[slot].iov_base = buffer;
+            vectors[slot].iov_len = size;
+            entry.opcode = IORING_OP_READV;
+            entry.addr = reinterpret_cast<uint64_t>(&vectors[slot]);
+            entry.len = 1;
+        }
+        submit_array[index] = index;
+        __atomic_store_n(submit_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+    }
+
+    /*
+     * Submits the queued reads and waits until at least one has completed
+     */
+    void submit_and_wait()
+    {
+        while (true)
+        {
+            int submitted = syscall(__NR_io_uring_enter, ring_fd, queued, 1,
+                                    IORING_ENTER_GETEVENTS, NULL, 0);
+            if (submitted >= 0)
+            {
+                queued -= submitted;
+                return;
+            }
+            if (errno != EINTR)
+                throw system_error(errno, system_category(), "io_uring_enter");
+        }
+    }
+
+    /*
+     * Takes one completion off the ring, returns false if there's none
+     */
+    bool pop(size_t &slot, int &result)
+    {
+        unsigned head = *complete_head;
+        if (head == __atomic_load_n(complete_tail, __ATOMIC_ACQUIRE))
+            return false;
+        io_uring_cqe &completion = completions[head & complete_mask];
+        slot = completion.user_data;
+        result = completion.res;
+        __atomic_store_n(complete_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    UringQueue(const UringQueue &);
+    UringQueue &operator=(const UringQueue &);
+
+    void unmap()
+    {
+        if (entries_map != MAP_FAILED)
+            munmap(entries_map, entries_bytes);
+        if (complete_ring != MAP_FAILED && complete_ring != submit_ring)
+            munmap(complete_ring, complete_bytes);
+        if (submit_ring != MAP_FAILED)
+            munmap(submit_ring, submit_bytes);
+        if (ring_fd >= 0)
+            close(ring_fd);
+    }
+
+    int ring_fd;
+    void *submit_ring, *complete_ring, *entries_map;
+    size_t submit_bytes, complete_bytes, entries_bytes;
+    unsigned *submit_tail, *submit_array, submit_mask;
+    unsigned *complete_head, *complete_tail, complete_mask;
+    io_uring_sqe *submissions;
+    io_uring_cqe *completions;
+    unsigned queued;
+    bool fixed;
+    vector<iovec> vectors;
+};
+
+#else
+
+class UringQueue {
+};
+
+#endif
+
+/*
+ * @param paths Shards, read in this order
+ * @param block_size Bytes per read
+ * @param depth Reads in flight at once with io_uring, one buffer each
+ * @param use_uring Whether to try io_uring at all
+ */
+ShardReader::ShardReader(const vector<string> &paths, size_t block_size, unsigned depth,
+                         bool use_uring)
+    : paths(paths), fds(paths.size(), -1), sizes(paths.size()), blocks_left(paths.size()),
+      block_size(max(block_size, (size_t)1)), next_shard(0), next_offset(0), in_flight(0)
+{
+    for (size_t s = 0; s < paths.size(); s++)
+    {
+        struct stat status;
+        if (stat(paths[s].c_str(), &status) != 0)
+            throw system_error(errno, system_category(), "stat " + paths[s]);
+        sizes[s] = status.st_size;
+        blocks_left[s] = (sizes[s] + this->block_size - 1) / this->block_size;
+    }
+    while (next_shard < paths.size() && sizes[next_shard] == 0)
+        next_shard++;
+
+#ifdef WITH_URING
+    if (use_uring)
+    {
+        try
+        {
+            uring.reset(new UringQueue(max(depth, 1u)));
+        }
+        catch (const system_error &)
+        {
+        }
+    }
+#else
+    (void)use_uring;
+#endif
+
+    slots.resize(uring ? max(depth, 1u) : 1);
+    for (Slot &slot : slots)
+    {
+        slot.buffer.resize(this->block_size);
+        slot.busy = false;
+    }
+
+#ifdef WITH_URING
+    if (uring)
+    {
+        vector<iovec> buffers(slots.size());
+        for (size_t s = 0; s < slots.size(); s++)
+        {
+            buffers[s].iov_base = slots[s].buffer.data();
+            buffers[s].iov_len = slots[s].buffer.size();
+        }
+        uring->register_buffers(buffers);
+    }
+#endif
+}
+
+ShardReader::~ShardReader()
+{
+    // the kernel may still be writing into the buffers of reads in flight
+#ifdef WITH_URING
+    while (uring && in_flight > 0)
+    {
+        try
+        {
+            uring->submit_and_wait();
+        }
+        catch (const system_error &)
+        {
+            break;
+        }
+        size_t slot;
+        int result;
+        while (uring->pop(slot, result))
+            in_flight--;
+    }
+#endif
+    for (int fd : fds)
+        if (fd >= 0)
+            close(fd);
+}
+
+bool ShardReader::uses_uring() const
+{
+    return uring != NULL;
+}
+
+void ShardReader::open_shard(size_t shard)
+{
+    fds[shard] = open(paths[shard].c_str(), O_RDONLY);
+    if (fds[shard] < 0)
+        throw system_error(errno, system_category(), "open " + paths[shard]);
+    posix_fadvise(fds[shard], 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+void ShardReader::close_shard(size_t shard)
+{
+    close(fds[shard]);
+    fds[shard] = -1;
+}
+
+/*
+ * Points slot 'slot' at the next block, opening its shard if it's the
+ * first one. Returns false once every block has been issued.
+ */
+bool ShardReader::issue(size_t slot)
+{
+    if (next_shard >= paths.size())
+        return false;
+
+    Slot &target = slots[slot];
+    target.shard = next_shard;
+    target.offset = next_offset;
+    target.size = min<uint64_t>(block_size, sizes[next_shard] - next_offset);
+    target.filled = 0;
+    target.busy = true;
+    if (next_offset == 0)
+        open_shard(next_shard);
+
+    next_offset += target.size;
+    if (next_offset == sizes[next_shard])
+    {
+        next_offset = 0;
+        do
+            next_shard++;
+        while (next_shard < paths.size() && sizes[next_shard] == 0);
+    }
+    return true;
+}
+
+/*
+ * The synchronous fallback: reads the slot's block with pread()
+ */
+void ShardReader::read_slot(size_t slot)
+{
+    Slot &target = slots[slot];
+    while (target.filled < target.size)
+    {
+        ssize_t got = pread(fds[target.shard], target.buffer.data() + target.filled,
+                            target.size - target.filled, target.offset + target.filled);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            throw system_error(errno, system_category(), "read " + paths[target.shard]);
+        if (got == 0)
+            throw runtime_error(paths[target.shard] + ": shrank while being read");
+        target.filled += got;
+    }
+}
+
+/*
+ * Waits for the next block to be read. Returns false when all of them
+ * have been handed over.
+ */
+bool ShardReader::next(ShardBlock &block)
+{
+    while (completed.empty())
+    {
+        if (!uring)
+        {
+            if (!issue(0))
+                return false;
+            read_slot(0);
+            completed.push_back(0);
+            break;
+        }
+
+#ifdef WITH_URING
+        for (size_t s = 0; s < slots.size(); s++)
+        {
+            if (!slots[s].busy && issue(s))
+            {
+                uring->read(s, fds[slots[s].shard], slots[s].buffer.data(), slots[s].size,
+                            slots[s].offset);
+                in_flight++;
+            }
+        }
+        if (in_flight == 0)
+            return false;
+
+        uring->submit_and_wait();
+        size_t s;
+        int result;
+        while (uring->pop(s, result))
+        {
+            Slot &done = slots[s];
+            if (result < 0)
+            {
+                in_flight--;
+                throw system_error(-result, system_category(), "read " + paths[done.shard]);
+            }
+            if (result == 0)
+            {
+                in_flight--;
+                throw runtime_error(paths[done.shard] + ": shrank while being read");
+            }
+            done.filled += result;
+            if (done.filled < done.size)
+            {
+                // a short read, ask for the rest
+                uring->read(s, fds[done.shard], done.buffer.data() + done.filled,
+                            done.size - done.filled, done.offset + done.filled);
+                continue;
+            }
+            in_flight--;
+            completed.push_back(s);
+        }
+#endif
+    }
+
+    size_t slot = completed.front();
+    completed.erase(completed.begin());
+    Slot &done = slots[slot];
+    if (--blocks_left[done.shard] == 0)
+        close_shard(done.shard);
+
+    block.slot = slot;
+    block.shard = done.shard;
+    block.offset = done.offset;
+    block.data = done.buffer.data();
+    block.size = done.size;
+    block.last = done.offset + done.size == sizes[done.shard];
+    return true;
+}
+
+/*
+ * Gives the block's buffer back for another read
+ */
+void ShardReader::release(const ShardBlock &block)
+{
+    slots[block.slot].busy = false;
+}
+
+/*
+ * Where one shard's parse has got to. 'parameters' is where the first
+ * line goes, if it holds AREA_RADIUS and KERNEL_BANDWIDTH.
+ */
+struct ShardParse {
+    uint64_t next_offset;
+    size_t line;
+    string partial;
+    Grid points;
+    double *parameters;
+    map<uint64_t, ShardBlock> early;
+
+    ShardParse() : next_offset(0), line(1), parameters(NULL) {}
+};
+
+static void parse_lines(ShardParse &shard, const char *begin, const char *end, int dimensions,
+                        int threads)
+{
+    parse_csv(begin, end, dimensions, shard.points, shard.parameters, threads, shard.line);
+    shard.line += count(begin, end, '\n');
+    shard.parameters = NULL;
+}
+
+/*
+ * Parses the complete lines of 'block', starting with the line left
+ * partial at the end of the previous block of the shard. The tail of the
+ * last block needs no newline.
+ */
+static void parse_block(ShardParse &shard, const ShardBlock &block, int dimensions)
+{
+    const char *begin = block.data, *end = block.data + block.size;
+    if (!shard.partial.empty())
+    {
+        const char *newline = static_cast<const char *>(memchr(begin, '\n', end - begin));
+        if (!newline && !block.last)
+        {
+            shard.partial.append(begin, end);
+            return;
+        }
+        const char *line_end = newline ? newline + 1 : end;
+        shard.partial.append(begin, line_end);
+        parse_lines(shard, shard.partial.data(), shard.partial.data() + shard.partial.size(),
+                    dimensions, 1);
+        shard.partial.clear();
+        begin = line_end;
+    }
+
+    const char *stop = end;
+    if (!block.last)
+    {
+        const char *newline = static_cast<const char *>(memrchr(begin, '\n', end - begin));
+        stop = newline ? newline + 1 : begin;
+    }
+    if (stop > begin)
+        parse_lines(shard, begin, stop, dimensions, 0);
+    shard.partial.assign(stop, end);
+}
+
+/*
+ * @param paths CSV shards of one dataset, the points come out in this order
+ * @param dimensions Values on every line
+ * @param has_parameters If true the first line of the first shard holds
+ *                       AREA_RADIUS and KERNEL_BANDWIDTH, otherwise they are
+ *                       estimated with estimate_parameters()
+ * @param use_uring Whether to try io_uring, see ShardReader
+ * @param block_size Bytes per read
+ * Same as grid_from_path() over the shards concatenated, it's up to the
+ * callee to free the Grid. Blocks are parsed as they complete, while the
+ * next reads are in flight; a block that lands before the earlier ones of
+ * its shard waits for them. Throws CsvError, with the line within its
+ * shard, for a malformed line.
+ */
+Grid &grid_from_shards(const vector<string> &paths, int dimensions, bool has_parameters,
+                       bool use_uring, size_t block_size)
+{
+    ShardReader reader(paths, block_size, 32, use_uring);
+    vector<ShardParse> shards(paths.size());
+    double parameters[2];
+    if (has_parameters && !shards.empty())
+        shards[0].parameters = parameters;
+
+    ShardBlock block;
+    while (reader.next(block))
+    {
+        ShardParse &shard = shards[block.shard];
+        if (block.offset != shard.next_offset)
+        {
+            shard.early[block.offset] = block;
+            continue;
+        }
+
+        while (true)
+        {
+            parse_block(shard, block, dimensions);
+            shard.next_offset += block.size;
+            reader.release(block);
+
+            map<uint64_t, ShardBlock>::iterator waiting = shard.early.find(shard.next_offset);
+            if (waiting == shard.early.end())
+                break;
+            block = waiting->second;
+            shard.early.erase(waiting);
+        }
+    }
+
+    Grid *grid = new Grid();
+    size_t total = 0;
+    for (ShardParse &shard : shards)
+        total += shard.points.size();
+    grid->reserve(total);
+    for (ShardParse &shard : shards)
+    {
+        grid->insert(grid->end(), make_move_iterator(shard.points.begin()),
+                     make_move_iterator(shard.points.end()));
+        Grid().swap(shard.points);
+    }
+
+    if (!has_parameters)
+        estimate_parameters(*grid);
+    else if (shards.empty() || shards[0].parameters)
+    {
+        delete grid;
+        throw CsvError(1, "missing AREA_RADIUS and KERNEL_BANDWIDTH");
+    }
+    else
+    {
+        AREA_RADIUS = parameters[0];
+        KERNEL_BANDWIDTH = parameters[1];
+    }
+    return *grid;
+}
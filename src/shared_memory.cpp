@@ -0,0 +1,295 @@
+/* 
+ * Author: Kamil S.
+ * Clustering in worker processes that share one read-only copy of the
+ * points and take seed ranges from a queue in shared memory, so a crashing
+ * worker can't take the coordinator down with it.
+ */
+
+#include "header/shared_memory.h"
+#include "header/mode_registry.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+extern double KERNEL_BANDWIDTH;
+
+static_assert(ATOMIC_LONG_LOCK_FREE == 2, "the work queue needs lock-free atomics across processes");
+
+/*
+ * Times a seed may take a retry worker down before it's given up on
+ */
+static const int SEED_RETRIES = 2;
+
+/*
+ * Header of the work segment, followed by the seeds, the modes, the
+ * iterations and a done flag per seed.
+ */
+struct WorkQueue {
+    atomic<long> next_seed;
+    long seeds;
+    int dimensions;
+    int chunk;
+};
+
+/*
+ * @param tag Part of the segment's name, to tell segments apart in /dev/shm
+ * @param bytes Size of the segment
+ * Creates a POSIX shared memory segment, maps it read-write and unlinks it,
+ * so it's shared with processes forked afterwards and freed with the last
+ * mapping. Throws system_error if the system refuses.
+ */
+void *map_shared_segment(const string &tag, size_t bytes)
+{
+    static atomic<int> segments(0);
+    stringstream name;
+    name << "/mean_shift." << getpid() << "." << tag << "." << segments++;
+
+    int fd = shm_open(name.str().c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        throw system_error(errno, system_category(), "shm_open " + name.str());
+    shm_unlink(name.str().c_str());
+
+    if (ftruncate(fd, max(bytes, (size_t)1)) != 0)
+    {
+        int error = errno;
+        close(fd);
+        throw system_error(error, system_category(), "ftruncate " + name.str());
+    }
+
+    void *mapping = mmap(NULL, max(bytes, (size_t)1), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw system_error(error, system_category(), "mmap " + name.str());
+
+    return mapping;
+}
+
+/*
+ * @param points Copied into the segment, can be freed afterwards
+ */
+SharedPoints::SharedPoints(const Grid &points)
+{
+    size_t size = points.size();
+    int dimensions = size ? points[0].size() : 0;
+    bytes = max(size * dimensions * sizeof(double), (size_t)1);
+    mapping = map_shared_segment("points", bytes);
+
+    double *data = static_cast<double *>(mapping);
+    for (const Coord &point : points)
+        data = copy(point.begin(), point.end(), data);
+
+    mprotect(mapping, bytes, PROT_READ);
+    this->points = PointView(static_cast<double *>(mapping), size, dimensions);
+}
+
+SharedPoints::~SharedPoints()
+{
+    munmap(mapping, bytes);
+}
+
+PointView SharedPoints::view() const
+{
+    return points;
+}
+
+/*
+ * Runs seed 's' of the work segment and marks it done
+ */
+static void run_seed(WorkQueue &queue, long s, const PointView &points, const ShiftOptions &options,
+                     ModeRegistry &known_modes)
+{
+    long seeds_size = queue.seeds;
+    int dimensions = queue.dimensions;
+    const double *seeds = reinterpret_cast<const double *>(&queue + 1);
+    double *modes = const_cast<double *>(seeds) + seeds_size * dimensions;
+    int *iterations = reinterpret_cast<int *>(modes + seeds_size * dimensions);
+    char *done = reinterpret_cast<char *>(iterations + seeds_size);
+
+    Coord seed(seeds + s * dimensions, seeds + (s + 1) * dimensions);
+    Coord mode = shift_to_mode(seed, points, iterations[s], options, NULL, &known_modes);
+    if (options.snap_to_modes)
+        known_modes.add(mode, options.snap_fraction * KERNEL_BANDWIDTH);
+    copy(mode.begin(), mode.end(), modes + s * dimensions);
+    done[s] = 1;
+}
+
+/*
+ * Body of a worker process: takes 'chunk' seeds at a time off the queue
+ * until there are none left.
+ */
+static void run_worker(WorkQueue &queue, const PointView &points, const ShiftOptions &options)
+{
+    ModeRegistry known_modes(options.snap_to_modes ? queue.seeds : 0);
+    while (true)
+    {
+        long begin = queue.next_seed.fetch_add(queue.chunk);
+        if (begin >= queue.seeds)
+            return;
+
+        long end = min(begin + queue.chunk, queue.seeds);
+        for (long s = begin; s < end; s++)
+            run_seed(queue, s, points, options, known_modes);
+    }
+}
+
+static void wait_for(pid_t child)
+{
+    while (waitpid(child, NULL, 0) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * @param seeds Starting points, one per seed
+ * @param points Shared copy of the points every worker reads
+ * @param modes Filled with the mode each seed converged to, in seed order
+ * @param iterations Filled with the iterations each seed needed
+ * @param workers Number of worker processes, one per CPU if 0
+ * @param chunk Seeds a worker takes off the queue at a time
+ * Same results as cluster_seeds() on the same points, computed by forked
+ * worker processes. Seeds left undone by a worker that died are run again,
+ * one at a time in order, by a fresh worker forked once every worker has
+ * exited, so the seed it dies on is known. A seed that takes a retry worker
+ * down SEED_RETRIES times is given up on: its mode is left at the seed and
+ * its iterations at -1, and so are the seeds still undone if a retry
+ * worker can't be forked. Returns how many seeds were given up on. If only
+ * some of the workers can be forked, those share all the seeds. Snapping
+ * only sees the modes found by the same worker. options.basin_shortcut,
+ * variable_bandwidth, control and converged stay in the coordinator's
+ * process and are ignored. Throws system_error if no worker can be forked.
+ */
+size_t cluster_processes(Grid &seeds, const SharedPoints &points, Grid &modes,
+                         vector<int> &iterations, const ShiftOptions &options, int workers,
+                         int chunk)
+{
+    long seeds_size = seeds.size();
+    int dimensions = points.view().dimensions;
+    if (workers <= 0)
+        workers = max(1, (int)thread::hardware_concurrency());
+
+    ShiftOptions worker_options = options;
+    worker_options.basin_shortcut = false;
+    worker_options.variable_bandwidth = NULL;
+    worker_options.control = NULL;
+    worker_options.converged = NULL;
+    if (options.deterministic)
+        worker_options.snap_to_modes = false;
+
+    size_t coordinates = seeds_size * dimensions;
+    size_t bytes = sizeof(WorkQueue) + 2 * coordinates * sizeof(double)
+                   + seeds_size * (sizeof(int) + sizeof(char));
+    void *mapping = map_shared_segment("work", bytes);
+    WorkQueue *queue = new (mapping) WorkQueue();
+    queue->next_seed.store(0);
+    queue->seeds = seeds_size;
+    queue->dimensions = dimensions;
+    queue->chunk = max(chunk, 1);
+
+    double *shared_seeds = reinterpret_cast<double *>(queue + 1);
+    for (long s = 0; s < seeds_size; s++)
+        copy(seeds[s].begin(), seeds[s].end(), shared_seeds + s * dimensions);
+    double *shared_modes = shared_seeds + coordinates;
+    int *shared_iterations = reinterpret_cast<int *>(shared_modes + coordinates);
+    char *done = reinterpret_cast<char *>(shared_iterations + seeds_size);
+    memset(done, 0, seeds_size);
+
+    cout.flush();
+    vector<pid_t> children;
+    int fork_error = 0;
+    for (int w = 0; w < workers; w++)
+    {
+        pid_t child = fork();
+        if (child == 0)
+        {
+            run_worker(*queue, points.view(), worker_options);
+            _exit(0);
+        }
+        if (child < 0)
+        {
+            // carry on with the workers there are
+            fork_error = errno;
+            break;
+        }
+        children.push_back(child);
+    }
+    if (children.empty())
+    {
+        queue->~WorkQueue();
+        munmap(mapping, bytes);
+        throw system_error(fork_error, system_category(), "fork");
+    }
+
+    for (pid_t child : children)
+        wait_for(child);
+
+    vector<long> undone;
+    for (long s = 0; s < seeds_size; s++)
+        if (!done[s])
+            undone.push_back(s);
+    vector<int> crashes(undone.size(), 0);
+    worker_options.snap_to_modes = false;
+
+    while (!undone.empty())
+    {
+        vector<long> retry;
+        for (size_t u = 0; u < undone.size(); u++)
+            if (!done[undone[u]] && crashes[u] < SEED_RETRIES)
+                retry.push_back(undone[u]);
+        if (retry.empty())
+            break;
+
+        cout.flush();
+        pid_t child = fork();
+        if (child == 0)
+        {
+            ModeRegistry unused(0);
+            for (long s : retry)
+                run_seed(*queue, s, points.view(), worker_options, unused);
+            _exit(0);
+        }
+        if (child < 0)
+            break;
+        wait_for(child);
+
+        for (size_t u = 0; u < undone.size(); u++)
+        {
+            if (!done[undone[u]] && crashes[u] < SEED_RETRIES)
+            {
+                crashes[u]++;
+                break;
+            }
+        }
+    }
+
+    size_t failed = 0;
+    modes.resize(seeds_size);
+    iterations.resize(seeds_size);
+    for (long s = 0; s < seeds_size; s++)
+    {
+        if (done[s])
+        {
+            modes[s].assign(shared_modes + s * dimensions, shared_modes + (s + 1) * dimensions);
+            iterations[s] = shared_iterations[s];
+        }
+        else
+        {
+            modes[s] = seeds[s];
+            iterations[s] = -1;
+            failed++;
+        }
+    }
+
+    queue->~WorkQueue();
+    munmap(mapping, bytes);
+    return failed;
+}
@@ -0,0 +1,190 @@
+/* 
+ * Author: Kamil S.
+ * Sparse uniform grid used to look up points near a position without
+ * scanning the whole Grid.
+ */
+
+#include "header/spatial_hash.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+SpatialHash::SpatialHash(double cell_size) : cell_size(cell_size), stored(0)
+{
+}
+
+/*
+ * FNV-1a over the cell indices
+ */
+size_t SpatialHash::CellHash::operator()(const Cell &cell) const
+{
+    size_t hash = 14695981039346656037ULL;
+    for (long index : cell)
+    {
+        hash ^= static_cast<size_t>(index);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+SpatialHash::Cell SpatialHash::cell_of(const Coord &point) const
+{
+    Cell cell(point.size());
+    for (size_t p = 0; p < point.size(); p++)
+        cell[p] = static_cast<long>(floor(point[p] / cell_size));
+    return cell;
+}
+
+void SpatialHash::insert(const Coord &point, int value)
+{
+    cells[cell_of(point)].push_back(make_pair(point, value));
+    stored++;
+}
+
+/*
+ * Removes a point inserted with exactly these coordinates and value.
+ * Returns false if there's none.
+ */
+bool SpatialHash::remove(const Coord &point, int value)
+{
+    auto cell = cells.find(cell_of(point));
+    if (cell == cells.end())
+        return false;
+
+    vector<pair<Coord, int>> &entries = cell->second;
+    for (size_t e = 0; e < entries.size(); e++)
+    {
+        if (entries[e].second == value && entries[e].first == point)
+        {
+            entries[e] = entries.back();
+            entries.pop_back();
+            if (entries.empty())
+                cells.erase(cell);
+            stored--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Calls visit(entry, squared_distance) for every stored point inside the
+ * sphere. Only visits the cells overlapping the sphere's bounding box.
+ */
+template <typename Visit>
+void SpatialHash::for_each_within(const Coord &center, double radius, Visit visit) const
+{
+    if (cells.empty())
+        return;
+
+    int dimensions = center.size();
+    long span = static_cast<long>(ceil(radius / cell_size));
+    double radius_squared = radius * radius;
+    Cell first = cell_of(center);
+    Cell cell = first;
+    for (int p = 0; p < dimensions; p++)
+        cell[p] -= span;
+
+    while (true)
+    {
+        auto it = cells.find(cell);
+        if (it != cells.end())
+        {
+            for (const pair<Coord, int> &entry : it->second)
+            {
+                double distance = squared_euclidean_distance(center, entry.first);
+                if (distance <= radius_squared)
+                    visit(entry, distance);
+            }
+        }
+
+        // Odometer over every cell in [first - span, first + span]^dimensions
+        int p = 0;
+        for (; p < dimensions; p++)
+        {
+            if (cell[p] < first[p] + span)
+            {
+                cell[p]++;
+                break;
+            }
+            cell[p] = first[p] - span;
+        }
+        if (p == dimensions)
+            return;
+    }
+}
+
+/*
+ * @param center Center of the search sphere
+ * @param radius Radius of the search sphere
+ * @param value Set to the value of the closest stored point inside the sphere
+ * Returns whether any stored point was inside the sphere.
+ */
+bool SpatialHash::find_within(const Coord &center, double radius, int &value) const
+{
+    double best = numeric_limits<double>::max();
+    for_each_within(center, radius, [&](const pair<Coord, int> &entry, double distance) {
+        if (distance < best)
+        {
+            best = distance;
+            value = entry.second;
+        }
+    });
+
+    return best != numeric_limits<double>::max();
+}
+
+/*
+ * @param center Center of the search sphere
+ * @param radius Radius of the search sphere
+ * @param values Appended with the value of every stored point inside the sphere
+ * @param distances Optional, appended with their squared distances to center
+ */
+void SpatialHash::query(const Coord &center, double radius, vector<int> &values,
+                        vector<double> *distances) const
+{
+    for_each_within(center, radius, [&](const pair<Coord, int> &entry, double distance) {
+        values.push_back(entry.second);
+        if (distances)
+            distances->push_back(distance);
+    });
+}
+
+/*
+ * @param center Point to measure from
+ * @param k Which neighbor, 0 being the closest (center itself if stored)
+ * Returns the distance to the k-th nearest stored point, searching spheres
+ * of doubling radius until one holds more than k points.
+ */
+double SpatialHash::kth_nearest_distance(const Coord &center, size_t k) const
+{
+    if (k >= stored)
+        return numeric_limits<double>::infinity();
+
+    vector<int> found;
+    vector<double> distances;
+    for (double radius = cell_size; ; radius *= 2)
+    {
+        found.clear();
+        distances.clear();
+        query(center, radius, found, &distances);
+        if (distances.size() > k)
+            break;
+    }
+
+    nth_element(distances.begin(), distances.begin() + k, distances.end());
+    return sqrt(distances[k]);
+}
+
+size_t SpatialHash::size() const
+{
+    return stored;
+}
+
+void SpatialHash::clear()
+{
+    cells.clear();
+    stored = 0;
+}
@@ -0,0 +1,382 @@
+/* 
+ * Author: Kamil S.
+ * Reads CSV from streams that may be gzip or zstd compressed, decompressing
+ * one block while the previous one is parsed, with no temporary file.
+ */
+
+#include "header/stream_input.h"
+#include "header/csv.h"
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <zlib.h>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+/*
+ * Compressed bytes read from the stream at a time
+ */
+static const size_t INPUT_BLOCK = 1 << 16;
+
+/*
+ * Decompressed blocks waiting to be parsed, bounding how far decompression
+ * runs ahead of the parser
+ */
+static const size_t PIPELINE_DEPTH = 2;
+
+static const unsigned char GZIP_MAGIC[] = {0x1f, 0x8b};
+static const unsigned char ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+/*
+ * Uncompressed input, first the bytes that were looked at to guess the
+ * format, then the rest of the stream.
+ */
+class RawSource : public BlockSource {
+public:
+    RawSource(istream &stream, const string &peeked) : stream(stream), peeked(peeked), offset(0) {}
+
+    size_t read(char *buffer, size_t size)
+    {
+        size_t copied = min(size, peeked.size() - offset);
+        memcpy(buffer, peeked.data() + offset, copied);
+        offset += copied;
+        if (copied < size)
+        {
+            stream.read(buffer + copied, size - copied);
+            copied += stream.gcount();
+        }
+        return copied;
+    }
+
+private:
+    istream &stream;
+    string peeked;
+    size_t offset;
+};
+
+/*
+ * gzip through zlib, including files made of several concatenated members
+ */
+class GzipSource : public BlockSource {
+public:
+    GzipSource(istream &stream, const string &peeked)
+        : raw(stream, peeked), input(INPUT_BLOCK), at_end(false), in_member(false),
+          finished(false)
+    {
+        memset(&inflater, 0, sizeof(inflater));
+        if (inflateInit2(&inflater, 15 + 16) != Z_OK)
+            throw runtime_error("gzip: can't initialize zlib");
+    }
+
+    ~GzipSource()
+    {
+        inflateEnd(&inflater);
+    }
+
+    /*
+     * Throws runtime_error if the data is corrupt or ends inside a member
+     */
+    size_t read(char *buffer, size_t size)
+    {
+        inflater.next_out = reinterpret_cast<Bytef *>(buffer);
+        inflater.avail_out = size;
+        while (inflater.avail_out > 0 && !finished)
+        {
+            if (inflater.avail_in == 0 && !at_end)
+            {
+                inflater.avail_in = raw.read(input.data(), input.size());
+                inflater.next_in = reinterpret_cast<Bytef *>(input.data());
+                at_end = inflater.avail_in == 0;
+            }
+            if (at_end && !in_member)
+            {
+                finished = true;
+                break;
+            }
+
+            // at the end of the input this only flushes what zlib holds back
+            in_member = true;
+            uInt space = inflater.avail_out;
+            int status = inflate(&inflater, Z_NO_FLUSH);
+            if (status == Z_STREAM_END)
+            {
+                in_member = false;
+                if (inflateReset(&inflater) != Z_OK)
+                    throw runtime_error("gzip: can't start the next member");
+            }
+            else if (status != Z_OK && status != Z_BUF_ERROR)
+                throw runtime_error(string("gzip: ") + (inflater.msg ? inflater.msg : "corrupt data"));
+            else if (at_end && inflater.avail_out == space)
+                throw runtime_error("gzip: unexpected end of data");
+        }
+        return size - inflater.avail_out;
+    }
+
+private:
+    RawSource raw;
+    vector<char> input;
+    z_stream inflater;
+    bool at_end;
+    bool in_member;
+    bool finished;
+};
+
+#ifdef WITH_ZSTD
+class ZstdSource : public BlockSource {
+public:
+    ZstdSource(istream &stream, const string &peeked)
+        : raw(stream, peeked), input(ZSTD_DStreamInSize()), decompressor(ZSTD_createDStream()),
+          at_end(false), frame_complete(false)
+    {
+        if (!decompressor)
+            throw runtime_error("zstd: can't create a decompression stream");
+        size_t status = ZSTD_initDStream(decompressor);
+        if (ZSTD_isError(status))
+        {
+            ZSTD_freeDStream(decompressor);
+            throw runtime_error(string("zstd: ") + ZSTD_getErrorName(status));
+        }
+        in.src = input.data();
+        in.size = in.pos = 0;
+    }
+
+    ~ZstdSource()
+    {
+        ZSTD_freeDStream(decompressor);
+    }
+
+    /*
+     * Throws runtime_error if the data is corrupt or ends inside a frame
+     */
+    size_t read(char *buffer, size_t size)
+    {
+        ZSTD_outBuffer out = {buffer, size, 0};
+        while (out.pos < out.size)
+        {
+            if (in.pos == in.size && !at_end)
+            {
+                in.size = raw.read(input.data(), input.size());
+                in.pos = 0;
+                at_end = in.size == 0;
+            }
+
+            // at the end of the input this only flushes what zstd holds back
+            size_t filled = out.pos, consumed = in.pos;
+            size_t status = ZSTD_decompressStream(decompressor, &out, &in);
+            if (ZSTD_isError(status))
+                throw runtime_error(string("zstd: ") + ZSTD_getErrorName(status));
+            if (out.pos != filled || in.pos != consumed)
+                frame_complete = status == 0;
+            else if (at_end)
+            {
+                if (!frame_complete)
+                    throw runtime_error("zstd: unexpected end of data");
+                break;
+            }
+        }
+        return out.pos;
+    }
+
+private:
+    RawSource raw;
+    vector<char> input;
+    ZSTD_DStream *decompressor;
+    ZSTD_inBuffer in;
+    bool at_end;
+    bool frame_complete;
+};
+#endif
+
+/*
+ * Whether the data starts like a gzip or zstd stream
+ */
+bool is_compressed(const char *data, size_t size)
+{
+    return (size >= 2 && memcmp(data, GZIP_MAGIC, 2) == 0)
+           || (size >= 4 && memcmp(data, ZSTD_MAGIC, 4) == 0);
+}
+
+/*
+ * Guesses the format from the first bytes of the stream: gzip, zstd (when
+ * built WITH_ZSTD) or plain text. Throws runtime_error for zstd data in a
+ * build without zstd.
+ */
+unique_ptr<BlockSource> open_block_source(istream &stream)
+{
+    char magic[4];
+    stream.read(magic, sizeof(magic));
+    string peeked(magic, stream.gcount());
+
+    if (peeked.size() >= 2 && memcmp(peeked.data(), GZIP_MAGIC, 2) == 0)
+        return unique_ptr<BlockSource>(new GzipSource(stream, peeked));
+
+    if (peeked.size() >= 4 && memcmp(peeked.data(), ZSTD_MAGIC, 4) == 0)
+    {
+#ifdef WITH_ZSTD
+        return unique_ptr<BlockSource>(new ZstdSource(stream, peeked));
+#else
+        throw runtime_error("zstd compressed input, but built without zstd");
+#endif
+    }
+
+    return unique_ptr<BlockSource>(new RawSource(stream, peeked));
+}
+
+/*
+ * Bounded queue of blocks between the decompressing thread and the parser.
+ * An empty block marks the end, a failure is handed over to the parser.
+ */
+class BlockPipeline {
+public:
+    BlockPipeline() : stopped(false) {}
+
+    /*
+     * Returns false once the parser has stopped taking blocks
+     */
+    bool push(vector<char> &block)
+    {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this] { return blocks.size() < PIPELINE_DEPTH || stopped; });
+        if (stopped)
+            return false;
+        blocks.push_back(vector<char>());
+        blocks.back().swap(block);
+        changed.notify_all();
+        return true;
+    }
+
+    void pop(vector<char> &block)
+    {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this] { return !blocks.empty(); });
+        block.swap(blocks.front());
+        blocks.pop_front();
+        changed.notify_all();
+        if (block.empty() && failure)
+            rethrow_exception(failure);
+    }
+
+    void fail(exception_ptr error)
+    {
+        lock_guard<mutex> guard(lock);
+        failure = error;
+    }
+
+    /*
+     * Lets a blocked push() return when the parser gave up
+     */
+    void stop()
+    {
+        lock_guard<mutex> guard(lock);
+        stopped = true;
+        changed.notify_all();
+    }
+
+private:
+    mutex lock;
+    condition_variable changed;
+    deque<vector<char>> blocks;
+    exception_ptr failure;
+    bool stopped;
+};
+
+static size_t count_lines(const char *begin, const char *end)
+{
+    size_t lines = 0;
+    while ((begin = static_cast<const char *>(memchr(begin, '\n', end - begin))))
+    {
+        lines++;
+        begin++;
+    }
+    return lines;
+}
+
+/*
+ * @param source Where the CSV text comes from
+ * @param dimensions Values on every line
+ * @param grid The points are appended to it
+ * @param parameters Optional, same as in parse_csv()
+ * @param block_size Bytes decompressed at a time
+ * A thread reads and decompresses blocks while this one parses the ones
+ * already out, so the two overlap and at most PIPELINE_DEPTH blocks wait in
+ * memory. Every block is cut after its last newline and the rest carried
+ * over, so parse_csv() only sees whole lines and can report their numbers.
+ */
+void parse_csv_stream(BlockSource &source, int dimensions, Grid &grid, double *parameters,
+                      size_t block_size)
+{
+    BlockPipeline pipeline;
+    thread reader([&] {
+        try
+        {
+            while (true)
+            {
+                vector<char> block(block_size);
+                block.resize(source.read(block.data(), block.size()));
+                bool last = block.empty();
+                if (!pipeline.push(block) || last)
+                    return;
+            }
+        }
+        catch (...)
+        {
+            pipeline.fail(current_exception());
+            vector<char> end;
+            pipeline.push(end);
+        }
+    });
+
+    try
+    {
+        vector<char> text, block;
+        size_t line = 1;
+        bool parameters_pending = parameters != NULL;
+        do
+        {
+            pipeline.pop(block);
+            text.insert(text.end(), block.begin(), block.end());
+
+            const char *begin = text.data(), *end = begin + text.size();
+            if (!block.empty())
+            {
+                const char *newline = static_cast<const char *>(memrchr(begin, '\n', text.size()));
+                end = newline ? newline + 1 : begin;
+            }
+            if (end == begin)
+                continue;
+
+            bool blank = all_of(begin, end, [](char c) { return isspace((unsigned char)c); });
+            if (parameters_pending && blank && !block.empty())
+            {
+                line += count_lines(begin, end);
+                text.erase(text.begin(), text.begin() + (end - begin));
+                continue;
+            }
+
+            parse_csv(begin, end, dimensions, grid, parameters_pending ? parameters : NULL, 0, line);
+            parameters_pending = false;
+            line += count_lines(begin, end);
+            text.erase(text.begin(), text.begin() + (end - begin));
+        } while (!block.empty());
+
+        if (parameters_pending)
+            throw CsvError(line, "missing AREA_RADIUS and KERNEL_BANDWIDTH");
+    }
+    catch (...)
+    {
+        pipeline.stop();
+        reader.join();
+        throw;
+    }
+
+    reader.join();
+}
@@ -1,13 +1,71 @@
 #include "catch.hpp"
 #include "../header/mean_shift.h"
+#include "../header/variable_bandwidth.h"
+#include "../header/bandwidth_estimation.h"
+#include "../header/engine.h"
+#include "../header/converged_queue.h"
+#include "../header/shared_memory.h"
+#include "../header/distributed.h"
+#include "../header/csv.h"
+#include "../header/binary_format.h"
+#include "../header/out_of_core.h"
+#include "../header/stream_input.h"
+#include "../header/results.h"
+#include "../header/npy.h"
+#include "../header/online.h"
+#include "../header/checkpoint.h"
+#include "../header/shard_reader.h"
+#include "../header/tiled_dataset.h"
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fenv.h>
 #include <fstream>
 #include <map>
+#include <sstream>
+#include <thread>
+#include <zlib.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef MS_VISUAL
 #include "../header/matplotlibcpp.h"
 namespace plt = matplotlibcpp;
 #endif
 
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+/*
+ * A scratch directory for the files a test writes, removed with everything
+ * in it when it goes out of scope
+ */
+class TempDirectory {
+public:
+    TempDirectory()
+    {
+        char name[] = "/tmp/mean_shift_test_XXXXXX";
+        REQUIRE( mkdtemp(name) != NULL );
+        path = name;
+    }
+
+    ~TempDirectory()
+    {
+        nftw(path.c_str(), [](const char *entry, const struct stat *, int, struct FTW *) {
+            return std::remove(entry);
+        }, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    std::string file(const std::string &name) const
+    {
+        return path + "/" + name;
+    }
+
+    std::string path;
+};
 
 bool double_equals(double a, double b, double epsilon = 0.001)
 {
@@ -337,4 +395,2144 @@ TEST_CASE( "Dataset3", "[mean_shift]" )
             }
         }
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE( "Accelerated convergence", "[mean_shift][acceleration]" ) 
+{
+
+    GIVEN("The grid from dataset3") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        Coord test_point;
+        test_point.push_back(2.0);
+        test_point.push_back(2.0);
+
+        int plain_iterations, accelerated_iterations;
+        ShiftOptions options;
+        Coord plain = shift_to_mode(test_point, grid, plain_iterations, options);
+
+        WHEN("Shifting 1 point with over-relaxation")
+        {
+            options.acceleration = ACCEL_OVER_RELAXED;
+            Coord mode = shift_to_mode(test_point, grid, accelerated_iterations, options);
+
+            THEN("It reaches the same mode")
+            {
+                REQUIRE( double_equals(mode[0], plain[0], 0.01) );
+                REQUIRE( double_equals(mode[1], plain[1], 0.01) );
+                REQUIRE( accelerated_iterations < options.max_iterations );
+            }
+        }
+
+        WHEN("Shifting 1 point with Anderson acceleration")
+        {
+            options.acceleration = ACCEL_ANDERSON;
+            Coord mode = shift_to_mode(test_point, grid, accelerated_iterations, options);
+
+            THEN("It reaches the same mode in fewer iterations")
+            {
+                REQUIRE( double_equals(mode[0], 1.07386, 0.01) );
+                REQUIRE( double_equals(mode[1], 0.00609471, 0.01) );
+                REQUIRE( accelerated_iterations <= plain_iterations );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+
+TEST_CASE( "Basin of attraction shortcut", "[mean_shift][basin]" ) 
+{
+
+    GIVEN("The grid from dataset1 seeded from every point") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset1.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        ShiftOptions options;
+        Grid plain_modes, modes;
+        std::vector<int> plain_iterations, iterations;
+        cluster_seeds(grid, grid, plain_modes, plain_iterations, options);
+
+        WHEN("Clustering with the shortcut enabled")
+        {
+            options.basin_shortcut = true;
+            cluster_seeds(grid, grid, modes, iterations, options);
+
+            THEN("Most seeds are skipped and keep their mode")
+            {
+                int plain_total = 0, total = 0, skipped = 0, moved = 0;
+                for (size_t s = 0; s < grid.size(); s++)
+                {
+                    plain_total += plain_iterations[s];
+                    total += iterations[s];
+                    skipped += iterations[s] == 0;
+                    moved += squared_euclidean_distance(plain_modes[s], modes[s]) > 0.01;
+                }
+
+                REQUIRE( skipped > static_cast<int>(grid.size()) / 2 );
+                REQUIRE( total * 2 < plain_total );
+                REQUIRE( moved * 100 <= static_cast<int>(grid.size()) );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+
+TEST_CASE( "Snap to known modes", "[mean_shift][snap]" ) 
+{
+
+    GIVEN("The grid from dataset3 seeded from every point") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        ShiftOptions options;
+        Grid plain_modes, modes;
+        std::vector<int> plain_iterations, iterations;
+        cluster_seeds(grid, grid, plain_modes, plain_iterations, options);
+
+        WHEN("Clustering with snapping enabled")
+        {
+            options.snap_to_modes = true;
+            cluster_seeds(grid, grid, modes, iterations, options);
+
+            THEN("Seeds stop early on the same modes")
+            {
+                int plain_total = 0, total = 0, moved = 0;
+                for (size_t s = 0; s < grid.size(); s++)
+                {
+                    plain_total += plain_iterations[s];
+                    total += iterations[s];
+                    moved += squared_euclidean_distance(plain_modes[s], modes[s]) > 0.01;
+                }
+
+                REQUIRE( total * 2 < plain_total );
+                REQUIRE( moved == 0 );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+
+TEST_CASE( "Variable bandwidth", "[mean_shift][variable_bandwidth]" ) 
+{
+
+    GIVEN("The grid from dataset1") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset1.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        VariableBandwidth variable;
+        compute_point_bandwidths(grid, variable);
+
+        WHEN("Computing the per-point bandwidths")
+        {
+            THEN("There is one bandwidth per point around KERNEL_BANDWIDTH")
+            {
+                REQUIRE( variable.bandwidths.size() == grid.size() );
+                double smallest = *std::min_element(variable.bandwidths.begin(), variable.bandwidths.end());
+                double largest = *std::max_element(variable.bandwidths.begin(), variable.bandwidths.end());
+                REQUIRE( smallest >= 1.5 / 4 );
+                REQUIRE( largest <= 1.5 * 4 );
+                REQUIRE( smallest < largest );
+            }
+        }
+
+        WHEN("Clustering every point with the per-point bandwidths")
+        {
+            ShiftOptions options;
+            options.variable_bandwidth = &variable;
+            Grid modes;
+            std::vector<int> iterations;
+            cluster_seeds(grid, grid, modes, iterations, options);
+
+            THEN("Every seed converges inside the data")
+            {
+                MinMaxData data;
+                get_grid_min_max(data, &grid);
+                for (size_t s = 0; s < grid.size(); s++)
+                {
+                    REQUIRE( iterations[s] < options.max_iterations );
+                    REQUIRE( modes[s][0] >= data.mins[0] );
+                    REQUIRE( modes[s][0] <= data.maxs[0] );
+                }
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+
+TEST_CASE( "Multiscale clustering", "[mean_shift][multiscale]" ) 
+{
+
+    GIVEN("The grid from dataset3") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        Grid seeds, modes;
+        std::vector<int> iterations;
+        for (size_t s = 0; s < grid.size(); s += 50)
+            seeds.push_back(grid[s]);
+
+        Grid plain_modes;
+        std::vector<int> plain_iterations;
+        cluster_seeds(seeds, grid, plain_modes, plain_iterations);
+
+        WHEN("Clustering coarse to fine")
+        {
+            cluster_multiscale(seeds, grid, modes, iterations);
+
+            THEN("Seeds reach the same modes with fewer full-resolution scans")
+            {
+                int moved = 0;
+                long scans = 0, plain_scans = 0;
+                for (size_t s = 0; s < seeds.size(); s++)
+                {
+                    moved += squared_euclidean_distance(plain_modes[s], modes[s]) > 0.01;
+                    scans += iterations[s];
+                    plain_scans += plain_iterations[s];
+                }
+
+                REQUIRE( modes.size() == seeds.size() );
+                REQUIRE( moved <= 1 );
+                REQUIRE( scans < plain_scans );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+
+TEST_CASE( "Bandwidth estimation", "[bandwidth_estimation]" ) 
+{
+
+    GIVEN("The grid from dataset1, whose hand-picked bandwidth is 1.5") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset1.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+        BandwidthEstimate options;
+
+        WHEN("Estimating it from k-NN distances")
+        {
+            double bandwidth = estimate_bandwidth(grid, options);
+
+            THEN("It is close to the hand-picked one")
+            {
+                REQUIRE( bandwidth > 0.75 );
+                REQUIRE( bandwidth < 3.0 );
+            }
+        }
+
+        WHEN("Estimating it from a sample")
+        {
+            options.sample_size = 100;
+            double bandwidth = estimate_bandwidth(grid, options);
+
+            THEN("It is still in the same range")
+            {
+                REQUIRE( bandwidth > 0.75 );
+                REQUIRE( bandwidth < 3.0 );
+            }
+        }
+
+        WHEN("Estimating it with Scott's and Silverman's rules")
+        {
+            options.rule = BANDWIDTH_SCOTT;
+            double scott = estimate_bandwidth(grid, options);
+            options.rule = BANDWIDTH_SILVERMAN;
+            double silverman = estimate_bandwidth(grid, options);
+
+            THEN("Both agree in 2 dimensions")
+            {
+                REQUIRE( scott > 0 );
+                REQUIRE( double_equals(scott, silverman) );
+            }
+        }
+
+        delete &grid;
+    }
+
+    GIVEN("Points on a line, with a constant second column")
+    {
+        Grid grid;
+        for (int i = 0; i < 5000; i++)
+            grid.push_back({i * 0.01, 3.0});
+
+        WHEN("Estimating the bandwidth")
+        {
+            double bandwidth = estimate_bandwidth(grid, BandwidthEstimate());
+
+            THEN("The constant column is left out of the search and it finishes")
+            {
+                REQUIRE( bandwidth > 0 );
+                REQUIRE( bandwidth < 50.0 );
+            }
+        }
+    }
+
+    GIVEN("A CSV without the parameters row")
+    {
+        std::istringstream is("1.0 1.0\n1.1 0.9\n0.9 1.1\n5.0 5.0\n5.1 4.9");
+        Grid &grid = grid_from_file(2, is, false);
+
+        THEN("Every row is read as a point")
+        {
+            REQUIRE( grid.size() == 5 );
+            REQUIRE( double_equals(grid[0][0], 1.0) );
+            REQUIRE( double_equals(grid[4][1], 4.9) );
+        }
+
+        delete &grid;
+    }
+}
+
+
+TEST_CASE( "Parallel mean shift", "[mean_shift][parallel]" ) 
+{
+
+    GIVEN("The grid from dataset2") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset2.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        WHEN("Shifting 1 point with the per-thread reduction")
+        {
+            Coord test_point;
+            test_point.push_back(2.0);
+            test_point.push_back(2.0);
+
+            Coord serial = mean_shift(test_point, grid);
+            Coord parallel = mean_shift_parallel(test_point, grid, 4);
+
+            THEN("It lands where mean_shift does")
+            {
+                REQUIRE( double_equals(parallel[0], serial[0], 1e-9) );
+                REQUIRE( double_equals(parallel[1], serial[1], 1e-9) );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+
+TEST_CASE( "Work-stealing engine", "[engine]" ) 
+{
+
+    GIVEN("An engine with 4 threads") 
+    {
+        Engine engine(4);
+
+        WHEN("Running uneven tasks on its pool")
+        {
+            std::vector<int> visits(1000, 0);
+            ThreadPool pool(4);
+            pool.parallel_for(0, 1000, 1, [&](int begin, int end) {
+                for (int i = begin; i < end; i++)
+                {
+                    volatile double spin = 0;
+                    for (int j = 0; j < i * 100; j++)
+                        spin += j;
+                    visits[i]++;
+                }
+            });
+
+            THEN("Every index is visited exactly once")
+            {
+                REQUIRE( std::count(visits.begin(), visits.end(), 1) == 1000 );
+            }
+        }
+
+        WHEN("Clustering dataset3 twice on the same engine")
+        {
+            std::filebuf fb;
+            REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+            std::istream is(&fb);
+            Grid &grid = grid_from_file(2, is);
+
+            Grid plain_modes, modes, snapped_modes;
+            std::vector<int> plain_iterations, iterations, snapped_iterations;
+            cluster_seeds(grid, grid, plain_modes, plain_iterations);
+            engine.cluster(grid, grid, modes, iterations);
+
+            ShiftOptions options;
+            options.snap_to_modes = true;
+            engine.cluster(grid, grid, snapped_modes, snapped_iterations, options);
+
+            THEN("Both jobs find the modes cluster_seeds does")
+            {
+                int moved = 0, snapped_moved = 0;
+                for (size_t s = 0; s < grid.size(); s++)
+                {
+                    moved += squared_euclidean_distance(plain_modes[s], modes[s]) > 1e-12;
+                    snapped_moved += squared_euclidean_distance(plain_modes[s], snapped_modes[s]) > 0.01;
+                }
+
+                REQUIRE( engine.threads() == 4 );
+                REQUIRE( moved == 0 );
+                REQUIRE( snapped_moved == 0 );
+            }
+
+            delete &grid;
+        }
+    }
+}
+
+
+TEST_CASE( "NUMA-aware engine", "[engine][numa]" ) 
+{
+
+    GIVEN("The machine's NUMA topology") 
+    {
+        NumaTopology topology;
+        detect_numa_topology(topology);
+
+        THEN("There is at least one node with CPUs")
+        {
+            REQUIRE( topology.node_cpus.size() >= 1 );
+            REQUIRE( !topology.node_cpus[0].empty() );
+        }
+
+        WHEN("The node ids have a gap")
+        {
+            TempDirectory sysfs;
+            std::ofstream(sysfs.file("online")) << "0,2-3\n";
+            const char *lists[] = {"0-1", "", "2,5", ""};
+            for (int node : {0, 2, 3})
+            {
+                mkdir(sysfs.file("node" + std::to_string(node)).c_str(), 0700);
+                std::ofstream(sysfs.file("node" + std::to_string(node) + "/cpulist"))
+                    << lists[node] << "\n";
+            }
+            NumaTopology sparse;
+            detect_numa_topology(sparse, sysfs.path);
+
+            THEN("The nodes after it are found, and the ones without CPUs left out")
+            {
+                REQUIRE( sparse.node_cpus.size() == 2 );
+                REQUIRE( sparse.node_cpus[0] == std::vector<int>({0, 1}) );
+                REQUIRE( sparse.node_cpus[1] == std::vector<int>({2, 5}) );
+            }
+        }
+
+        WHEN("Clustering dataset1 on a NUMA-aware engine")
+        {
+            std::filebuf fb;
+            REQUIRE( fb.open("data/dataset1.csv", std::ios::in) );
+            std::istream is(&fb);
+            Grid &grid = grid_from_file(2, is);
+
+            Engine engine(0, true);
+            Grid plain_modes, modes;
+            std::vector<int> plain_iterations, iterations;
+            cluster_seeds(grid, grid, plain_modes, plain_iterations);
+            engine.cluster(grid, grid, modes, iterations);
+
+            THEN("It finds the modes cluster_seeds does")
+            {
+                int moved = 0;
+                for (size_t s = 0; s < grid.size(); s++)
+                    moved += squared_euclidean_distance(plain_modes[s], modes[s]) > 1e-12;
+
+                REQUIRE( moved == 0 );
+            }
+
+            delete &grid;
+        }
+    }
+}
+
+
+/*
+ * The 10x10 grid of test points the Dataset tests shift, as the
+ * resultados*.csv golden files were produced
+ */
+static void golden_test_points(Grid &grid, Grid &test_points_grid)
+{
+    MinMaxData data;
+    get_grid_min_max(data, &grid);
+
+    double ratio_0 = data.maxs[0] / 10.0;
+    double ratio_1 = data.maxs[1] / 10.0;
+    for (double x = data.mins[0]; x < data.maxs[0]; x += ratio_0)
+    {
+        for (double y = data.mins[1]; y < data.maxs[1]; y += ratio_1)
+        {
+            Coord test_point;
+            test_point.push_back(x);
+            test_point.push_back(y);
+            test_points_grid.push_back(test_point);
+        }
+    }
+}
+
+static std::string golden_text(Grid &test_points_grid)
+{
+    std::ostringstream text;
+    for (size_t c = 0; c < test_points_grid.size(); c++)
+        text << (c ? "\n" : "") << test_points_grid[c][0] << " " << test_points_grid[c][1];
+    return text.str();
+}
+
+TEST_CASE( "Deterministic results", "[mean_shift][deterministic]" ) 
+{
+
+    GIVEN("The grid from dataset1 and its golden file") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset1.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        std::ifstream golden_file("resultados1.csv");
+        REQUIRE( golden_file.is_open() );
+        std::stringstream golden;
+        golden << golden_file.rdbuf();
+
+        Grid test_points_grid;
+        golden_test_points(grid, test_points_grid);
+
+        WHEN("Applying the mean_shift algorithm in 100 points over 20 iterations")
+        {
+            for (int z = 0; z < 20; z++)
+                for (auto &coord : test_points_grid)
+                    coord = mean_shift(coord, grid);
+
+            THEN("The output matches resultados1.csv")
+            {
+                REQUIRE( golden_text(test_points_grid) == golden.str() );
+            }
+        }
+
+        WHEN("Applying the deterministic parallel mean shift with 1 to 8 threads")
+        {
+            std::vector<Grid> results;
+            for (int threads = 1; threads <= 8; threads *= 2)
+            {
+                Grid shifted = test_points_grid;
+                for (int z = 0; z < 20; z++)
+                    for (auto &coord : shifted)
+                        coord = mean_shift_parallel(coord, grid, threads, true);
+                results.push_back(shifted);
+            }
+
+            THEN("Every thread count gives the same bits, matching resultados1.csv")
+            {
+                for (size_t r = 1; r < results.size(); r++)
+                    for (size_t c = 0; c < test_points_grid.size(); c++)
+                        REQUIRE( std::memcmp(results[r][c].data(), results[0][c].data(),
+                                             2 * sizeof(double)) == 0 );
+                REQUIRE( golden_text(results[0]) == golden.str() );
+            }
+        }
+
+        WHEN("Clustering with snapping on engines of 1 and 4 threads")
+        {
+            ShiftOptions options;
+            options.snap_to_modes = true;
+            options.deterministic = true;
+
+            Engine single(1), quad(4);
+            Grid single_modes, quad_modes;
+            std::vector<int> single_iterations, quad_iterations;
+            single.cluster(test_points_grid, grid, single_modes, single_iterations, options);
+            quad.cluster(test_points_grid, grid, quad_modes, quad_iterations, options);
+
+            THEN("Both give the same bits")
+            {
+                REQUIRE( single_iterations == quad_iterations );
+                for (size_t c = 0; c < test_points_grid.size(); c++)
+                    REQUIRE( std::memcmp(single_modes[c].data(), quad_modes[c].data(),
+                                         2 * sizeof(double)) == 0 );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Asynchronous jobs", "[engine][async]" ) 
+{
+
+    GIVEN("The grid from dataset3 and an engine with 4 threads") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        Engine engine(4);
+
+        WHEN("Submitting a job with a progress callback")
+        {
+            std::atomic<long> callbacks(0), last_converged(0);
+            ClusterJob job;
+            job.seeds = grid;
+            job.points = &grid;
+            job.progress_every = 100;
+            job.on_progress = [&](const JobProgress &progress) {
+                callbacks++;
+                long seen = last_converged.load();
+                while (progress.seeds_converged > seen &&
+                       !last_converged.compare_exchange_weak(seen, progress.seeds_converged))
+                    ;
+            };
+
+            JobHandle handle = engine.submit(job);
+            const ClusterResult &result = handle.get();
+
+            Grid modes;
+            std::vector<int> iterations;
+            engine.cluster(grid, grid, modes, iterations);
+
+            THEN("It gives the same result as a blocking call, with its progress counted")
+            {
+                REQUIRE( handle.ready() );
+                REQUIRE( !result.cancelled );
+                REQUIRE( result.modes == modes );
+                REQUIRE( result.iterations == iterations );
+
+                JobProgress progress = handle.progress();
+                REQUIRE( progress.seeds_total == (long)grid.size() );
+                REQUIRE( progress.seeds_converged == (long)grid.size() );
+                long total_iterations = 0;
+                for (int i : iterations)
+                    total_iterations += i;
+                REQUIRE( progress.iterations >= total_iterations );
+                REQUIRE( callbacks.load() == (long)grid.size() / 100 );
+                REQUIRE( last_converged.load() == (long)grid.size() );
+            }
+        }
+
+        WHEN("Cancelling a job while another one runs ahead of it")
+        {
+            ClusterJob job;
+            job.seeds = grid;
+            job.points = &grid;
+
+            JobHandle first = engine.submit(job);
+            JobHandle second = engine.submit(job);
+            second.cancel();
+            first.cancel();
+
+            THEN("Both finish, marked as cancelled, and the second never ran")
+            {
+                REQUIRE( first.get().cancelled );
+                REQUIRE( first.get().modes.size() == grid.size() );
+                REQUIRE( second.get().cancelled );
+                REQUIRE( second.get().modes == grid );
+                REQUIRE( second.progress().iterations == 0 );
+            }
+        }
+
+        WHEN("Cancelling a job once it's running")
+        {
+            std::atomic<bool> started(false), cancel_sent(false);
+            ClusterJob job;
+            job.seeds = grid;
+            job.points = &grid;
+            job.progress_every = 1;
+            job.on_progress = [&](const JobProgress &) {
+                if (!started.exchange(true))
+                    while (!cancel_sent.load())
+                        std::this_thread::yield();
+            };
+
+            JobHandle handle = engine.submit(job);
+            while (!started.load())
+                std::this_thread::yield();
+            handle.cancel();
+            cancel_sent = true;
+            const ClusterResult &result = handle.get();
+
+            THEN("The seeds it hadn't reached keep their start and 0 iterations, unreported")
+            {
+                REQUIRE( result.cancelled );
+                long moved = 0, untouched = 0;
+                for (size_t s = 0; s < grid.size(); s++)
+                {
+                    if (result.iterations[s] > 0)
+                        moved++;
+                    else if (result.modes[s] == grid[s])
+                        untouched++;
+                }
+                REQUIRE( untouched > 0 );
+                REQUIRE( handle.progress().seeds_converged <= moved );
+                REQUIRE( handle.progress().seeds_converged < (long)grid.size() );
+            }
+        }
+
+        WHEN("Destroying an engine while its job is running")
+        {
+            std::atomic<bool> started(false), destroying(false);
+            ClusterJob job;
+            job.seeds = grid;
+            job.points = &grid;
+            job.progress_every = 1;
+            job.on_progress = [&](const JobProgress &) {
+                if (started.exchange(true))
+                    return;
+                while (!destroying.load())
+                    std::this_thread::yield();
+                // give the destructor time to cancel before the job goes on
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            };
+
+            Engine *doomed = new Engine(2);
+            JobHandle handle = doomed->submit(job);
+            while (!started.load())
+                std::this_thread::yield();
+            destroying = true;
+            delete doomed;
+
+            THEN("The running job is cancelled before the destructor returns")
+            {
+                REQUIRE( handle.ready() );
+                const ClusterResult &result = handle.get();
+                REQUIRE( result.cancelled );
+                REQUIRE( handle.progress().seeds_converged < (long)grid.size() );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Streaming converged seeds", "[engine][converged_queue]" ) 
+{
+
+    GIVEN("A queue of 8 seeds") 
+    {
+        ConvergedQueue queue(5);
+        ConvergedSeed seed;
+        seed.mode = Coord(2, 0.0);
+
+        THEN("It rounds its capacity up, fills up and empties in order")
+        {
+            REQUIRE( queue.capacity() == 8 );
+            for (int i = 0; i < 8; i++)
+            {
+                seed.index = i;
+                REQUIRE( queue.try_push(seed) );
+            }
+            REQUIRE( !queue.try_push(seed) );
+
+            for (int i = 0; i < 8; i++)
+            {
+                REQUIRE( queue.try_pop(seed) );
+                REQUIRE( seed.index == i );
+            }
+            REQUIRE( !queue.try_pop(seed) );
+        }
+    }
+
+    GIVEN("The grid from dataset3, an engine with 4 threads and a small queue") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        Engine engine(4);
+        ConvergedQueue queue(16);
+
+        WHEN("Draining the queue while a job runs")
+        {
+            ClusterJob job;
+            job.seeds = grid;
+            job.points = &grid;
+            job.options.converged = &queue;
+            JobHandle handle = engine.submit(job);
+
+            std::vector<ConvergedSeed> streamed;
+            ConvergedSeed seed;
+            while (streamed.size() < grid.size())
+            {
+                if (queue.try_pop(seed))
+                    streamed.push_back(seed);
+                else
+                    std::this_thread::yield();
+            }
+            const ClusterResult &result = handle.get();
+
+            THEN("Every seed comes out once with its final mode and iterations")
+            {
+                std::vector<int> seen(grid.size(), 0);
+                for (ConvergedSeed &converged : streamed)
+                {
+                    seen[converged.index]++;
+                    REQUIRE( converged.mode == result.modes[converged.index] );
+                    REQUIRE( converged.iterations == result.iterations[converged.index] );
+                }
+                REQUIRE( std::count(seen.begin(), seen.end(), 1) == (long)grid.size() );
+                REQUIRE( !queue.try_pop(seed) );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Shared-memory worker processes", "[shared_memory]" ) 
+{
+
+    GIVEN("The points of dataset3 in shared memory") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        SharedPoints shared(grid);
+
+        THEN("The shared copy holds the same points")
+        {
+            PointView view = shared.view();
+            REQUIRE( view.size == grid.size() );
+            REQUIRE( view.dimensions == 2 );
+            for (size_t i = 0; i < grid.size(); i++)
+                REQUIRE( std::memcmp(view[i], grid[i].data(), 2 * sizeof(double)) == 0 );
+        }
+
+        WHEN("Clustering in 3 worker processes")
+        {
+            Grid modes, process_modes;
+            std::vector<int> iterations, process_iterations;
+            cluster_seeds(grid, grid, modes, iterations);
+            cluster_processes(grid, shared, process_modes, process_iterations, ShiftOptions(), 3, 7);
+
+            THEN("They give the same results as in-process clustering")
+            {
+                REQUIRE( process_modes == modes );
+                REQUIRE( process_iterations == iterations );
+            }
+        }
+
+        WHEN("A seed takes down every worker that runs it")
+        {
+            Grid seeds(grid.begin(), grid.begin() + 40), modes, process_modes;
+            std::vector<int> iterations, process_iterations;
+            cluster_seeds(seeds, grid, modes, iterations);
+
+            // a NaN seed under trapped invalid operations kills its worker with SIGFPE
+            const long bad_seed = 17;
+            seeds[bad_seed][0] = std::numeric_limits<double>::quiet_NaN();
+            feenableexcept(FE_INVALID);
+            size_t failed = cluster_processes(seeds, shared, process_modes, process_iterations,
+                                              ShiftOptions(), 3, 7);
+            fedisableexcept(FE_INVALID);
+
+            THEN("Only that seed is given up on and the others still converge")
+            {
+                REQUIRE( failed == 1 );
+                REQUIRE( process_iterations[bad_seed] == -1 );
+                for (long s = 0; s < (long)seeds.size(); s++)
+                {
+                    if (s == bad_seed)
+                        continue;
+                    REQUIRE( process_modes[s] == modes[s] );
+                    REQUIRE( process_iterations[s] == iterations[s] );
+                }
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Distributed engine", "[distributed]" ) 
+{
+
+    GIVEN("The grid from dataset3 split in 3 ranks over a loopback network") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        const int ranks = 3;
+        std::vector<Grid> shares(ranks);
+        for (size_t i = 0; i < grid.size(); i++)
+            shares[i * ranks / grid.size()].push_back(grid[i]);
+
+        WHEN("Clustering every rank's points as its seeds")
+        {
+            LoopbackNetwork network(ranks);
+            std::vector<Grid> modes(ranks);
+            std::vector<std::vector<int>> iterations(ranks);
+            std::vector<long> migrations(ranks);
+            std::vector<size_t> halos(ranks);
+            std::vector<std::thread> threads;
+            for (int r = 0; r < ranks; r++)
+            {
+                threads.push_back(std::thread([&, r] {
+                    LoopbackTransport transport(network, r);
+                    DistributedEngine engine(transport);
+                    engine.cluster(shares[r], shares[r], modes[r], iterations[r]);
+                    migrations[r] = engine.migrations();
+                    halos[r] = engine.halo_size();
+                }));
+            }
+            for (std::thread &thread : threads)
+                thread.join();
+
+            Grid expected_modes;
+            std::vector<int> expected_iterations;
+            cluster_seeds(grid, grid, expected_modes, expected_iterations);
+
+            THEN("It gives the same bits as clustering on one node")
+            {
+                Grid gathered_modes;
+                std::vector<int> gathered_iterations;
+                for (int r = 0; r < ranks; r++)
+                {
+                    gathered_modes.insert(gathered_modes.end(), modes[r].begin(), modes[r].end());
+                    gathered_iterations.insert(gathered_iterations.end(),
+                                               iterations[r].begin(), iterations[r].end());
+                }
+                REQUIRE( gathered_modes == expected_modes );
+                REQUIRE( gathered_iterations == expected_iterations );
+            }
+
+            THEN("Ranks hold halos and seeds crossed between them")
+            {
+                for (int r = 0; r < ranks; r++)
+                    REQUIRE( halos[r] > 0 );
+                REQUIRE( migrations[0] + migrations[1] + migrations[2] > 0 );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "CSV loading", "[csv]" ) 
+{
+
+    GIVEN("A small CSV ending with a newline") 
+    {
+        std::istringstream is("0.5 1\n1 2\r\n\n3.5,-4e-1\n");
+        Grid &grid = grid_from_file(2, is);
+
+        THEN("It has no trailing point and the parameters are set")
+        {
+            REQUIRE( grid.size() == 2 );
+            REQUIRE( grid[0] == Coord({1, 2}) );
+            REQUIRE( grid[1] == Coord({3.5, -0.4}) );
+            REQUIRE( AREA_RADIUS == 0.5 );
+            REQUIRE( KERNEL_BANDWIDTH == 1 );
+        }
+
+        delete &grid;
+    }
+
+    GIVEN("A CSV with a malformed line") 
+    {
+        std::istringstream is("0.5 1\n1 2\n3 4 5\n6 x\n");
+
+        THEN("The error has its line number")
+        {
+            size_t line = 0;
+            try
+            {
+                grid_from_file(2, is);
+            }
+            catch (const CsvError &error)
+            {
+                line = error.line();
+            }
+            REQUIRE( line == 3 );
+        }
+    }
+
+    GIVEN("Numbers in many notations") 
+    {
+        const char *numbers[] = {"3.277701E+000", "-8.140820E-001", "0.1", "1e22", "1e23",
+                                 "123456789012345678901234", "4.9e-324", "0.000000000000000000001",
+                                 "2.2250738585072014e-308", "9007199254740993", "-0", "17"};
+
+        THEN("They parse to the same bits as the standard library")
+        {
+            for (const char *number : numbers)
+            {
+                const char *cursor = number;
+                double value;
+                REQUIRE( parse_double(cursor, number + std::strlen(number), value) );
+                double expected = std::strtod(number, NULL);
+                REQUIRE( std::memcmp(&value, &expected, sizeof(double)) == 0 );
+            }
+        }
+    }
+
+    GIVEN("dataset2 read through a stream") 
+    {
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset2.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        WHEN("Mapping it instead")
+        {
+            Grid &mapped = grid_from_path("data/dataset2.csv");
+
+            THEN("Both give the same points")
+            {
+                REQUIRE( mapped.size() == 4096 );
+                REQUIRE( mapped == grid );
+            }
+
+            delete &mapped;
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Binary datasets", "[binary_format]" ) 
+{
+
+    GIVEN("dataset3 written in the binary format") 
+    {
+        TempDirectory scratch;
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+        double radius = AREA_RADIUS, bandwidth = KERNEL_BANDWIDTH;
+
+        write_binary_dataset(scratch.file("dataset3.msds"), grid, radius, bandwidth);
+
+        WHEN("Mapping it back")
+        {
+            BinaryDataset dataset(scratch.file("dataset3.msds"));
+            PointView view = dataset.view();
+            MinMaxData stored, scanned;
+            get_grid_min_max(stored, dataset);
+            get_grid_min_max(scanned, &grid);
+
+            THEN("It holds the same points, bounds and parameters, aligned")
+            {
+                REQUIRE( view.size == grid.size() );
+                REQUIRE( view.dimensions == 2 );
+                REQUIRE( reinterpret_cast<uintptr_t>(view.data) % BINARY_ALIGNMENT == 0 );
+                for (size_t i = 0; i < grid.size(); i++)
+                    REQUIRE( std::memcmp(view[i], grid[i].data(), 2 * sizeof(double)) == 0 );
+                REQUIRE( stored.mins == scanned.mins );
+                REQUIRE( stored.maxs == scanned.maxs );
+
+                AREA_RADIUS = KERNEL_BANDWIDTH = 0;
+                dataset.apply_parameters();
+                REQUIRE( AREA_RADIUS == radius );
+                REQUIRE( KERNEL_BANDWIDTH == bandwidth );
+            }
+
+            THEN("Seeds shifted over the mapped points reach the same modes")
+            {
+                for (size_t s = 0; s < grid.size(); s += 40)
+                {
+                    int grid_iterations, view_iterations;
+                    Coord grid_mode = shift_to_mode(grid[s], grid, grid_iterations);
+                    Coord view_mode = shift_to_mode(grid[s], view, view_iterations);
+                    REQUIRE( grid_mode == view_mode );
+                    REQUIRE( grid_iterations == view_iterations );
+                }
+            }
+        }
+
+        WHEN("Writing it in single precision")
+        {
+            write_binary_dataset(scratch.file("dataset3_float.msds"), grid, radius, bandwidth,
+                                 SCALAR_FLOAT32);
+            BinaryDataset dataset(scratch.file("dataset3_float.msds"));
+            Grid widened;
+            dataset.to_grid(widened);
+
+            THEN("The points come back rounded to floats")
+            {
+                REQUIRE( widened.size() == grid.size() );
+                for (size_t i = 0; i < grid.size(); i++)
+                    for (int d = 0; d < 2; d++)
+                        REQUIRE( widened[i][d] == static_cast<float>(grid[i][d]) );
+            }
+        }
+
+        WHEN("Opening a file that isn't a dataset")
+        {
+            THEN("It's refused")
+            {
+                REQUIRE_THROWS( BinaryDataset("data/dataset3.csv") );
+            }
+        }
+
+        WHEN("Its header claims so many points that their size wraps around")
+        {
+            std::ifstream in(scratch.file("dataset3.msds"), std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            BinaryHeader header;
+            std::memcpy(&header, bytes.data(), sizeof(header));
+            header.count = uint64_t(1) << 60;
+            std::memcpy(&bytes[0], &header, sizeof(header));
+            std::ofstream(scratch.file("dataset3_wrapped.msds"), std::ios::binary) << bytes;
+
+            THEN("It's refused")
+            {
+                REQUIRE_THROWS( BinaryDataset(scratch.file("dataset3_wrapped.msds")) );
+            }
+        }
+
+        WHEN("Its header claims so many dimensions that the bounds' size wraps around")
+        {
+            std::ifstream in(scratch.file("dataset3.msds"), std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            BinaryHeader header;
+            std::memcpy(&header, bytes.data(), sizeof(header));
+            header.dimensions = uint32_t(1) << 31;
+            header.count = 0;
+            std::memcpy(&bytes[0], &header, sizeof(header));
+            std::ofstream(scratch.file("dataset3_wide.msds"), std::ios::binary) << bytes;
+
+            THEN("It's refused")
+            {
+                REQUIRE_THROWS( BinaryDataset(scratch.file("dataset3_wide.msds")) );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Out-of-core engine", "[out_of_core]" ) 
+{
+
+    GIVEN("The points of dataset3 and a memory budget of 4 KB") 
+    {
+        TempDirectory scratch;
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        std::vector<double> flat;
+        for (Coord &point : grid)
+            flat.insert(flat.end(), point.begin(), point.end());
+
+        OutOfCoreOptions options;
+        options.directory = scratch.path;
+        options.memory_budget = 4096;
+
+        WHEN("Clustering it tile by tile")
+        {
+            OutOfCoreEngine engine(PointView(flat.data(), grid.size(), 2), options);
+            Grid modes;
+            std::vector<int> iterations;
+            engine.cluster(ShiftOptions(), &modes, &iterations);
+
+            Grid expected_modes;
+            std::vector<int> expected_iterations;
+            cluster_seeds(grid, grid, expected_modes, expected_iterations);
+
+            THEN("It gives the same bits as clustering in memory")
+            {
+                REQUIRE( engine.tiles() > 2 );
+                REQUIRE( engine.migrations() > 0 );
+                REQUIRE( modes == expected_modes );
+                REQUIRE( iterations == expected_iterations );
+                REQUIRE( engine.largest_tile() > 0 );
+            }
+        }
+
+        WHEN("Two engines share the directory and the first one goes away")
+        {
+            Grid expected_modes;
+            std::vector<int> expected_iterations;
+            cluster_seeds(grid, grid, expected_modes, expected_iterations);
+
+            std::unique_ptr<OutOfCoreEngine> first(
+                new OutOfCoreEngine(PointView(flat.data(), grid.size(), 2), options));
+            std::reverse(flat.begin(), flat.end());
+            OutOfCoreEngine second(PointView(flat.data(), grid.size(), 2), options);
+            std::reverse(flat.begin(), flat.end());
+            second.cluster();
+            Grid modes;
+            std::vector<int> iterations;
+            first->cluster(ShiftOptions(), &modes, &iterations);
+            first.reset();
+
+            THEN("Neither one's tiles are touched by the other")
+            {
+                REQUIRE( modes == expected_modes );
+                REQUIRE( iterations == expected_iterations );
+                REQUIRE_NOTHROW( second.cluster() );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Compressed and streamed input", "[stream_input]" ) 
+{
+
+    GIVEN("dataset2 and a gzip copy of it written in two members") 
+    {
+        TempDirectory scratch;
+        std::ifstream csv("data/dataset2.csv", std::ios::binary);
+        std::stringstream text;
+        text << csv.rdbuf();
+        std::string contents = text.str();
+        size_t half = contents.size() / 2;
+
+        gzFile gz = gzopen(scratch.file("dataset2.csv.gz").c_str(), "wb");
+        REQUIRE( gz != NULL );
+        gzwrite(gz, contents.data(), half);
+        gzclose(gz);
+        gz = gzopen(scratch.file("dataset2.csv.gz").c_str(), "ab");
+        gzwrite(gz, contents.data() + half, contents.size() - half);
+        gzclose(gz);
+
+        std::istringstream plain(contents);
+        Grid &grid = grid_from_file(2, plain);
+
+        WHEN("Loading the gzip file")
+        {
+            Grid &decompressed = grid_from_path(scratch.file("dataset2.csv.gz"));
+
+            THEN("It gives the same points")
+            {
+                REQUIRE( decompressed == grid );
+            }
+
+            delete &decompressed;
+        }
+
+        WHEN("The gzip file is cut short")
+        {
+            std::ifstream gzip(scratch.file("dataset2.csv.gz"), std::ios::binary);
+            std::stringstream compressed;
+            compressed << gzip.rdbuf();
+            std::string whole = compressed.str();
+
+            THEN("Loading it fails instead of giving the points before the cut")
+            {
+                for (size_t cut : {whole.size() / 4, whole.size() - 20, whole.size() - 1})
+                {
+                    std::istringstream stream(whole.substr(0, cut));
+                    std::unique_ptr<BlockSource> source = open_block_source(stream);
+                    Grid blocks;
+                    double parameters[2];
+                    REQUIRE_THROWS_AS( parse_csv_stream(*source, 2, blocks, parameters, 100),
+                                       std::runtime_error );
+                }
+            }
+        }
+
+        WHEN("Parsing it in blocks of 100 bytes")
+        {
+            std::istringstream stream(contents);
+            std::unique_ptr<BlockSource> source = open_block_source(stream);
+            Grid blocks;
+            double parameters[2];
+            parse_csv_stream(*source, 2, blocks, parameters, 100);
+
+            THEN("Lines cut between blocks are put back together")
+            {
+                REQUIRE( blocks == grid );
+                REQUIRE( parameters[0] == AREA_RADIUS );
+                REQUIRE( parameters[1] == KERNEL_BANDWIDTH );
+            }
+        }
+
+        WHEN("A line far into the stream is malformed")
+        {
+            std::string broken = contents;
+            size_t line_start = 0;
+            for (int l = 1; l < 3000; l++)
+                line_start = broken.find('\n', line_start) + 1;
+            broken[line_start] = 'x';
+
+            std::istringstream stream(broken);
+            std::unique_ptr<BlockSource> source = open_block_source(stream);
+            Grid blocks;
+            double parameters[2];
+            size_t line = 0;
+            try
+            {
+                parse_csv_stream(*source, 2, blocks, parameters, 100);
+            }
+            catch (const CsvError &error)
+            {
+                line = error.line();
+            }
+
+            THEN("The error has its line number in the whole stream")
+            {
+                REQUIRE( line == 3000 );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Results writer", "[results]" ) 
+{
+
+    GIVEN("The modes of every point of dataset3, labeled") 
+    {
+        TempDirectory scratch;
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        Grid modes, clusters;
+        std::vector<int> iterations, labels, sizes;
+        cluster_seeds(grid, grid, modes, iterations);
+        label_modes(modes, clusters, labels, sizes);
+
+        THEN("Every seed is in one cluster near its mode")
+        {
+            REQUIRE( clusters.size() > 1 );
+            REQUIRE( clusters.size() < grid.size() / 10 );
+            long total = 0;
+            for (int size : sizes)
+                total += size;
+            REQUIRE( total == (long)grid.size() );
+            for (size_t s = 0; s < modes.size(); s++)
+                REQUIRE( squared_euclidean_distance(modes[s], clusters[labels[s]])
+                         <= 0.25 * KERNEL_BANDWIDTH * KERNEL_BANDWIDTH );
+        }
+
+        THEN("Doubles are formatted short and read back to the same bits")
+        {
+            char buffer[32];
+            REQUIRE( std::string(buffer, format_double(0.1, buffer)) == "0.1" );
+            REQUIRE( std::string(buffer, format_double(-2.5e-300, buffer)) == "-2.5e-300" );
+            REQUIRE( std::string(buffer, format_double(1.0 / 3, buffer)) == "0.3333333333333333" );
+        }
+
+        WHEN("Writing them as CSV in small chunks")
+        {
+            WriteOptions options;
+            options.chunk_rows = 7;
+            options.sync = SYNC_AT_CLOSE;
+            write_seed_results(scratch.file("seeds.csv"), modes, labels, iterations, options);
+            write_cluster_results(scratch.file("clusters.csv"), clusters, sizes, options);
+
+            MappedFile seeds_file(scratch.file("seeds.csv"));
+            MappedFile clusters_file(scratch.file("clusters.csv"));
+            Grid seeds_back, clusters_back;
+            parse_csv(seeds_file.data(), seeds_file.data() + seeds_file.size(), 4, seeds_back);
+            parse_csv(clusters_file.data(), clusters_file.data() + clusters_file.size(), 3,
+                      clusters_back);
+
+            THEN("They read back exactly")
+            {
+                REQUIRE( seeds_back.size() == modes.size() );
+                for (size_t s = 0; s < modes.size(); s++)
+                {
+                    REQUIRE( seeds_back[s][0] == modes[s][0] );
+                    REQUIRE( seeds_back[s][1] == modes[s][1] );
+                    REQUIRE( seeds_back[s][2] == labels[s] );
+                    REQUIRE( seeds_back[s][3] == iterations[s] );
+                }
+                REQUIRE( clusters_back.size() == clusters.size() );
+                for (size_t c = 0; c < clusters.size(); c++)
+                    REQUIRE( clusters_back[c][2] == sizes[c] );
+            }
+        }
+
+        WHEN("Writing them in binary")
+        {
+            WriteOptions options;
+            options.format = RESULTS_BINARY;
+            options.chunk_rows = 7;
+            write_seed_results(scratch.file("seeds.msrs"), modes, labels, iterations, options);
+            MappedFile file(scratch.file("seeds.msrs"));
+
+            THEN("The records follow the header")
+            {
+                ResultsHeader header;
+                std::memcpy(&header, file.data(), sizeof(header));
+                REQUIRE( header.count == modes.size() );
+                REQUIRE( header.dimensions == 2 );
+                size_t record = 2 * sizeof(double) + 2 * sizeof(int32_t);
+                REQUIRE( file.size() == sizeof(header) + modes.size() * record );
+                for (size_t s = 0; s < modes.size(); s++)
+                {
+                    const char *row = file.data() + sizeof(header) + s * record;
+                    int32_t values[2];
+                    std::memcpy(values, row + 2 * sizeof(double), sizeof(values));
+                    REQUIRE( std::memcmp(row, modes[s].data(), 2 * sizeof(double)) == 0 );
+                    REQUIRE( values[0] == labels[s] );
+                    REQUIRE( values[1] == iterations[s] );
+                }
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "NumPy arrays", "[npy]" ) 
+{
+
+    GIVEN("dataset3 saved as .npy and .npz") 
+    {
+        TempDirectory scratch;
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+
+        write_npy(scratch.file("dataset3.npy"), grid);
+        Grid column(grid.size(), Coord(1));
+        for (size_t i = 0; i < grid.size(); i++)
+            column[i][0] = i;
+        std::vector<std::string> names = {"points", "index"};
+        std::vector<Grid *> arrays = {&grid, &column};
+        write_npz(scratch.file("dataset3.npz"), names, arrays);
+        write_npz(scratch.file("dataset3_compressed.npz"), names, arrays, true);
+
+        WHEN("Mapping the .npy back")
+        {
+            NpyArray array(scratch.file("dataset3.npy"));
+            PointView view = array.view();
+            MappedFile file(scratch.file("dataset3.npy"));
+
+            THEN("Its header is the one numpy writes and the points are used in place")
+            {
+                std::string header(file.data() + 10, 118);
+                REQUIRE( std::string(file.data() + 1, 5) == "NUMPY" );
+                REQUIRE( header.find("{'descr': '<f8', 'fortran_order': False, 'shape': (" +
+                                     std::to_string(grid.size()) + ", 2), }") == 0 );
+                REQUIRE( header[header.size() - 1] == '\n' );
+                REQUIRE( array.type() == SCALAR_FLOAT64 );
+                REQUIRE( view.size == grid.size() );
+                REQUIRE( view.dimensions == 2 );
+                REQUIRE( reinterpret_cast<uintptr_t>(view.data) % 64 == 0 );
+                for (size_t i = 0; i < grid.size(); i++)
+                    REQUIRE( std::memcmp(view[i], grid[i].data(), 2 * sizeof(double)) == 0 );
+            }
+        }
+
+        WHEN("Saving it in single precision")
+        {
+            write_npy(scratch.file("dataset3_float.npy"), grid, SCALAR_FLOAT32);
+            NpyArray array(scratch.file("dataset3_float.npy"));
+            Grid widened;
+            array.to_grid(widened);
+
+            THEN("The points come back rounded to floats")
+            {
+                REQUIRE( array.type() == SCALAR_FLOAT32 );
+                REQUIRE( widened.size() == grid.size() );
+                for (size_t i = 0; i < grid.size(); i++)
+                    for (int d = 0; d < 2; d++)
+                        REQUIRE( widened[i][d] == static_cast<float>(grid[i][d]) );
+            }
+        }
+
+        WHEN("Reading the members of the archives")
+        {
+            THEN("Stored and deflated members hold the same arrays")
+            {
+                REQUIRE( npz_members(scratch.file("dataset3.npz")) == names );
+                REQUIRE( npz_members(scratch.file("dataset3_compressed.npz")) == names );
+                for (const std::string &path :
+                     {scratch.file("dataset3.npz"), scratch.file("dataset3_compressed.npz")})
+                {
+                    Grid points, index;
+                    NpyArray(path, "points").to_grid(points);
+                    NpyArray(path, "index.npy").to_grid(index);
+                    REQUIRE( points == grid );
+                    REQUIRE( index == column );
+                    Grid first;
+                    NpyArray(path).to_grid(first);
+                    REQUIRE( first == grid );
+                    REQUIRE_THROWS( NpyArray(path, "missing") );
+                }
+            }
+
+            THEN("Stored members start aligned, whatever their names' lengths")
+            {
+                MappedFile file(scratch.file("dataset3.npz"));
+                size_t at = 0;
+                for (size_t m = 0; m < names.size(); m++)
+                {
+                    uint16_t name_size, extra_size;
+                    uint32_t stored_size;
+                    std::memcpy(&stored_size, file.data() + at + 18, sizeof(stored_size));
+                    std::memcpy(&name_size, file.data() + at + 26, sizeof(name_size));
+                    std::memcpy(&extra_size, file.data() + at + 28, sizeof(extra_size));
+                    at += 30 + name_size + extra_size;
+                    REQUIRE( at % 64 == 0 );
+                    at += stored_size;
+                }
+
+                NpyArray points(scratch.file("dataset3.npz"), "points");
+                NpyArray index(scratch.file("dataset3.npz"), "index");
+                REQUIRE( reinterpret_cast<uintptr_t>(points.view().data) % 64 == 0 );
+                REQUIRE( reinterpret_cast<uintptr_t>(index.view().data) % 64 == 0 );
+            }
+        }
+
+        WHEN("Reading arrays this can't use")
+        {
+            std::string dict = "{'descr': '<i8', 'fortran_order': False, 'shape': (2, 2), }";
+            std::ofstream out(scratch.file("integers.npy"), std::ios::binary);
+            out.write("\x93NUMPY\x01\x00", 8);
+            char length[2] = {(char)dict.size(), 0};
+            out.write(length, 2);
+            out << dict;
+            out.write(std::string(32, '\0').data(), 32);
+            out.close();
+
+            THEN("They're refused")
+            {
+                REQUIRE_THROWS( NpyArray(scratch.file("integers.npy")) );
+                REQUIRE_THROWS( NpyArray("data/dataset3.csv") );
+            }
+        }
+
+        WHEN("Reading arrays whose sizes don't add up")
+        {
+            std::string dict = "{'descr': '<f8', 'fortran_order': False, "
+                               "'shape': (2305843009213693952, 1), }";
+            dict.resize(118, ' ');
+            std::ofstream out(scratch.file("wrapped.npy"), std::ios::binary);
+            out.write("\x93NUMPY\x01\x00", 8);
+            char length[2] = {(char)dict.size(), 0};
+            out.write(length, 2);
+            out << dict;
+            out.write(std::string(32, '\0').data(), 32);
+            out.close();
+
+            // a stored member whose compressed size isn't its size
+            std::ifstream in(scratch.file("dataset3.npz"), std::ios::binary);
+            std::string zip((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            size_t central = zip.find(std::string("PK\x01\x02", 4));
+            REQUIRE( central != std::string::npos );
+            uint32_t size;
+            std::memcpy(&size, &zip[central + 24], sizeof(size));
+            size -= 8;
+            std::memcpy(&zip[central + 20], &size, sizeof(size));
+            std::ofstream(scratch.file("mismatched.npz"), std::ios::binary) << zip;
+
+            // a zip64 locator whose offset wraps around when added to
+            std::ifstream whole(scratch.file("dataset3.npz"), std::ios::binary);
+            std::string wrapped((std::istreambuf_iterator<char>(whole)),
+                                std::istreambuf_iterator<char>());
+            size_t end = wrapped.size() - 22;
+            uint32_t locator = 0x07064b50, directory = 0xFFFFFFFF;
+            uint64_t end64 = ~uint64_t(0) - 7;
+            std::memcpy(&wrapped[end - 20], &locator, sizeof(locator));
+            std::memcpy(&wrapped[end - 12], &end64, sizeof(end64));
+            std::memcpy(&wrapped[end + 16], &directory, sizeof(directory));
+            std::ofstream(scratch.file("wrapped.npz"), std::ios::binary) << wrapped;
+
+            THEN("They're refused")
+            {
+                REQUIRE_THROWS( NpyArray(scratch.file("wrapped.npy")) );
+                REQUIRE_THROWS( NpyArray(scratch.file("mismatched.npz"), "points") );
+                REQUIRE_THROWS( NpyArray(scratch.file("wrapped.npz"), "points") );
+            }
+        }
+
+        WHEN("Writing results as .npy")
+        {
+            Grid modes(grid.begin(), grid.begin() + 50);
+            std::vector<int> labels(50), iterations(50);
+            for (int s = 0; s < 50; s++)
+            {
+                labels[s] = s % 3;
+                iterations[s] = s;
+            }
+            WriteOptions options;
+            options.format = RESULTS_NPY;
+            options.chunk_rows = 7;
+            write_seed_results(scratch.file("seeds.npy"), modes, labels, iterations, options);
+            NpyArray array(scratch.file("seeds.npy"));
+            PointView view = array.view();
+
+            THEN("Every row holds the mode, label and iterations")
+            {
+                REQUIRE( view.size == 50 );
+                REQUIRE( view.dimensions == 4 );
+                for (int s = 0; s < 50; s++)
+                {
+                    REQUIRE( view[s][0] == modes[s][0] );
+                    REQUIRE( view[s][1] == modes[s][1] );
+                    REQUIRE( view[s][2] == labels[s] );
+                    REQUIRE( view[s][3] == iterations[s] );
+                }
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+/*
+ * Runs run_stream() over 'text' fed through a pipe in small writes, and
+ * returns what it wrote
+ */
+static std::string stream_through_pipes(const std::string &text, const StreamOptions &options,
+                                        StreamStats &stats)
+{
+    int input[2], output[2];
+    signal(SIGPIPE, SIG_IGN);
+    REQUIRE( pipe(input) == 0 );
+    REQUIRE( pipe(output) == 0 );
+
+    std::thread producer([&] {
+        for (size_t at = 0; at < text.size(); at += 512)
+        {
+            size_t size = std::min((size_t)512, text.size() - at);
+            if (write(input[1], text.data() + at, size) != (ssize_t)size)
+                break;
+        }
+        close(input[1]);
+    });
+    std::string written;
+    std::thread consumer([&] {
+        char block[4096];
+        ssize_t got;
+        while ((got = read(output[0], block, sizeof(block))) > 0)
+            written.append(block, got);
+    });
+
+    try
+    {
+        stats = run_stream(input[0], output[1], options);
+    }
+    catch (...)
+    {
+        close(input[0]);
+        close(output[1]);
+        producer.join();
+        consumer.join();
+        close(output[0]);
+        throw;
+    }
+    close(input[0]);
+    close(output[1]);
+    producer.join();
+    consumer.join();
+    close(output[0]);
+    return written;
+}
+
+TEST_CASE( "Streaming from a pipe", "[online]" ) 
+{
+
+    GIVEN("dataset3 as text") 
+    {
+        std::ifstream file("data/dataset3.csv");
+        std::stringstream contents;
+        contents << file.rdbuf();
+        std::string text = contents.str();
+        std::istringstream is(text);
+        Grid &grid = grid_from_file(2, is);
+
+        WHEN("Clustering it in batches with an online engine that keeps every point")
+        {
+            OnlineEngine engine(2, grid.size());
+            std::vector<ModeUpdate> updates;
+            std::map<int, size_t> sizes;
+            for (size_t at = 0; at < grid.size(); at += 100)
+            {
+                Grid batch(grid.begin() + at, grid.begin() + std::min(grid.size(), at + 100));
+                engine.add(batch, updates);
+                for (ModeUpdate &update : updates)
+                    sizes[update.label] = update.size;
+            }
+
+            THEN("Every point joined one cluster")
+            {
+                REQUIRE( engine.points() == grid.size() );
+                REQUIRE( engine.clusters() == sizes.size() );
+                REQUIRE( engine.clusters() > 1 );
+                size_t total = 0;
+                for (auto &size : sizes)
+                    total += size.second;
+                REQUIRE( total == grid.size() );
+            }
+        }
+
+        WHEN("The window is smaller than the stream")
+        {
+            OnlineEngine engine(2, 150);
+            std::vector<ModeUpdate> updates;
+            std::map<int, size_t> sizes;
+            size_t expired = 0;
+            for (size_t at = 0; at < grid.size(); at += 100)
+            {
+                engine.add(Grid(grid.begin() + at, grid.begin() + std::min(grid.size(), at + 100)),
+                           updates);
+                for (ModeUpdate &update : updates)
+                {
+                    if (update.size == 0)
+                    {
+                        sizes.erase(update.label);
+                        expired++;
+                    }
+                    else
+                        sizes[update.label] = update.size;
+                }
+            }
+
+            THEN("Only the latest points and their clusters are kept")
+            {
+                REQUIRE( engine.points() == 150 );
+                REQUIRE( engine.clusters() == sizes.size() );
+                size_t total = 0;
+                for (auto &size : sizes)
+                    total += size.second;
+                REQUIRE( total == 150 );
+                REQUIRE( expired > 0 );
+            }
+        }
+
+        WHEN("Streaming it through a pipe with one batch of room between stages")
+        {
+            StreamOptions options;
+            options.batch_size = 16;
+            options.queue_depth = 1;
+            StreamStats stats;
+            std::string output = stream_through_pipes(text, options, stats);
+
+            THEN("Every point is clustered and the last update of every cluster adds up")
+            {
+                REQUIRE( stats.points == grid.size() );
+                REQUIRE( stats.batches >= grid.size() / 16 );
+                REQUIRE( stats.reader_waits > 0 );
+
+                std::istringstream lines(output);
+                std::map<int, size_t> sizes;
+                int label;
+                double x, y;
+                size_t size;
+                while (lines >> label >> x >> y >> size)
+                    sizes[label] = size;
+                REQUIRE( sizes.size() == stats.clusters );
+                size_t total = 0;
+                for (auto &cluster : sizes)
+                    total += cluster.second;
+                REQUIRE( total == grid.size() );
+            }
+        }
+
+        WHEN("A line is malformed")
+        {
+            StreamOptions options;
+            StreamStats stats;
+
+            THEN("The error reaches the caller")
+            {
+                REQUIRE_THROWS_AS( stream_through_pipes(text + "\n1.0 oops\n", options, stats),
+                                   CsvError );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Checkpoint and resume", "[checkpoint]" ) 
+{
+
+    GIVEN("dataset3 and every fourth point as seeds") 
+    {
+        TempDirectory scratch;
+        std::filebuf fb;
+        REQUIRE( fb.open("data/dataset3.csv", std::ios::in) );
+        std::istream is(&fb);
+        Grid &grid = grid_from_file(2, is);
+        std::vector<double> flat;
+        for (Coord &point : grid)
+            flat.insert(flat.end(), point.begin(), point.end());
+        PointView view(flat.data(), grid.size(), 2);
+        Grid seeds;
+        for (size_t i = 0; i < grid.size(); i += 4)
+            seeds.push_back(grid[i]);
+
+        Grid expected_modes;
+        std::vector<int> expected_iterations;
+        cluster_seeds(seeds, grid, expected_modes, expected_iterations);
+
+        CheckpointOptions checkpoint;
+        checkpoint.path = scratch.file("dataset3.checkpoint");
+        checkpoint.dataset = "data/dataset3.csv";
+        checkpoint.every_rounds = 3;
+        std::remove(checkpoint.path.c_str());
+
+        WHEN("Running without interruption")
+        {
+            CheckpointedRun run(seeds, view, checkpoint);
+            Grid modes;
+            std::vector<int> iterations;
+            REQUIRE( run.run(modes, iterations) );
+
+            THEN("It gets cluster_seeds' results and checkpoints on the way")
+            {
+                REQUIRE( modes == expected_modes );
+                REQUIRE( iterations == expected_iterations );
+                REQUIRE( run.checkpoints() >= 1 );
+                REQUIRE( run.active() == 0 );
+            }
+        }
+
+        WHEN("A run is stopped halfway and resumed by another")
+        {
+            JobControl control;
+            control.seeds_total = seeds.size();
+            control.on_progress = [&](const JobProgress &progress) {
+                if (progress.seeds_converged >= (long)seeds.size() / 2)
+                    control.cancelled = true;
+            };
+            ShiftOptions options;
+            options.control = &control;
+            long stopped_at;
+            {
+                CheckpointedRun first(seeds, view, checkpoint, options);
+                Grid modes;
+                std::vector<int> iterations;
+                REQUIRE_FALSE( first.run(modes, iterations) );
+                REQUIRE( first.active() > 0 );
+                REQUIRE( first.active() < seeds.size() );
+                stopped_at = first.rounds();
+            }
+
+            CheckpointedRun second(seeds, view, checkpoint);
+            REQUIRE( second.resume() );
+            REQUIRE( second.rounds() == stopped_at );
+            Grid modes;
+            std::vector<int> iterations;
+            REQUIRE( second.run(modes, iterations) );
+
+            THEN("The results are the same bits as an uninterrupted run's")
+            {
+                REQUIRE( modes == expected_modes );
+                REQUIRE( iterations == expected_iterations );
+            }
+        }
+
+        WHEN("Resuming over other points")
+        {
+            {
+                CheckpointedRun run(seeds, view, checkpoint);
+                Grid modes;
+                std::vector<int> iterations;
+                run.run(modes, iterations);
+            }
+            flat[0] += 1;
+            CheckpointedRun run(seeds, view, checkpoint);
+
+            THEN("The checkpoint is refused")
+            {
+                REQUIRE_THROWS_AS( run.resume(), std::runtime_error );
+            }
+        }
+
+        WHEN("Resuming from a checkpoint cut short")
+        {
+            {
+                CheckpointedRun run(seeds, view, checkpoint);
+                Grid modes;
+                std::vector<int> iterations;
+                run.run(modes, iterations);
+            }
+            std::ifstream in(checkpoint.path, std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            in.close();
+            std::ofstream(checkpoint.path, std::ios::binary) << bytes.substr(0, bytes.size() / 2);
+
+            CheckpointedRun run(seeds, view, checkpoint);
+            REQUIRE_THROWS_AS( run.resume(), std::runtime_error );
+            Grid modes;
+            std::vector<int> iterations;
+            REQUIRE( run.run(modes, iterations) );
+
+            THEN("The run starts over as if it hadn't tried")
+            {
+                REQUIRE( modes == expected_modes );
+                REQUIRE( iterations == expected_iterations );
+            }
+        }
+
+        WHEN("Asking for options checkpointed runs don't support")
+        {
+            ShiftOptions snapping, accelerated;
+            snapping.snap_to_modes = true;
+            accelerated.acceleration = ACCEL_OVER_RELAXED;
+
+            THEN("They're refused")
+            {
+                REQUIRE_THROWS_AS( CheckpointedRun(seeds, view, checkpoint, snapping),
+                                   std::invalid_argument );
+                REQUIRE_THROWS_AS( CheckpointedRun(seeds, view, checkpoint, accelerated),
+                                   std::invalid_argument );
+            }
+        }
+
+        WHEN("There's no checkpoint yet")
+        {
+            CheckpointedRun run(seeds, view, checkpoint);
+
+            THEN("Resuming does nothing")
+            {
+                REQUIRE_FALSE( run.resume() );
+                REQUIRE( run.rounds() == 0 );
+            }
+        }
+
+        delete &grid;
+    }
+}
+
+TEST_CASE( "Sharded input", "[shard_reader]" ) 
+{
+
+    GIVEN("dataset3 split into shards at line boundaries") 
+    {
+        TempDirectory scratch;
+        std::ifstream file("data/dataset3.csv");
+        std::stringstream contents;
+        contents << file.rdbuf();
+        std::string text = contents.str();
+        Grid &whole = grid_from_path("data/dataset3.csv");
+        double radius = AREA_RADIUS, bandwidth = KERNEL_BANDWIDTH;
+
+        std::vector<std::string> paths, pieces;
+        size_t at = 0;
+        for (int s = 0; s < 4; s++)
+        {
+            size_t end = s == 3 ? text.size() : text.find('\n', (s + 1) * text.size() / 4) + 1;
+            pieces.push_back(text.substr(at, end - at));
+            paths.push_back(scratch.file("dataset3.shard" + std::to_string(s)));
+            std::ofstream out(paths.back().c_str(), std::ios::binary);
+            out << pieces.back();
+            at = end;
+        }
+        paths.insert(paths.begin() + 2, scratch.file("empty.shard"));
+        pieces.insert(pieces.begin() + 2, "");
+        std::ofstream(scratch.file("empty.shard")).close();
+
+        for (bool use_uring : {true, false})
+        {
+            WHEN(std::string(use_uring ? "Reading them with io_uring if possible"
+                                       : "Reading them with pread"))
+            {
+                THEN("Every byte of every shard comes through once")
+                {
+                    ShardReader reader(paths, 100, 8, use_uring);
+                    std::vector<std::string> read(paths.size());
+                    for (size_t s = 0; s < paths.size(); s++)
+                        read[s].resize(pieces[s].size());
+                    ShardBlock block;
+                    size_t blocks = 0;
+                    while (reader.next(block))
+                    {
+                        std::memcpy(&read[block.shard][block.offset], block.data, block.size);
+                        REQUIRE( block.last
+                                 == (block.offset + block.size == pieces[block.shard].size()) );
+                        reader.release(block);
+                        blocks++;
+                    }
+                    REQUIRE( read == pieces );
+                    REQUIRE( blocks >= text.size() / 100 );
+                }
+
+                THEN("Parsing them in small blocks gives the whole file's points")
+                {
+                    AREA_RADIUS = KERNEL_BANDWIDTH = 0;
+                    Grid &sharded = grid_from_shards(paths, 2, true, use_uring, 64);
+                    REQUIRE( sharded == whole );
+                    REQUIRE( AREA_RADIUS == radius );
+                    REQUIRE( KERNEL_BANDWIDTH == bandwidth );
+                    delete &sharded;
+                }
+            }
+        }
+
+        WHEN("A shard is missing")
+        {
+            paths.push_back(scratch.file("missing.shard"));
+
+            THEN("It's reported")
+            {
+                REQUIRE_THROWS_AS( grid_from_shards(paths), std::system_error );
+            }
+        }
+
+        delete &whole;
+    }
+}
+
+TEST_CASE( "Tiled datasets", "[tiled_dataset]" ) 
+{
+
+    GIVEN("dataset3 written in small spatial blocks") 
+    {
+        TempDirectory scratch;
+        Grid &grid = grid_from_path("data/dataset3.csv");
+        double radius = AREA_RADIUS, bandwidth = KERNEL_BANDWIDTH;
+
+        write_tiled_dataset(scratch.file("dataset3.mstl"), grid, radius, bandwidth, 32);
+
+        WHEN("Mapping it back")
+        {
+            TiledDataset dataset(scratch.file("dataset3.mstl"));
+            const TiledHeader &header = dataset.header();
+            Grid stored;
+            dataset.to_grid(stored);
+
+            THEN("It holds the same points, in blocks inside their bounding boxes")
+            {
+                REQUIRE( header.count == grid.size() );
+                REQUIRE( header.blocks == (grid.size() + 31) / 32 );
+                Grid sorted_grid = grid, sorted_stored = stored;
+                std::sort(sorted_grid.begin(), sorted_grid.end());
+                std::sort(sorted_stored.begin(), sorted_stored.end());
+                REQUIRE( sorted_stored == sorted_grid );
+
+                std::vector<size_t> blocks;
+                for (size_t b = 0; b < header.blocks; b++)
+                {
+                    PointView points = dataset.block(b);
+                    REQUIRE( reinterpret_cast<uintptr_t>(points.data) % TILED_ALIGNMENT == 0 );
+                    for (size_t i = 0; i < points.size; i++)
+                    {
+                        Coord point(points[i], points[i] + 2);
+                        dataset.blocks_within(point, 0, blocks);
+                        REQUIRE( std::find(blocks.begin(), blocks.end(), b) != blocks.end() );
+                    }
+                }
+
+                AREA_RADIUS = KERNEL_BANDWIDTH = 0;
+                dataset.apply_parameters();
+                REQUIRE( AREA_RADIUS == radius );
+                REQUIRE( KERNEL_BANDWIDTH == bandwidth );
+            }
+
+            THEN("A small region query finds every point in it, reading only some blocks")
+            {
+                double region = radius / 4;
+                for (size_t s = 0; s < grid.size(); s += 97)
+                {
+                    Grid found, expected;
+                    dataset.points_within(grid[s], region, found);
+                    for (Coord &point : grid)
+                        if (squared_euclidean_distance(grid[s], point) <= region * region)
+                            expected.push_back(point);
+                    std::sort(found.begin(), found.end());
+                    std::sort(expected.begin(), expected.end());
+                    REQUIRE( found == expected );
+                }
+                REQUIRE( dataset.blocks_read() < header.blocks * (grid.size() / 97 + 1) / 2 );
+            }
+
+            THEN("Seeds shifted over the blocks they reach match shifting over all the points")
+            {
+                PointView all(NULL, 0, 2);
+                std::vector<double> flat;
+                for (Coord &point : stored)
+                    flat.insert(flat.end(), point.begin(), point.end());
+                all = PointView(flat.data(), stored.size(), 2);
+
+                long steps = 0;
+                for (size_t s = 0; s < grid.size(); s += 40)
+                {
+                    int all_iterations, tiled_iterations;
+                    Coord all_mode = shift_to_mode(grid[s], all, all_iterations);
+                    Coord tiled_mode = dataset.shift_to_mode(grid[s], tiled_iterations);
+                    REQUIRE( tiled_mode == all_mode );
+                    REQUIRE( tiled_iterations == all_iterations );
+                    steps += tiled_iterations;
+                }
+                REQUIRE( dataset.blocks_read() < steps * header.blocks / 2 );
+            }
+        }
+
+        WHEN("Opening a file that isn't a tiled dataset")
+        {
+            THEN("It's refused")
+            {
+                REQUIRE_THROWS( TiledDataset("data/dataset3.csv") );
+                write_binary_dataset(scratch.file("dataset3.msds"), grid, radius, bandwidth);
+                REQUIRE_THROWS( TiledDataset(scratch.file("dataset3.msds")) );
+            }
+        }
+
+        WHEN("Its header claims so many blocks that the index size wraps around")
+        {
+            std::ifstream in(scratch.file("dataset3.mstl"), std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            TiledHeader header;
+            std::memcpy(&header, bytes.data(), sizeof(header));
+            // 48-byte entries in 2 dimensions, adding up to 2^64 + 32 bytes
+            header.blocks = uint64_t(1) << 60;
+            header.blocks /= 3;
+            header.blocks += 1;
+            std::memcpy(&bytes[0], &header, sizeof(header));
+            std::ofstream(scratch.file("dataset3_wrapped.mstl"), std::ios::binary) << bytes;
+
+            THEN("It's refused")
+            {
+                REQUIRE_THROWS( TiledDataset(scratch.file("dataset3_wrapped.mstl")) );
+            }
+        }
+
+        WHEN("Asking for what a tiled dataset doesn't support")
+        {
+            TiledDataset dataset(scratch.file("dataset3.mstl"));
+            ShiftOptions snapping, accelerated;
+            snapping.snap_to_modes = true;
+            accelerated.acceleration = ACCEL_ANDERSON;
+            int iterations;
+
+            THEN("It's refused")
+            {
+                REQUIRE_THROWS_AS( dataset.shift_to_mode(grid[0], iterations, snapping),
+                                   std::invalid_argument );
+                REQUIRE_THROWS_AS( dataset.shift_to_mode(grid[0], iterations, accelerated),
+                                   std::invalid_argument );
+                REQUIRE_THROWS_AS( write_tiled_dataset(scratch.file("empty_blocks.mstl"), grid,
+                                                       radius, bandwidth, 0),
+                                   std::invalid_argument );
+                REQUIRE_THROWS_AS( write_tiled_dataset(scratch.file("huge_blocks.mstl"), grid,
+                                                       radius, bandwidth, size_t(1) << 32),
+                                   std::invalid_argument );
+            }
+        }
+
+        delete &grid;
+    }
+}
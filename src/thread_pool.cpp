@@ -0,0 +1,241 @@
+/* 
+ * Author: Kamil S.
+ * Work-stealing pool the engine runs seed batches on. Seeds converge at very
+ * different rates, so a static split leaves threads idle behind stragglers.
+ */
+
+#include "header/thread_pool.h"
+
+using namespace std;
+
+/*
+ * Node of the pool worker running on this thread, 0 for any other thread
+ */
+static thread_local int worker_node = 0;
+
+/*
+ * One worker per CPU unless asked for a given number
+ */
+static int worker_count(int threads, const NumaTopology *topology)
+{
+    if (threads > 0)
+        return threads;
+
+    if (topology)
+    {
+        int cpus = 0;
+        for (const vector<int> &node : topology->node_cpus)
+            cpus += node.size();
+        return max(1, cpus);
+    }
+
+    return max(1u, thread::hardware_concurrency());
+}
+
+/*
+ * @param threads How many workers to start, one per CPU if 0
+ * @param topology Optional, nodes to spread and pin the workers over
+ */
+ThreadPool::ThreadPool(int threads, const NumaTopology *topology)
+    : workers(worker_count(threads, topology)),
+      node_count(topology ? max<int>(1, topology->node_cpus.size()) : 1),
+      task(NULL), grain(1), remaining(0), queued(0), idle(0), stopping(false)
+{
+    int count = workers.size();
+    for (int w = 0; w < count; w++)
+        workers[w].node = static_cast<long>(w) * node_count / count;
+
+    for (int w = 0; w < count; w++)
+    {
+        vector<int> cpus;
+        if (topology && !topology->node_cpus.empty())
+            cpus = topology->node_cpus[workers[w].node];
+        this->threads.push_back(thread(&ThreadPool::work, this, w, cpus));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(wake_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (thread &worker : threads)
+        worker.join();
+}
+
+int ThreadPool::size() const
+{
+    return workers.size();
+}
+
+int ThreadPool::nodes() const
+{
+    return node_count;
+}
+
+/*
+ * Returns the NUMA node of the calling pool worker, 0 outside the pool
+ */
+int ThreadPool::current_node()
+{
+    return worker_node;
+}
+
+/*
+ * @param begin First index
+ * @param end One past the last index
+ * @param grain Ranges this small aren't split any further
+ * @param task Called as task(range_begin, range_end) on the workers
+ * Blocks until every index in [begin, end) has been handed to task.
+ * The range starts out evenly split over the workers. Jobs from several
+ * threads are run one after another. Rethrows the first exception a task
+ * threw, once the job has finished.
+ */
+void ThreadPool::parallel_for(int begin, int end, int grain, const RangeTask &task)
+{
+    if (begin >= end)
+        return;
+
+    lock_guard<mutex> job(job_lock);
+    this->task = &task;
+    this->grain = max(1, grain);
+    failure = exception_ptr();
+    remaining.store(end - begin);
+
+    int count = workers.size();
+    int chunk = (end - begin + count - 1) / count;
+    for (int w = 0; w < count && begin < end; w++, begin += chunk)
+        push(w, Range(begin, min(end, begin + chunk)));
+
+    unique_lock<mutex> lock(wake_lock);
+    done.wait(lock, [this] { return remaining.load() == 0; });
+    this->task = NULL;
+
+    if (failure)
+        rethrow_exception(failure);
+}
+
+void ThreadPool::push(int index, const Range &range)
+{
+    {
+        lock_guard<mutex> lock(workers[index].lock);
+        workers[index].ranges.push_back(range);
+    }
+    {
+        lock_guard<mutex> lock(wake_lock);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+/*
+ * Takes the newest range from the worker's own deque
+ */
+bool ThreadPool::pop(int index, Range &range)
+{
+    lock_guard<mutex> lock(workers[index].lock);
+    if (workers[index].ranges.empty())
+        return false;
+
+    range = workers[index].ranges.back();
+    workers[index].ranges.pop_back();
+    queued--;
+    return true;
+}
+
+/*
+ * Takes the oldest, and so largest, range from some other worker's deque,
+ * looking at the workers on the same node before the rest
+ */
+bool ThreadPool::steal(int index, Range &range)
+{
+    int count = workers.size();
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int offset = 1; offset < count; offset++)
+        {
+            Worker &victim = workers[(index + offset) % count];
+            if ((victim.node == workers[index].node) != (pass == 0))
+                continue;
+
+            lock_guard<mutex> lock(victim.lock);
+            if (victim.ranges.empty())
+                continue;
+
+            range = victim.ranges.front();
+            victim.ranges.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Runs the range 'grain' indices at a time. Whenever a worker is idle and
+ * nothing is queued for it, the back half of what's left is pushed onto
+ * this worker's deque for it to steal.
+ */
+void ThreadPool::run(int index, Range range)
+{
+    while (range.first < range.second)
+    {
+        if (range.second - range.first > grain && idle.load() > 0 && queued.load() == 0)
+        {
+            int middle = range.first + (range.second - range.first) / 2;
+            push(index, Range(middle, range.second));
+            range.second = middle;
+            continue;
+        }
+
+        int stop = min(range.second, range.first + grain);
+        try
+        {
+            (*task)(range.first, stop);
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock(wake_lock);
+            if (!failure)
+                failure = current_exception();
+        }
+
+        if (remaining.fetch_sub(stop - range.first) == stop - range.first)
+        {
+            lock_guard<mutex> lock(wake_lock);
+            done.notify_all();
+        }
+        range.first = stop;
+    }
+}
+
+/*
+ * @param index Which worker this thread is
+ * @param cpus CPUs of the worker's node, the thread isn't pinned if empty
+ */
+void ThreadPool::work(int index, vector<int> cpus)
+{
+    worker_node = workers[index].node;
+    if (!cpus.empty())
+        pin_current_thread(cpus);
+
+    while (true)
+    {
+        Range range;
+        if (pop(index, range) || steal(index, range))
+        {
+            run(index, range);
+            continue;
+        }
+
+        unique_lock<mutex> lock(wake_lock);
+        idle++;
+        wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+        idle--;
+        if (stopping)
+            return;
+    }
+}
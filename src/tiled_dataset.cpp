@@ -0,0 +1,390 @@
+/*
+ * Author: Kamil S.
+ * Spatially tiled dataset format, for queries over a small region of a
+ * dataset too big to read whole: points are grouped into blocks of nearby
+ * points and only the blocks a query reaches are paged in.
+ */
+
+#include "header/tiled_dataset.h"
+#include "header/job.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <sys/mman.h>
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+/*
+ * Splits rows [begin, end) of 'rows' into blocks of block_points, cutting
+ * at the median of the widest dimension until a range fits in a block (a
+ * k-d tree's leaves). The rows are moved so every range stays contiguous,
+ * which keeps the deeper cuts in cache. Cuts fall on multiples of
+ * block_points, so every block but the last one is full.
+ */
+static void split_blocks(vector<double> &rows, int dimensions, size_t begin, size_t end,
+                         size_t block_points, vector<size_t> &block_ends)
+{
+    if (end - begin <= block_points)
+    {
+        block_ends.push_back(end);
+        return;
+    }
+
+    vector<double> low(dimensions, numeric_limits<double>::max());
+    vector<double> high(dimensions, numeric_limits<double>::lowest());
+    for (size_t i = begin; i < end; i++)
+    {
+        for (int d = 0; d < dimensions; d++)
+        {
+            low[d] = min(low[d], rows[i * dimensions + d]);
+            high[d] = max(high[d], rows[i * dimensions + d]);
+        }
+    }
+    int widest = 0;
+    for (int d = 1; d < dimensions; d++)
+        if (high[d] - low[d] > high[widest] - low[widest])
+            widest = d;
+
+    vector<pair<double, size_t> > keys(end - begin);
+    for (size_t i = begin; i < end; i++)
+        keys[i - begin] = make_pair(rows[i * dimensions + widest], i);
+    size_t blocks = (end - begin + block_points - 1) / block_points;
+    size_t middle = (blocks + 1) / 2 * block_points;
+    nth_element(keys.begin(), keys.begin() + middle, keys.end());
+
+    vector<double> moved((end - begin) * dimensions);
+    for (size_t k = 0; k < keys.size(); k++)
+        copy_n(&rows[keys[k].second * dimensions], dimensions, &moved[k * dimensions]);
+    keys.clear();
+    keys.shrink_to_fit();
+    copy(moved.begin(), moved.end(), rows.begin() + begin * dimensions);
+    moved.clear();
+    moved.shrink_to_fit();
+
+    split_blocks(rows, dimensions, begin, begin + middle, block_points, block_ends);
+    split_blocks(rows, dimensions, begin + middle, end, block_points, block_ends);
+}
+
+/*
+ * @param path File to write, replaced if it exists
+ * @param points Points to store, all with the same number of dimensions
+ * @param area_radius AREA_RADIUS to store with them
+ * @param kernel_bandwidth KERNEL_BANDWIDTH to store with them
+ * @param block_points Points per block. Smaller blocks fit a query's region
+ *                     more tightly but make the index longer, and every
+ *                     block is padded to a TILED_ALIGNMENT boundary.
+ * The points are reordered, a block's points are stored in no particular
+ * order. Throws invalid_argument if block_points is 0 or doesn't fit the
+ * header, system_error if the file can't be written.
+ */
+void write_tiled_dataset(const string &path, Grid &points, double area_radius,
+                         double kernel_bandwidth, size_t block_points)
+{
+    if (block_points == 0 || block_points > numeric_limits<uint32_t>::max())
+        throw invalid_argument("block_points must be between 1 and UINT32_MAX");
+    uint32_t dimensions = points.empty() ? 0 : points[0].size();
+
+    vector<double> rows;
+    rows.reserve(points.size() * dimensions);
+    for (Coord &point : points)
+        rows.insert(rows.end(), point.begin(), point.end());
+    vector<size_t> block_ends;
+    if (!points.empty())
+        split_blocks(rows, dimensions, 0, points.size(), block_points, block_ends);
+
+    TiledHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TILED_MAGIC, sizeof(header.magic));
+    header.version = TILED_VERSION;
+    header.dimensions = dimensions;
+    header.block_points = block_points;
+    header.count = points.size();
+    header.blocks = block_ends.size();
+    header.area_radius = area_radius;
+    header.kernel_bandwidth = kernel_bandwidth;
+    size_t index_end = sizeof(TiledHeader)
+                       + block_ends.size() * (sizeof(TiledBlock) + 2 * dimensions * sizeof(double));
+    header.data_offset = (index_end + TILED_ALIGNMENT - 1) / TILED_ALIGNMENT * TILED_ALIGNMENT;
+
+    vector<TiledBlock> index(block_ends.size());
+    vector<double> boxes(block_ends.size() * 2 * dimensions);
+    uint64_t offset = header.data_offset;
+    size_t begin = 0;
+    for (size_t b = 0; b < block_ends.size(); b++)
+    {
+        index[b].offset = offset;
+        index[b].count = block_ends[b] - begin;
+        double *mins = &boxes[b * 2 * dimensions];
+        double *maxs = mins + dimensions;
+        fill(mins, maxs, numeric_limits<double>::max());
+        fill(maxs, maxs + dimensions, numeric_limits<double>::lowest());
+        for (size_t i = begin; i < block_ends[b]; i++)
+        {
+            for (uint32_t d = 0; d < dimensions; d++)
+            {
+                mins[d] = min(mins[d], rows[i * dimensions + d]);
+                maxs[d] = max(maxs[d], rows[i * dimensions + d]);
+            }
+        }
+
+        size_t block_bytes = index[b].count * dimensions * sizeof(double);
+        offset += (block_bytes + TILED_ALIGNMENT - 1) / TILED_ALIGNMENT * TILED_ALIGNMENT;
+        begin = block_ends[b];
+    }
+
+    ofstream out(path.c_str(), ios::binary | ios::trunc);
+    if (!out)
+        throw system_error(errno, system_category(), "open " + path);
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(TiledBlock));
+    out.write(reinterpret_cast<const char *>(boxes.data()), boxes.size() * sizeof(double));
+    vector<char> padding(TILED_ALIGNMENT, 0);
+    out.write(padding.data(), header.data_offset - index_end);
+
+    begin = 0;
+    for (size_t b = 0; b < block_ends.size(); b++)
+    {
+        size_t block_bytes = index[b].count * dimensions * sizeof(double);
+        size_t block_end = (block_bytes + TILED_ALIGNMENT - 1) / TILED_ALIGNMENT * TILED_ALIGNMENT;
+        out.write(reinterpret_cast<const char *>(&rows[begin * dimensions]), block_bytes);
+        out.write(padding.data(), block_end - block_bytes);
+        begin = block_ends[b];
+    }
+
+    out.flush();
+    if (!out)
+        throw system_error(errno, system_category(), "write " + path);
+}
+
+/*
+ * @param path Dataset written by write_tiled_dataset()
+ */
+TiledDataset::TiledDataset(const string &path) : file(path), index(NULL), boxes(NULL), touched(0)
+{
+    if (file.size() < sizeof(TiledHeader))
+        throw runtime_error(path + ": too short for a dataset header");
+
+    memcpy(&stored, file.data(), sizeof(TiledHeader));
+    if (memcmp(stored.magic, TILED_MAGIC, sizeof(stored.magic)) != 0)
+        throw runtime_error(path + ": not a tiled dataset");
+    if (stored.version != TILED_VERSION)
+        throw runtime_error(path + ": unsupported version " + to_string(stored.version));
+
+    // checked by dividing, blocks * entry could wrap around
+    size_t row = stored.dimensions * sizeof(double);
+    size_t entry = sizeof(TiledBlock) + 2 * row;
+    if (stored.blocks > (file.size() - sizeof(TiledHeader)) / entry)
+        throw runtime_error(path + ": truncated or corrupt dataset");
+    size_t index_end = sizeof(TiledHeader) + stored.blocks * entry;
+    if (stored.data_offset < index_end || stored.data_offset % TILED_ALIGNMENT != 0
+        || file.size() < stored.data_offset || (stored.dimensions == 0 && stored.blocks > 0))
+        throw runtime_error(path + ": truncated or corrupt dataset");
+
+    index = reinterpret_cast<const TiledBlock *>(file.data() + sizeof(TiledHeader));
+    boxes = reinterpret_cast<const double *>(index + stored.blocks);
+    uint64_t count = 0;
+    for (size_t b = 0; b < stored.blocks; b++)
+    {
+        if (index[b].offset < stored.data_offset || index[b].offset % TILED_ALIGNMENT != 0
+            || index[b].offset > file.size()
+            || (file.size() - index[b].offset) / row < index[b].count)
+            throw runtime_error(path + ": truncated or corrupt dataset");
+        count += index[b].count;
+    }
+    if (count != stored.count)
+        throw runtime_error(path + ": truncated or corrupt dataset");
+
+    // a query jumps between blocks, reading ahead would page in the ones it skips
+    if (file.size() > 0)
+        madvise(const_cast<char *>(file.data()), file.size(), MADV_RANDOM);
+}
+
+const TiledHeader &TiledDataset::header() const
+{
+    return stored;
+}
+
+/*
+ * The points of one block, in place
+ */
+PointView TiledDataset::block(size_t index_of_block) const
+{
+    const TiledBlock &entry = index[index_of_block];
+    return PointView(reinterpret_cast<const double *>(file.data() + entry.offset), entry.count,
+                     stored.dimensions);
+}
+
+/*
+ * Sets AREA_RADIUS and KERNEL_BANDWIDTH to the ones stored in the dataset
+ */
+void TiledDataset::apply_parameters() const
+{
+    AREA_RADIUS = stored.area_radius;
+    KERNEL_BANDWIDTH = stored.kernel_bandwidth;
+}
+
+/*
+ * Copies every point into a Grid, block after block. This reads the
+ * whole file.
+ */
+void TiledDataset::to_grid(Grid &grid) const
+{
+    grid.clear();
+    grid.reserve(stored.count);
+    for (size_t b = 0; b < stored.blocks; b++)
+    {
+        PointView points = block(b);
+        for (size_t i = 0; i < points.size; i++)
+            grid.push_back(Coord(points[i], points[i] + points.dimensions));
+    }
+}
+
+/*
+ * @param center Center of the query
+ * @param radius Radius of the query
+ * @param blocks Set to the blocks whose bounding box comes within 'radius'
+ *               of 'center', in file order
+ * Only reads the index. A box's distance is summed the way the mean shift
+ * sums a point's, so it's never more than any of its points' and a block
+ * left out can't hold a point the mean shift would count.
+ */
+void TiledDataset::blocks_within(const Coord &center, double radius, vector<size_t> &blocks) const
+{
+    assert(center.size() == stored.dimensions);
+    double radius_squared = radius * radius;
+    int dimensions = stored.dimensions;
+
+    blocks.clear();
+    for (size_t b = 0; b < stored.blocks; b++)
+    {
+        const double *mins = boxes + b * 2 * dimensions;
+        const double *maxs = mins + dimensions;
+        double distance = 0;
+        for (int p = 0; p < dimensions; p++)
+        {
+            double nearest = min(max(center[p], mins[p]), maxs[p]);
+            double curr_distance = center[p] - nearest;
+            distance += curr_distance * curr_distance;
+        }
+        if (distance <= radius_squared)
+            blocks.push_back(b);
+    }
+}
+
+/*
+ * @param center Center of the query
+ * @param radius Radius of the query
+ * @param points Set to the points within 'radius' of 'center', reading
+ *               only the blocks that can hold them
+ */
+void TiledDataset::points_within(const Coord &center, double radius, Grid &points) const
+{
+    vector<size_t> blocks;
+    blocks_within(center, radius, blocks);
+    touched.fetch_add(blocks.size(), memory_order_relaxed);
+
+    double radius_squared = radius * radius;
+    points.clear();
+    for (size_t b : blocks)
+    {
+        PointView candidates = block(b);
+        for (size_t i = 0; i < candidates.size; i++)
+        {
+            Coord point(candidates[i], candidates[i] + candidates.dimensions);
+            if (squared_euclidean_distance(center, point) <= radius_squared)
+                points.push_back(point);
+        }
+    }
+}
+
+/*
+ * Copies the points of 'blocks' one after another into 'points'
+ */
+void TiledDataset::gather(const vector<size_t> &blocks, vector<double> &points) const
+{
+    touched.fetch_add(blocks.size(), memory_order_relaxed);
+
+    points.clear();
+    for (size_t b : blocks)
+    {
+        PointView block_points = block(b);
+        points.insert(points.end(), block_points.data,
+                      block_points.data + block_points.size * block_points.dimensions);
+    }
+}
+
+/*
+ * @param x Seed from which to start shifting
+ * @param iterations Set to the number of mean shift evaluations it took
+ * @param options Convergence threshold, iteration cap, bandwidth_scale and
+ *                an optional control; acceleration, snapping and variable
+ *                bandwidths aren't supported
+ * @return Returns the mode the seed converged to.
+ * Plain mean shift where every step only reads the blocks that reach the
+ * AREA_RADIUS window around x. The window's points are kept while a step
+ * needs the same blocks as the one before. The points left out are all
+ * outside the window, so the mode and iterations are the same bits as
+ * shift_to_mode() over to_grid()'s points. Safe to call from several
+ * threads at once. Throws invalid_argument for the options it doesn't
+ * support.
+ */
+Coord TiledDataset::shift_to_mode(Coord x, int &iterations, const ShiftOptions &options) const
+{
+    if (options.acceleration != ACCEL_NONE || options.snap_to_modes
+        || options.variable_bandwidth)
+        throw invalid_argument("tiled datasets support neither acceleration, snapping nor "
+                               "variable bandwidths");
+    double epsilon_squared = options.epsilon * options.epsilon;
+    double radius = AREA_RADIUS * options.bandwidth_scale;
+    int dimensions = stored.dimensions;
+
+    vector<size_t> blocks, window_blocks;
+    vector<double> window;
+    Coord shifted;
+    auto shift = [&](Coord &from) {
+        blocks_within(from, radius, blocks);
+        if (blocks != window_blocks)
+        {
+            gather(blocks, window);
+            window_blocks.swap(blocks);
+        }
+        size_t size = window.empty() ? 0 : window.size() / dimensions;
+        shift_point(from, PointView(window.data(), size, dimensions), options, shifted);
+    };
+
+    shift(x);
+    iterations = 1;
+
+    while (iterations < options.max_iterations)
+    {
+        if (options.control && options.control->cancelled.load(memory_order_relaxed))
+            return x;
+
+        if (squared_euclidean_distance(x, shifted) <= epsilon_squared)
+            return shifted;
+
+        x = shifted;
+        shift(x);
+        iterations++;
+    }
+
+    return x;
+}
+
+/*
+ * Blocks read by the queries so far, counting a block once per query or
+ * per mean shift step that had to gather it
+ */
+size_t TiledDataset::blocks_read() const
+{
+    return touched.load(memory_order_relaxed);
+}
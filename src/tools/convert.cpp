@@ -0,0 +1,72 @@
+/* 
+ * Author: Kamil S.
+ * Converts a CSV dataset into the binary format, so later runs map it
+ * instead of parsing it, into the tiled format (.mstl) for queries over a
+ * region of it, or into a .npy array for numpy.
+ * Usage: convert.o input.csv output.msds|output.mstl|output.npy [dimensions] [--float32]
+ *                  [--estimate]
+ *   --float32   store single precision points, half the size (not in .mstl)
+ *   --estimate  the CSV has no AREA_RADIUS/KERNEL_BANDWIDTH row, estimate them
+ */
+
+#include "../header/mean_shift.h"
+#include "../header/binary_format.h"
+#include "../header/npy.h"
+#include "../header/tiled_dataset.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+int main(int argc, char *argv[])
+{
+    const char *paths[2] = {NULL, NULL};
+    int dimensions = 2, positional = 0;
+    ScalarType type = SCALAR_FLOAT64;
+    bool has_parameters = true;
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--float32") == 0)
+            type = SCALAR_FLOAT32;
+        else if (strcmp(argv[a], "--estimate") == 0)
+            has_parameters = false;
+        else if (positional < 2)
+            paths[positional++] = argv[a];
+        else
+            dimensions = atoi(argv[a]);
+    }
+
+    if (positional < 2 || dimensions <= 0)
+    {
+        fprintf(stderr, "Usage: %s input.csv output.msds|output.mstl|output.npy [dimensions]"
+                        " [--float32] [--estimate]\n", argv[0]);
+        return 2;
+    }
+
+    try
+    {
+        Grid &points = grid_from_path(paths[0], dimensions, has_parameters);
+        size_t length = strlen(paths[1]);
+        if (length > 4 && strcmp(paths[1] + length - 4, ".npy") == 0)
+            write_npy(paths[1], points, type);
+        else if (length > 5 && strcmp(paths[1] + length - 5, ".mstl") == 0)
+            write_tiled_dataset(paths[1], points, AREA_RADIUS, KERNEL_BANDWIDTH);
+        else
+            write_binary_dataset(paths[1], points, AREA_RADIUS, KERNEL_BANDWIDTH, type);
+        printf("%zu points, %d dimensions, radius %g, bandwidth %g\n", points.size(), dimensions,
+               AREA_RADIUS, KERNEL_BANDWIDTH);
+        delete &points;
+    }
+    catch (const exception &error)
+    {
+        fprintf(stderr, "%s: %s\n", paths[0], error.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Author: Kamil S.
+ * Clusters points read from stdin as they arrive and writes the clusters
+ * they join to stdout, to sit in a pipeline after whatever produces them.
+ * Usage: stream.o [dimensions] [--batch N] [--window N] [--queue N]
+ *                 [--radius R --bandwidth B]
+ *   --batch      points clustered together, at most (256)
+ *   --window     latest points the density is estimated over (65536)
+ *   --queue      batches buffered between stages (4)
+ *   --radius, --bandwidth  AREA_RADIUS and KERNEL_BANDWIDTH, otherwise
+ *                the first line of input holds them like in the datasets
+ * Every output line is "label x y ... size" for a cluster whose size in the
+ * window changed, a size of 0 meaning the cluster is gone.
+ */
+
+#include "../header/online.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <unistd.h>
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+int main(int argc, char *argv[])
+{
+    StreamOptions options;
+    double radius = 0, bandwidth = 0;
+    bool usage = false;
+    for (int a = 1; a < argc; a++)
+    {
+        bool has_value = a + 1 < argc;
+        if (strcmp(argv[a], "--batch") == 0 && has_value)
+            options.batch_size = atol(argv[++a]);
+        else if (strcmp(argv[a], "--window") == 0 && has_value)
+            options.window = atol(argv[++a]);
+        else if (strcmp(argv[a], "--queue") == 0 && has_value)
+            options.queue_depth = atol(argv[++a]);
+        else if (strcmp(argv[a], "--radius") == 0 && has_value)
+            radius = atof(argv[++a]);
+        else if (strcmp(argv[a], "--bandwidth") == 0 && has_value)
+            bandwidth = atof(argv[++a]);
+        else if (argv[a][0] != '-')
+            options.dimensions = atoi(argv[a]);
+        else
+            usage = true;
+    }
+
+    if (usage || options.dimensions <= 0 || (radius > 0) != (bandwidth > 0))
+    {
+        fprintf(stderr, "Usage: %s [dimensions] [--batch N] [--window N] [--queue N]"
+                        " [--radius R --bandwidth B]\n", argv[0]);
+        return 2;
+    }
+    if (radius > 0)
+    {
+        AREA_RADIUS = radius;
+        KERNEL_BANDWIDTH = bandwidth;
+        options.has_parameters = false;
+    }
+
+    try
+    {
+        StreamStats stats = run_stream(STDIN_FILENO, STDOUT_FILENO, options);
+        fprintf(stderr, "%zu points in %zu batches, %zu clusters, reader waited %zu times\n",
+                stats.points, stats.batches, stats.clusters, stats.reader_waits);
+    }
+    catch (const exception &error)
+    {
+        fprintf(stderr, "stdin: %s\n", error.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+/* 
+ * Author: Kamil S.
+ * In-process transport, so a distributed job can run and be tested on one
+ * machine.
+ */
+
+#include "header/transport.h"
+
+using namespace std;
+
+LoopbackNetwork::LoopbackNetwork(int ranks) : size(ranks), mailboxes(ranks * ranks)
+{
+}
+
+int LoopbackNetwork::ranks() const
+{
+    return size;
+}
+
+void LoopbackNetwork::post(int from, int to, const Message &message)
+{
+    Mailbox &mailbox = mailboxes[to * size + from];
+    {
+        lock_guard<mutex> lock(mailbox.lock);
+        mailbox.messages.push_back(message);
+    }
+    mailbox.arrived.notify_one();
+}
+
+/*
+ * Waits for the next message 'from' sent to 'to'
+ */
+void LoopbackNetwork::collect(int from, int to, Message &message)
+{
+    Mailbox &mailbox = mailboxes[to * size + from];
+    unique_lock<mutex> lock(mailbox.lock);
+    mailbox.arrived.wait(lock, [&mailbox] { return !mailbox.messages.empty(); });
+    message.swap(mailbox.messages.front());
+    mailbox.messages.pop_front();
+}
+
+LoopbackTransport::LoopbackTransport(LoopbackNetwork &network, int rank)
+    : network(network), own_rank(rank)
+{
+}
+
+int LoopbackTransport::rank() const
+{
+    return own_rank;
+}
+
+int LoopbackTransport::ranks() const
+{
+    return network.ranks();
+}
+
+void LoopbackTransport::send(int to, const Message &message)
+{
+    network.post(own_rank, to, message);
+}
+
+void LoopbackTransport::receive(int from, Message &message)
+{
+    network.collect(from, own_rank, message);
+}
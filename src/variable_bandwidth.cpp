@@ -0,0 +1,159 @@
+/* 
+ * Author: Kamil S.
+ * Variable bandwidth mean shift with one bandwidth per data point.
+ * Reference: Comaniciu, Ramesh & Meer, "The Variable Bandwidth Mean Shift
+ * and Data-Driven Scale Selection"
+ */
+
+#include "header/variable_bandwidth.h"
+#include <algorithm>
+
+#ifdef OMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+extern double AREA_RADIUS;
+extern double KERNEL_BANDWIDTH;
+
+/*
+ * Bandwidths are kept within this factor of KERNEL_BANDWIDTH so that
+ * isolated points don't blow up max_radius and duplicates don't get 0.
+ */
+static const double MAX_BANDWIDTH_RATIO = 4.0;
+
+/*
+ * @param points The whole grid
+ * @param variable Filled with one bandwidth per point and an index over points
+ * @param k Which nearest neighbor's distance measures the local density
+ * Sets h_i = KERNEL_BANDWIDTH * d_k(i) / mean(d_k), where d_k(i) is the
+ * distance from point i to its k-th nearest neighbor and the mean is
+ * geometric, so KERNEL_BANDWIDTH stays the typical bandwidth and dense
+ * regions get narrower kernels than sparse ones.
+ * The k-NN searches run in parallel in the OMP build.
+ */
+void compute_point_bandwidths(Grid &points, VariableBandwidth &variable, int k)
+{
+    int points_size = points.size();
+    k = min(k, points_size - 1);
+
+    variable.index = SpatialHash(AREA_RADIUS);
+    for (int i = 0; i < points_size; i++)
+        variable.index.insert(points[i], i);
+
+    Bandwidths knn_distances(points_size, 0.0);
+    if (k < 1)
+    {
+        variable.bandwidths.assign(points_size, KERNEL_BANDWIDTH);
+        variable.max_radius = AREA_RADIUS;
+        return;
+    }
+
+#ifdef OMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for (int i = 0; i < points_size; i++)
+        knn_distances[i] = variable.index.kth_nearest_distance(points[i], k);
+
+    double log_sum = 0;
+    int positive = 0;
+    for (double distance : knn_distances)
+    {
+        if (distance > 0)
+        {
+            log_sum += log(distance);
+            positive++;
+        }
+    }
+    double mean = positive ? exp(log_sum / positive) : 1.0;
+
+    variable.bandwidths.resize(points_size);
+    variable.max_radius = 0;
+    for (int i = 0; i < points_size; i++)
+    {
+        double ratio = knn_distances[i] / mean;
+        ratio = max(1.0 / MAX_BANDWIDTH_RATIO, min(ratio, MAX_BANDWIDTH_RATIO));
+        variable.bandwidths[i] = KERNEL_BANDWIDTH * ratio;
+        variable.max_radius = max(variable.max_radius, AREA_RADIUS * ratio);
+    }
+}
+
+/*
+ * @param center Checks for the neighbors of circle with center 'center'
+ * @param variable Per-point bandwidths and index from compute_point_bandwidths()
+ * @param neighbors Filled with the indices of the neighbors
+ * Every point has its own radius, so the index is queried with the largest
+ * one and the candidates are then checked against their own.
+ */
+void get_neighbors(const Coord &center, const VariableBandwidth &variable,
+                   vector<int> &neighbors)
+{
+    vector<int> candidates;
+    vector<double> distances;
+    variable.index.query(center, variable.max_radius, candidates, &distances);
+
+    for (size_t c = 0; c < candidates.size(); c++)
+    {
+        double radius = AREA_RADIUS * variable.bandwidths[candidates[c]] / KERNEL_BANDWIDTH;
+        if (distances[c] <= radius * radius)
+            neighbors.push_back(candidates[c]);
+    }
+}
+
+/*
+ * @param x Center point from with which to calculate the mean shift
+ * @param points The whole grid
+ * @param variable Per-point bandwidths and index from compute_point_bandwidths()
+ * @param shifted Set to the Coord to where x should shift to
+ * Returns the density at x, see kernel_density().
+ * Each neighbor is weighted by gaussian_kernel with its own bandwidth h_i
+ * and by 1 / h_i^(d + 2), the sample point estimator's normalization.
+ */
+double mean_shift_with_density(Coord &x, Grid &points, const VariableBandwidth &variable,
+                               Coord &shifted)
+{
+    vector<int> neighbors;
+    get_neighbors(x, variable, neighbors);
+
+    int numerator_size = x.size();
+    double edge = gaussian_kernel(AREA_RADIUS * AREA_RADIUS, KERNEL_BANDWIDTH);
+    double denominator = 0, density = 0;
+    shifted.assign(numerator_size, 0.0);
+    if (neighbors.size() == 0)
+        return 0;
+
+    for (int i : neighbors)
+    {
+        Coord &x_i = points[i];
+        double bandwidth = variable.bandwidths[i];
+        double normalization = pow(bandwidth, -numerator_size);
+        double distance = squared_euclidean_distance(x, x_i);
+        double kernel = gaussian_kernel(distance, bandwidth);
+        double weight = normalization * kernel / (bandwidth * bandwidth);
+
+        for (int p = 0; p < numerator_size; p++)
+            shifted[p] += (weight * x_i[p]);
+
+        denominator += weight;
+        density += normalization * (edge - kernel);
+    }
+
+    for (double &num_i : shifted)
+        num_i /= denominator;
+
+    return density;
+}
+
+/*
+ * @param x Center point from with which to calculate the mean shift
+ * @param points The whole grid
+ * @param variable Per-point bandwidths and index from compute_point_bandwidths()
+ * @return Returns the Coord to where x should shift to.
+ */
+Coord mean_shift(Coord x, Grid &points, const VariableBandwidth &variable)
+{
+    Coord shifted;
+    mean_shift_with_density(x, points, variable, shifted);
+    return shifted;
+}